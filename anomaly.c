@@ -0,0 +1,65 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#include <math.h>
+#include "anomaly.h"
+
+int anomaly_check(anomaly_state_t *state, double value, double scores[3]) {
+    int found = 0;
+
+    if (state->samples == 0) {
+        state->mean = value;
+        state->variance = 0;
+        state->last_value = value;
+        state->samples = 1;
+        return 0;
+    }
+
+    // outlier: far from the rolling mean, only once the mean and variance have settled
+    double stddev = sqrt(state->variance);
+    if (stddev < ANOMALY_MIN_STDDEV) stddev = ANOMALY_MIN_STDDEV;
+    double z = (value - state->mean) / stddev;
+    if (state->samples >= ANOMALY_WARMUP && fabs(z) > ANOMALY_Z_LIMIT) {
+        found |= ANOMALY_OUTLIER;
+        scores[0] = z;
+    }
+
+    // stuck: the same value over and over, reported once when the run reaches ANOMALY_STUCK_SAMPLES
+    if (value == state->last_value) {
+        if (++state->repeats == ANOMALY_STUCK_SAMPLES - 1) {
+            found |= ANOMALY_STUCK;
+            scores[1] = ANOMALY_STUCK_SAMPLES;
+        }
+    } else {
+        state->repeats = 0;
+    }
+
+    // step: a sudden jump between two consecutive readings
+    double jump = value - state->last_value;
+    if (fabs(jump) > ANOMALY_STEP_LIMIT) {
+        found |= ANOMALY_STEP;
+        scores[2] = jump;
+    }
+
+    // incremental EWMA mean and variance
+    double delta = value - state->mean;
+    state->mean += ANOMALY_EWMA_ALPHA * delta;
+    state->variance = (1 - ANOMALY_EWMA_ALPHA) * (state->variance + ANOMALY_EWMA_ALPHA * delta * delta);
+    state->last_value = value;
+    if (state->samples < ANOMALY_WARMUP) state->samples++;
+    return found;
+}
+
+const char *anomaly_name(uint8_t kind) {
+    switch (kind) {
+        case ANOMALY_OUTLIER:
+            return "outlier";
+        case ANOMALY_STUCK:
+            return "stuck";
+        case ANOMALY_STEP:
+            return "step";
+        default:
+            return "unknown";
+    }
+}
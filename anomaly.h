@@ -0,0 +1,82 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _ANOMALY_H_
+#define _ANOMALY_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+
+#ifndef ANOMALY_EWMA_ALPHA
+#define ANOMALY_EWMA_ALPHA 0.05     // weight of a new reading in the rolling mean and variance
+#endif
+
+#ifndef ANOMALY_WARMUP
+#define ANOMALY_WARMUP 20           // readings before outliers are flagged, the variance needs them to settle
+#endif
+
+#ifndef ANOMALY_Z_LIMIT
+#define ANOMALY_Z_LIMIT 4.0         // a reading this many standard deviations from the mean is an outlier
+#endif
+
+#ifndef ANOMALY_MIN_STDDEV
+#define ANOMALY_MIN_STDDEV 0.1      // floor of the standard deviation, so a very steady sensor does not flag noise
+#endif
+
+#ifndef ANOMALY_STUCK_SAMPLES
+#define ANOMALY_STUCK_SAMPLES 30    // identical readings in a row before a sensor is flagged as stuck
+#endif
+
+#ifndef ANOMALY_STEP_LIMIT
+#define ANOMALY_STEP_LIMIT 5.0      // degrees between two consecutive readings that count as a sudden step
+#endif
+
+typedef enum {
+    ANOMALY_OUTLIER = 1,
+    ANOMALY_STUCK = 2,
+    ANOMALY_STEP = 4
+} anomaly_kind_t;
+
+/**
+ * per-sensor state of the anomaly checks, zero-initialised means 'no readings yet'
+ */
+typedef struct anomaly_state {
+    double mean;                /**< exponentially weighted mean of the readings */
+    double variance;            /**< exponentially weighted variance of the readings */
+    double last_value;          /**< the previous reading */
+    uint32_t samples;           /**< readings seen, saturates */
+    uint32_t repeats;           /**< readings in a row equal to last_value */
+} anomaly_state_t;
+
+/**
+ * an anomaly as it travels from the datamgr workers to the logger and the database
+ */
+typedef struct anomaly_event {
+    sensor_id_t sensor_id;
+    uint16_t room_id;
+    uint8_t kind;               /**< one anomaly_kind_t */
+    double value;               /**< the reading that was flagged */
+    double score;               /**< z-score for an outlier, repeats for a stuck sensor, the jump for a step */
+    sensor_ts_t ts;             /**< timestamp of the reading */
+} anomaly_event_t;
+
+/**
+ * Feeds a reading into the anomaly checks of one sensor, in O(1) time and memory
+ * The reading is compared with the rolling mean and variance before it is added to them
+ * \param state the sensor's anomaly state
+ * \param value the reading
+ * \param scores filled out with the score of every flagged kind, indexed by kind bit (0 outlier, 1 stuck, 2 step)
+ * \return the anomaly_kind_t bits of the anomalies found, 0 if the reading looks normal
+ */
+int anomaly_check(anomaly_state_t *state, double value, double scores[3]);
+
+/**
+ * Returns a short name for an anomaly kind, for log messages
+ * \param kind one anomaly_kind_t
+ * \return "outlier", "stuck", "step" or "unknown"
+ */
+const char *anomaly_name(uint8_t kind);
+
+#endif  //_ANOMALY_H_
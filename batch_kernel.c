@@ -0,0 +1,58 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#include "batch_kernel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void batch_window_avg(const double *window, int length, int n, const double *min_temp, const double *max_temp,
+                      double *avg, uint8_t *outside) {
+    int i = 0;
+
+#if defined(__AVX2__)
+    const __m256d divisor = _mm256_set1_pd((double) length);
+    for (; i + 4 <= n; i += 4) {
+        __m256d sum = _mm256_loadu_pd(window + i);
+        for (int k = 1; k < length; k++) {
+            sum = _mm256_add_pd(sum, _mm256_loadu_pd(window + k * n + i));
+        }
+        __m256d mean = _mm256_div_pd(sum, divisor);
+        _mm256_storeu_pd(avg + i, mean);
+        int below = _mm256_movemask_pd(_mm256_cmp_pd(mean, _mm256_loadu_pd(min_temp + i), _CMP_LT_OQ));
+        int above = _mm256_movemask_pd(_mm256_cmp_pd(mean, _mm256_loadu_pd(max_temp + i), _CMP_GT_OQ));
+        for (int lane = 0; lane < 4; lane++) {
+            outside[i + lane] = ((below >> lane) & 1) * BATCH_BELOW_MIN | ((above >> lane) & 1) * BATCH_ABOVE_MAX;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128d divisor = _mm_set1_pd((double) length);
+    for (; i + 2 <= n; i += 2) {
+        __m128d sum = _mm_loadu_pd(window + i);
+        for (int k = 1; k < length; k++) {
+            sum = _mm_add_pd(sum, _mm_loadu_pd(window + k * n + i));
+        }
+        __m128d mean = _mm_div_pd(sum, divisor);
+        _mm_storeu_pd(avg + i, mean);
+        int below = _mm_movemask_pd(_mm_cmplt_pd(mean, _mm_loadu_pd(min_temp + i)));
+        int above = _mm_movemask_pd(_mm_cmpgt_pd(mean, _mm_loadu_pd(max_temp + i)));
+        for (int lane = 0; lane < 2; lane++) {
+            outside[i + lane] = ((below >> lane) & 1) * BATCH_BELOW_MIN | ((above >> lane) & 1) * BATCH_ABOVE_MAX;
+        }
+    }
+#endif
+
+    // scalar tail, and the whole batch when there is no SIMD
+    for (; i < n; i++) {
+        double sum = window[i];
+        for (int k = 1; k < length; k++) {
+            sum += window[k * n + i];
+        }
+        avg[i] = sum / length;
+        outside[i] = (avg[i] < min_temp[i]) * BATCH_BELOW_MIN | (avg[i] > max_temp[i]) * BATCH_ABOVE_MAX;
+    }
+}
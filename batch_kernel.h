@@ -0,0 +1,29 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _BATCH_KERNEL_H_
+#define _BATCH_KERNEL_H_
+
+#include <stdint.h>
+
+#define BATCH_BELOW_MIN 1
+#define BATCH_ABOVE_MAX 2
+
+/**
+ * Computes the running average of 'n' sensors at once and checks it against their limits
+ * The windows are passed transposed: 'window' holds 'length' rows of 'n' values, row k holding value k of every sensor
+ * Uses AVX2 or SSE2 when the compiler targets them (e.g. make SIMD_FLAGS=-mavx2), plain C otherwise.
+ * Every path sums the rows in the same order, so they all give the same results
+ * \param window 'length' rows of 'n' window values
+ * \param length the number of values in a window (RUN_AVG_LENGTH)
+ * \param n the number of sensors
+ * \param min_temp the lower limit of every sensor
+ * \param max_temp the upper limit of every sensor
+ * \param avg filled out with the running average of every sensor
+ * \param outside filled out with BATCH_BELOW_MIN and/or BATCH_ABOVE_MAX for every sensor, 0 if the average is in range
+ */
+void batch_window_avg(const double *window, int length, int n, const double *min_temp, const double *max_temp,
+                      double *avg, uint8_t *outside);
+
+#endif  //_BATCH_KERNEL_H_
@@ -0,0 +1,182 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "bqueue.h"
+
+int bqueue_init(bqueue_t **queue, size_t item_size, size_t capacity) {
+    if (queue == NULL || item_size == 0 || capacity == 0) return BQUEUE_FAILURE;
+    *queue = malloc(sizeof(bqueue_t));
+    if (*queue == NULL) return BQUEUE_FAILURE;
+    (*queue)->items = malloc(item_size * capacity);
+    if ((*queue)->items == NULL) {
+        free(*queue);
+        *queue = NULL;
+        return BQUEUE_FAILURE;
+    }
+    (*queue)->item_size = item_size;
+    (*queue)->capacity = capacity;
+    (*queue)->head = 0;
+    (*queue)->count = 0;
+    (*queue)->closed = 0;
+
+    // initialize mutex and condition variables
+    if (pthread_mutex_init(&(*queue)->mutex, NULL) != 0) {
+        return BQUEUE_FAILURE;
+    }
+    if (pthread_cond_init(&(*queue)->not_empty, NULL) != 0) {
+        return BQUEUE_FAILURE;
+    }
+    if (pthread_cond_init(&(*queue)->not_full, NULL) != 0) {
+        return BQUEUE_FAILURE;
+    }
+    return BQUEUE_SUCCESS;
+}
+
+int bqueue_free(bqueue_t **queue) {
+    if ((queue == NULL) || (*queue == NULL)) {
+        return BQUEUE_FAILURE;
+    }
+    if (pthread_mutex_destroy(&(*queue)->mutex) != 0) {
+        return BQUEUE_FAILURE;
+    }
+    pthread_cond_destroy(&(*queue)->not_empty);
+    pthread_cond_destroy(&(*queue)->not_full);
+    free((*queue)->items);
+    free(*queue);
+    *queue = NULL;
+    return BQUEUE_SUCCESS;
+}
+
+// copy 'item' behind the last item, the caller holds the mutex and checked there is room
+static void bqueue_put(bqueue_t *queue, const void *item) {
+    size_t tail = (queue->head + queue->count) % queue->capacity;
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+}
+
+int bqueue_push(bqueue_t *queue, const void *item) {
+    if (queue == NULL || item == NULL) return BQUEUE_FAILURE;
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->capacity && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->mutex);
+        return BQUEUE_CLOSED;
+    }
+    bqueue_put(queue, item);
+    pthread_mutex_unlock(&queue->mutex);
+    return BQUEUE_SUCCESS;
+}
+
+int bqueue_push_batch(bqueue_t *queue, const void *items, size_t n) {
+    size_t done = 0;
+    if (queue == NULL || items == NULL) return BQUEUE_FAILURE;
+    pthread_mutex_lock(&queue->mutex);
+    while (done < n) {
+        while (queue->count == queue->capacity && !queue->closed) {
+            pthread_cond_wait(&queue->not_full, &queue->mutex);
+        }
+        if (queue->closed) {
+            pthread_mutex_unlock(&queue->mutex);
+            return BQUEUE_CLOSED;
+        }
+        // copy as much as fits, at most two memcpy's because the ring can wrap around once
+        while (done < n && queue->count < queue->capacity) {
+            size_t tail = (queue->head + queue->count) % queue->capacity;
+            size_t run = queue->capacity - tail;
+            if (run > queue->capacity - queue->count) run = queue->capacity - queue->count;
+            if (run > n - done) run = n - done;
+            memcpy(queue->items + tail * queue->item_size, (const char *) items + done * queue->item_size,
+                   run * queue->item_size);
+            queue->count += run;
+            done += run;
+        }
+        pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return BQUEUE_SUCCESS;
+}
+
+int bqueue_try_push(bqueue_t *queue, const void *item) {
+    int status = BQUEUE_SUCCESS;
+    if (queue == NULL || item == NULL) return BQUEUE_FAILURE;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->closed) {
+        status = BQUEUE_CLOSED;
+    } else if (queue->count == queue->capacity) {
+        status = BQUEUE_FULL;
+    } else {
+        bqueue_put(queue, item);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return status;
+}
+
+int bqueue_pop_batch(bqueue_t *queue, void *items, size_t max, int timeout_ms) {
+    struct timespec deadline;
+    size_t n = 0;
+    if (queue == NULL || items == NULL || max == 0) return BQUEUE_FAILURE;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && !queue->closed && timeout_ms != 0) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&queue->not_empty, &queue->mutex);
+        } else if (pthread_cond_timedwait(&queue->not_empty, &queue->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (queue->count == 0 && queue->closed) {
+        pthread_mutex_unlock(&queue->mutex);
+        return BQUEUE_CLOSED;
+    }
+
+    // copy the items out, at most two memcpy's because the ring can wrap around once
+    while (n < max && queue->count > 0) {
+        size_t run = queue->capacity - queue->head;
+        if (run > queue->count) run = queue->count;
+        if (run > max - n) run = max - n;
+        memcpy((char *) items + n * queue->item_size, queue->items + queue->head * queue->item_size,
+               run * queue->item_size);
+        queue->head = (queue->head + run) % queue->capacity;
+        queue->count -= run;
+        n += run;
+    }
+    if (n > 0) pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return (int) n;
+}
+
+void bqueue_close(bqueue_t *queue) {
+    if (queue == NULL) return;
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+size_t bqueue_size(bqueue_t *queue) {
+    size_t count;
+    if (queue == NULL) return 0;
+    pthread_mutex_lock(&queue->mutex);
+    count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
@@ -0,0 +1,96 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _BQUEUE_H_
+#define _BQUEUE_H_
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define BQUEUE_CLOSED -2
+#define BQUEUE_FAILURE -1
+#define BQUEUE_SUCCESS 0
+#define BQUEUE_FULL 1
+
+/**
+ * a bounded FIFO of fixed-size items, used to hand work from one thread to another
+ * without unbounded memory growth (unlike the sbuffer, a full queue blocks or rejects the producer)
+ */
+typedef struct bqueue {
+    char *items;                /**< ring storage of 'capacity' items of 'item_size' bytes */
+    size_t item_size;           /**< size of one item in bytes */
+    size_t capacity;            /**< maximum number of items in the queue */
+    size_t head;                /**< index of the oldest item */
+    size_t count;               /**< number of items currently queued */
+    int closed;                 /**< set by bqueue_close(), no more items will be pushed */
+    pthread_mutex_t mutex;      /**< mutex to protect the ring */
+    pthread_cond_t not_empty;   /**< signalled when an item is pushed or the queue is closed */
+    pthread_cond_t not_full;    /**< signalled when items are popped or the queue is closed */
+} bqueue_t;
+
+/**
+ * Allocates and initializes a new bounded queue
+ * \param queue a double pointer to the queue that needs to be initialized
+ * \param item_size the size in bytes of one item
+ * \param capacity the maximum number of items the queue can hold
+ * \return BQUEUE_SUCCESS on success and BQUEUE_FAILURE if an error occurred
+ */
+int bqueue_init(bqueue_t **queue, size_t item_size, size_t capacity);
+
+/**
+ * All allocated resources are freed and cleaned up, items still in the queue are discarded
+ * \param queue a double pointer to the queue that needs to be freed
+ * \return BQUEUE_SUCCESS on success and BQUEUE_FAILURE if an error occurred
+ */
+int bqueue_free(bqueue_t **queue);
+
+/**
+ * Copies 'item' to the tail of 'queue', blocks while the queue is full
+ * \param queue a pointer to the queue that is used
+ * \param item a pointer to the item that will be copied into the queue
+ * \return BQUEUE_SUCCESS on success, BQUEUE_CLOSED if the queue was closed and BQUEUE_FAILURE if an error occurred
+ */
+int bqueue_push(bqueue_t *queue, const void *item);
+
+/**
+ * Copies 'n' items to the tail of 'queue' in order, blocks while the queue is full
+ * \param queue a pointer to the queue that is used
+ * \param items a pointer to the 'n' items that will be copied into the queue
+ * \param n the number of items
+ * \return BQUEUE_SUCCESS on success, BQUEUE_CLOSED if the queue was closed and BQUEUE_FAILURE if an error occurred
+ */
+int bqueue_push_batch(bqueue_t *queue, const void *items, size_t n);
+
+/**
+ * Same as bqueue_push() but never blocks
+ * \return BQUEUE_SUCCESS on success, BQUEUE_FULL if there is no room, BQUEUE_CLOSED if the queue was closed
+ * and BQUEUE_FAILURE if an error occurred
+ */
+int bqueue_try_push(bqueue_t *queue, const void *item);
+
+/**
+ * Removes up to 'max' items from the head of 'queue' and copies them into 'items'
+ * \param queue a pointer to the queue that is used
+ * \param items pre-allocated space for at least 'max' items
+ * \param max the maximum number of items to remove
+ * \param timeout_ms how long to wait for the first item: -1 waits forever, 0 does not wait
+ * \return the number of items removed (0 on timeout), BQUEUE_CLOSED if the queue is closed and drained
+ * and BQUEUE_FAILURE if an error occurred
+ */
+int bqueue_pop_batch(bqueue_t *queue, void *items, size_t max, int timeout_ms);
+
+/**
+ * Closes 'queue': pending pushes fail with BQUEUE_CLOSED and consumers drain the remaining items
+ * \param queue a pointer to the queue that is used
+ */
+void bqueue_close(bqueue_t *queue);
+
+/**
+ * Returns the number of items currently in 'queue'
+ * \param queue a pointer to the queue that is used
+ */
+size_t bqueue_size(bqueue_t *queue);
+
+#endif  //_BQUEUE_H_
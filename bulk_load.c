@@ -0,0 +1,192 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#define _GNU_SOURCE     // needed for mmap and madvise with -std=c11
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bulk_load.h"
+#include "bqueue.h"
+
+#define BULK_LOAD_QUEUE_SIZE 16     // parsed chunks waiting for the writer
+
+// the valid readings of one chunk of the file
+typedef struct bulk_load_chunk {
+    int count;
+    int rejected;
+    sensor_data_t readings[BULK_LOAD_CHUNK];
+} bulk_load_chunk_t;
+
+// the file and the queue, shared by the parser threads
+typedef struct bulk_load_job {
+    const uint8_t *data;
+    size_t records;
+    sensor_ts_t max_ts;         // newest timestamp a valid record can have
+    size_t next;                // first record no parser has claimed yet
+    int running;                // parsers that have not finished
+    pthread_mutex_t mutex;      // protects next and running
+    bqueue_t *queue;            // parsers -> the calling thread
+} bulk_load_job_t;
+
+// milliseconds on the monotonic clock
+static double bulk_load_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// a parser thread: claims chunks of records, validates them and queues the valid readings
+static void *bulk_load_parser(void *arg) {
+    bulk_load_job_t *job = arg;
+    bulk_load_chunk_t chunk;
+    while (1) {
+        pthread_mutex_lock(&job->mutex);
+        size_t first = job->next;
+        size_t last = job->records - first > BULK_LOAD_CHUNK ? first + BULK_LOAD_CHUNK : job->records;
+        job->next = last;
+        pthread_mutex_unlock(&job->mutex);
+        if (first == last) break;
+
+        chunk.count = 0;
+        chunk.rejected = 0;
+        for (size_t i = first; i < last; i++) {
+            const uint8_t *record = job->data + i * BULK_LOAD_RECORD_SIZE;
+            sensor_data_t *reading = &chunk.readings[chunk.count];
+            // the fields are packed, so they are copied instead of read in place
+            memcpy(&reading->id, record, sizeof(sensor_id_t));
+            memcpy(&reading->value, record + sizeof(sensor_id_t), sizeof(sensor_value_t));
+            memcpy(&reading->ts, record + sizeof(sensor_id_t) + sizeof(sensor_value_t), sizeof(sensor_ts_t));
+            if (!isfinite(reading->value) || reading->ts <= 0 || reading->ts > job->max_ts) {
+                chunk.rejected++;
+            } else {
+                chunk.count++;
+            }
+        }
+        if (bqueue_push(job->queue, &chunk) != BQUEUE_SUCCESS) break;
+    }
+    // the last parser to finish lets the writer drain the queue
+    pthread_mutex_lock(&job->mutex);
+    if (--job->running == 0) bqueue_close(job->queue);
+    pthread_mutex_unlock(&job->mutex);
+    return NULL;
+}
+
+// commits the readings of the open transaction, which are lost if the commit fails
+static int bulk_load_commit(DBCONN *conn, unsigned long *pending, bulk_load_stats_t *result) {
+    int rc = commit_transaction(conn);
+    if (rc == SQLITE_OK) {
+        result->loaded += *pending;
+    } else {
+        result->failed += *pending;
+    }
+    *pending = 0;
+    return rc;
+}
+
+int bulk_load(DBCONN *conn, const char *path, const bulk_load_options_t *options, bulk_load_stats_t *stats) {
+    bulk_load_options_t opts = {0};
+    bulk_load_stats_t result;
+    struct stat st;
+    double start = bulk_load_now_ms();
+
+    if (options != NULL) opts = *options;
+    if (opts.threads <= 0) opts.threads = BULK_LOAD_THREADS;
+    if (opts.commit_rows <= 0) opts.commit_rows = BULK_LOAD_COMMIT_ROWS;
+    memset(&result, 0, sizeof(result));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        log_event("Bulk load of %s failed: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        if (stats != NULL) *stats = result;
+        return SQLITE_CANTOPEN;
+    }
+    result.records = st.st_size / BULK_LOAD_RECORD_SIZE;
+    result.trailing_bytes = st.st_size % BULK_LOAD_RECORD_SIZE;
+    void *data = NULL;
+    if (result.records > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            log_event("Bulk load of %s failed: %s\n", path, strerror(errno));
+            close(fd);
+            if (stats != NULL) *stats = result;
+            return SQLITE_IOERR;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);   // read ahead, every page is read once
+    }
+    close(fd);  // the mapping keeps the file open
+
+    bulk_load_job_t job = {
+            .data = data,
+            .records = result.records,
+            .max_ts = time(NULL) + BULK_LOAD_FUTURE_SECONDS,
+            .next = 0,
+            .running = opts.threads,
+    };
+    pthread_mutex_init(&job.mutex, NULL);
+    ERROR_HANDLER(bqueue_init(&job.queue, sizeof(bulk_load_chunk_t), BULK_LOAD_QUEUE_SIZE) != BQUEUE_SUCCESS,
+                  "bqueue_init() error");
+    pthread_t *parsers = malloc(opts.threads * sizeof(pthread_t));
+    bulk_load_chunk_t *chunk = malloc(sizeof(bulk_load_chunk_t));
+    ERROR_HANDLER(parsers == NULL || chunk == NULL, "malloc() error");
+    for (int i = 0; i < opts.threads; i++) {
+        ERROR_HANDLER(pthread_create(&parsers[i], NULL, bulk_load_parser, &job) != 0, "pthread_create() error");
+    }
+
+    // the writer: SQLite takes one writer at a time, so the calling thread inserts while the parsers read ahead
+    int rc = SQLITE_OK;
+    unsigned long pending = 0;  // readings in the open transaction
+    if (opts.defer_index) set_index_deferral(conn, 1);
+    while (bqueue_pop_batch(job.queue, chunk, 1, -1) == 1) {
+        result.rejected += chunk->rejected;
+        if (chunk->count == 0) continue;
+        int err = begin_transaction(conn);
+        if (err != SQLITE_OK) {
+            result.failed += chunk->count;
+            if (rc == SQLITE_OK) rc = err;
+            continue;
+        }
+        for (int i = 0; i < chunk->count; i++) {
+            sensor_data_t *reading = &chunk->readings[i];
+            if (insert_sensor(conn, reading->id, reading->value, reading->ts) != 0) {
+                result.failed++;
+            } else {
+                pending++;
+            }
+        }
+        if (pending >= (unsigned long) opts.commit_rows) {
+            err = bulk_load_commit(conn, &pending, &result);
+            if (rc == SQLITE_OK) rc = err;
+        }
+    }
+    int err = bulk_load_commit(conn, &pending, &result);
+    if (rc == SQLITE_OK) rc = err;
+    if (opts.defer_index) {
+        err = set_index_deferral(conn, 0);
+        if (rc == SQLITE_OK) rc = err;
+    }
+
+    for (int i = 0; i < opts.threads; i++) {
+        pthread_join(parsers[i], NULL);
+    }
+    free(chunk);
+    free(parsers);
+    bqueue_free(&job.queue);
+    pthread_mutex_destroy(&job.mutex);
+    if (data != NULL) munmap(data, st.st_size);
+
+    result.seconds = (bulk_load_now_ms() - start) / 1e3;
+    log_event("Bulk load of %s: %lu of %lu records loaded, %lu rejected, %lu failed, %zu trailing bytes, %.2f s\n",
+              path, result.loaded, result.records, result.rejected, result.failed, result.trailing_bytes,
+              result.seconds);
+    if (stats != NULL) *stats = result;
+    return rc;
+}
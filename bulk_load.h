@@ -0,0 +1,65 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _BULK_LOAD_H_
+#define _BULK_LOAD_H_
+
+#include "config.h"
+#include "sensor_db.h"
+
+#ifndef BULK_LOAD_THREADS
+#define BULK_LOAD_THREADS 4             // parser threads of a bulk load
+#endif
+
+#ifndef BULK_LOAD_COMMIT_ROWS
+#define BULK_LOAD_COMMIT_ROWS 100000    // readings per transaction of a bulk load
+#endif
+
+#ifndef BULK_LOAD_CHUNK
+#define BULK_LOAD_CHUNK 1024            // records a parser thread validates and hands to the writer at once
+#endif
+
+#ifndef BULK_LOAD_FUTURE_SECONDS
+#define BULK_LOAD_FUTURE_SECONDS 86400  // records more than this far after the time of the load are rejected
+#endif
+
+// a record of the sensor_data file of file_creator and sensor_node: id, value and timestamp, packed without padding
+#define BULK_LOAD_RECORD_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+/**
+ * how a bulk load runs, a field of 0 takes the default
+ */
+typedef struct bulk_load_options {
+    int threads;                /**< parser threads, BULK_LOAD_THREADS by default */
+    int commit_rows;            /**< readings per transaction, BULK_LOAD_COMMIT_ROWS by default */
+    int defer_index;            /**< 1 creates the indexes of new partitions once at the end, see set_index_deferral */
+} bulk_load_options_t;
+
+/**
+ * the outcome of a bulk load
+ */
+typedef struct bulk_load_stats {
+    unsigned long records;      /**< whole records in the file */
+    unsigned long loaded;       /**< readings committed */
+    unsigned long rejected;     /**< records with a value that is not finite or a timestamp out of range */
+    unsigned long failed;       /**< valid records the database did not store */
+    size_t trailing_bytes;      /**< bytes after the last whole record, ignored */
+    double seconds;             /**< wall-clock time of the load */
+} bulk_load_stats_t;
+
+/**
+ * Loads a binary sensor_data file into the database
+ * The file is mapped into memory, so its size is only limited by the address space. Parser threads validate the
+ * records chunk by chunk while the calling thread inserts them, in roughly file order, with one transaction per
+ * 'commit_rows' readings. The readings go through insert_sensor, so they end up in partitions or blocks like
+ * readings of the gateway
+ * \param conn pointer to the current connection, not used by another thread during the load
+ * \param path the sensor_data file
+ * \param options how to run the load, NULL for the defaults
+ * \param stats filled out with the counts of the load, may be NULL
+ * \return zero for success, and non-zero if the file could not be read or a transaction failed
+ */
+int bulk_load(DBCONN *conn, const char *path, const bulk_load_options_t *options, bulk_load_stats_t *stats);
+
+#endif  //_BULK_LOAD_H_
@@ -18,4 +18,22 @@ typedef struct {
     sensor_ts_t ts;
 } sensor_data_t;
 
+typedef enum {
+    ROLLUP_SENSOR = 0,
+    ROLLUP_ROOM = 1
+} rollup_scope_t;
+
+// one closed time bucket of the readings of a sensor or a room, the average is sum / count
+// room buckets are built per datamgr shard, the database adds up the partial buckets of the same room
+typedef struct {
+    uint8_t scope;          // rollup_scope_t
+    uint16_t id;            // sensor id or room id
+    uint32_t period;        // length of the bucket in seconds
+    sensor_ts_t start;      // start of the bucket, a multiple of 'period'
+    uint32_t count;
+    double sum;
+    double min;
+    double max;
+} sensor_rollup_t;
+
 #endif /* _CONFIG_H_ */
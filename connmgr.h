@@ -3,6 +3,7 @@
 
 #include <poll.h>
 #include <stdio.h>
+#include <sys/select.h>
 #include "lib/tcpsock.h"
 #include "lib/dplist.h"
 #include "config.h"
@@ -1,142 +1,1343 @@
+#define _GNU_SOURCE     // needed for asprintf, clock_gettime and st_mtim with -std=c11
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include "datamgr.h"
+#include "bqueue.h"
+#include "seqlock.h"
+#include "rcu.h"
+#include "sensor_map.h"
+#include "batch_kernel.h"
+#include "iheap.h"
+#include "ddsketch.h"
+
+#define SENSOR_ID_SPACE (UINT16_MAX + 1)
+#define DATAMGR_MAX_WAIT_MS 3600000  // longest timed pop of a worker, one hour
+
+// scratch space of a worker: one round of the batch path, each lane is a different sensor
+typedef struct datamgr_lanes {
+    int slot[DATAMGR_BATCH_SIZE];
+    const sensor_data_t *reading[DATAMGR_BATCH_SIZE];
+    double window[RUN_AVG_LENGTH * DATAMGR_BATCH_SIZE];     // transposed windows, see batch_window_avg()
+    double min_temp[DATAMGR_BATCH_SIZE];
+    double max_temp[DATAMGR_BATCH_SIZE];
+    double avg[DATAMGR_BATCH_SIZE];
+    uint8_t outside[DATAMGR_BATCH_SIZE];
+} datamgr_lanes_t;
+
+// readings of one sensor held back until the watermark passes them, sorted by timestamp
+typedef struct datamgr_reorder {
+    int count;
+    sensor_data_t reading[DATAMGR_REORDER_SIZE];
+} datamgr_reorder_t;
+
+// the most recent readings of one sensor, ts and value are kept as 32 bit to halve the footprint
+typedef struct datamgr_history {
+    uint32_t count;             // readings appended so far, the next one goes to count % DATAMGR_HISTORY_SIZE
+    uint32_t ts[DATAMGR_HISTORY_SIZE];
+    float value[DATAMGR_HISTORY_SIZE];
+} datamgr_history_t;
+
+// the open time bucket of a sensor or a room for one rollup period
+typedef struct datamgr_bucket {
+    time_t start;
+    uint32_t count;
+    double sum;
+    double min;
+    double max;
+} datamgr_bucket_t;
+
+static const uint32_t rollup_periods[] = DATAMGR_ROLLUP_PERIODS;
+#define ROLLUP_PERIOD_COUNT ((int) (sizeof(rollup_periods) / sizeof(rollup_periods[0])))
+
+// checkpoint file: a header, one record per sensor that has readings, and an FNV-1a hash of the records
+#define CHECKPOINT_MAGIC "SNDMCKP1"
+
+typedef struct datamgr_checkpoint_header {
+    char magic[8];
+    uint32_t run_avg_length;    // a checkpoint is only loaded by a datamgr with the same RUN_AVG_LENGTH
+    uint32_t count;             // number of records
+} datamgr_checkpoint_header_t;
+
+typedef struct datamgr_checkpoint_record {
+    uint64_t readings;
+    int64_t last_modified;
+    double running_avg;
+    double window[RUN_AVG_LENGTH];  // as stored in the shard, the ring position follows from 'readings'
+    uint16_t sensor_id;
+} datamgr_checkpoint_record_t;
+
+// the temperature distribution of a sensor or a room over the last one to two sketch windows
+// written by the owning worker, queries copy it out through its own sequence counter
+typedef struct datamgr_sketch {
+    seqlock_t seq;
+    long window;                // ts / DATAMGR_SKETCH_WINDOW of the readings in 'current'
+    ddsketch_t current;
+    ddsketch_t previous;        // the window before 'current', empty if no reading arrived in it
+} datamgr_sketch_t;
+
+// change of the sum of sensor averages and of the sensor count of a room, collected by a worker during a batch
+typedef struct datamgr_room_delta {
+    uint16_t room_id;
+    int sensors;
+    double sum;
+} datamgr_room_delta_t;
+
+// a sensor that stopped reporting, or started again, waiting to be logged
+typedef struct datamgr_silence {
+    sensor_id_t sensor_id;
+    uint16_t room_id;
+    uint8_t silent;             // 1 when the sensor went silent, 0 when it reports again
+    time_t last_seen;           // timestamp of its newest reading
+} datamgr_silence_t;
+
+// one partition of the sensor id space, owned by a single worker thread
+// the worker is the only writer of its shard, queries read it lock-free through the per-sensor seqlocks
+// the state is indexed by sensor id and does not depend on the sensor map, so it survives a map reload
+// every field is its own array (indexed by sensor_id / shard_count) so the hot fields share no cache lines with cold ones
+typedef struct datamgr_shard {
+    pthread_t thread;
+    bqueue_t *queue;            // readings routed to this shard by the dispatcher
+    seqlock_t *seq;             // one sequence counter per sensor slot
+    double *running_avg;
+    time_t *last_modified;
+    unsigned long *readings;    // readings received, limits are only checked once the window is full
+    double *window;             // RUN_AVG_LENGTH values per slot, reading r goes to position r % RUN_AVG_LENGTH
+    threshold_state_t *alarm;   // threshold state machine of the sensor
+    uint8_t *occurrence;        // batch path scratch: readings of the slot seen so far in the current batch
+    time_t *newest;             // newest timestamp seen, the watermark is max(newest, now) - DATAMGR_ALLOWED_LATENESS
+    time_t *released;           // timestamp of the last reading released to the aggregates
+    datamgr_reorder_t **pending;    // reorder buffer of every slot, allocated when a sensor first needs one
+    iheap_t *hold;              // slots holding readings back, keyed by the time the oldest one is due
+    datamgr_history_t **history;    // recent readings of every slot, allocated with the first reading of a sensor
+    datamgr_bucket_t *bucket;   // open rollup bucket of every slot, ROLLUP_PERIOD_COUNT per slot
+    datamgr_bucket_t **room_bucket; // open rollup buckets of the readings of this shard per room, allocated on first use
+    _Atomic(datamgr_sketch_t *) *sketch;        // percentile sketch of every slot, allocated with its first reading
+    _Atomic(datamgr_sketch_t *) *room_sketch;   // percentile sketch of the readings of this shard per room
+    anomaly_state_t *anomaly;   // rolling statistics of every slot for the anomaly checks
+    uint8_t *in_room;           // set once the average of the slot counts towards the average of its room
+    uint16_t *room_of;          // the room the average of the slot counts towards
+    unsigned long generation;   // generation of the table the room counts were last checked against
+    datamgr_room_delta_t room_delta[DATAMGR_BATCH_SIZE];    // room changes of the current batch
+    int room_delta_count;
+    iheap_t *deadline;          // slots of the sensors expected to report, keyed by the time they are declared silent
+    float *interval;            // learned reporting interval of every slot in seconds
+    uint8_t *silent;            // set while the sensor of the slot is reported silent
+    atomic_ulong late;          // readings dropped because they were older than a released reading
+    atomic_ulong forced;        // readings released ahead of the watermark because the reorder buffer was full
+    sensor_data_t ready[DATAMGR_BATCH_SIZE];    // released readings, in timestamp order per sensor
+    int ready_count;
+    datamgr_lanes_t lanes;
+} datamgr_shard_t;
+
+// everything derived from room_sensor.map, never modified once published, a reload publishes a new table
+typedef struct datamgr_table {
+    unsigned long generation;   // counts the tables published so far
+    sensor_map_t *map;
+    const threshold_rule_t *rule[SENSOR_ID_SPACE];  // limits that apply to each mapped sensor
+} datamgr_table_t;
+
+static datamgr_shard_t *shards = NULL;
+static int shard_count = 0;
+
+static _Atomic(datamgr_table_t *) table = NULL;
+static rcu_t table_rcu;
+static unsigned long table_generation = 0;  // only changed by the thread that creates the tables
+
+static threshold_config_t *thresholds = NULL;
+static bqueue_t *rollup_queue = NULL;   // workers push closed buckets, the storagemgr writes them
+static atomic_ulong rollups_closed;
+static atomic_ulong rollups_dropped;
+static bqueue_t *alert_queue = NULL;    // workers push alerts, the dispatcher logs them
+static atomic_ulong alerts_logged;
+static atomic_ulong alerts_dropped;
+// room averages for the top-k queries, shared by all workers and updated once per batch
+static pthread_mutex_t room_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double *room_sum = NULL;         // sum of the running averages of the sensors of every room
+static int *room_sensors = NULL;        // number of sensors counted in room_sum
+static iheap_t *coldest_rooms = NULL;   // rooms keyed by their average
+static iheap_t *hottest_rooms = NULL;   // rooms keyed by minus their average
+static bqueue_t *anomaly_queue = NULL;     // workers push anomalies, the dispatcher logs them
+static bqueue_t *anomaly_db_queue = NULL;  // the same anomalies, for the storagemgr
+static atomic_ulong anomalies_found;
+static atomic_ulong anomalies_dropped;
+static bqueue_t *silence_queue = NULL;  // workers push silence events, the dispatcher logs them
+static atomic_ulong silence_events;
+static atomic_long sensors_silent;
+
+// map reloading, done by a separate thread so neither the workers nor the queries ever wait for it
+static pthread_t reloader;
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reload_cond = PTHREAD_COND_INITIALIZER;
+static int reloader_stop;
+static atomic_int reload_requested;  // lock-free, so it may be set from a signal handler
+
+// periodic checkpoints of the sensor state, written by their own thread
+static pthread_t checkpointer;
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+static int checkpointer_stop;
+
+static inline datamgr_shard_t *shard_of(sensor_id_t sensor_id) {
+    return &shards[sensor_id % shard_count];
+}
+
+static inline int slot_of(sensor_id_t sensor_id) {
+    return sensor_id / shard_count;
+}
+
+static datamgr_table_t *table_create(sensor_map_t *map) {
+    datamgr_table_t *new_table = malloc(sizeof(datamgr_table_t));
+    if (new_table == NULL) return NULL;
+    new_table->generation = ++table_generation;
+    new_table->map = map;
+    for (int id = 0; id < SENSOR_ID_SPACE; id++) {
+        new_table->rule[id] = map->present[id] ? threshold_resolve(thresholds, id, map->room_id[id]) : NULL;
+    }
+    return new_table;
+}
+
+static void table_free(datamgr_table_t *old_table) {
+    if (old_table == NULL) return;
+    sensor_map_free(&old_table->map);
+    free(old_table);
+}
 
-dplist_t *list;
-pthread_mutex_t list_mutex;
+static void rollup_emit(uint8_t scope, uint16_t id, uint32_t period, const datamgr_bucket_t *bucket) {
+    sensor_rollup_t rollup = {scope, id, period, bucket->start, bucket->count, bucket->sum, bucket->min, bucket->max};
+    atomic_fetch_add(&rollups_closed, 1);
+    if (bqueue_try_push(rollup_queue, &rollup) != BQUEUE_SUCCESS) {
+        atomic_fetch_add(&rollups_dropped, 1);
+    }
+}
+
+// adds a reading to the open bucket, the bucket is closed and emitted when the reading belongs to a later one
+static void rollup_add(datamgr_bucket_t *bucket, uint8_t scope, uint16_t id, uint32_t period, time_t ts, double value) {
+    time_t start = ts - ts % period;
+    if (bucket->count > 0 && bucket->start != start) {
+        if (start < bucket->start) {
+            // a room reading behind the open bucket, the database merges it into its own bucket
+            datamgr_bucket_t single = {start, 1, value, value, value};
+            rollup_emit(scope, id, period, &single);
+            return;
+        }
+        rollup_emit(scope, id, period, bucket);
+        bucket->count = 0;
+    }
+    if (bucket->count == 0) {
+        bucket->start = start;
+        bucket->sum = 0;
+        bucket->min = value;
+        bucket->max = value;
+    }
+    bucket->count++;
+    bucket->sum += value;
+    if (value < bucket->min) bucket->min = value;
+    if (value > bucket->max) bucket->max = value;
+}
+
+// adds a reading to a sketch, rotating its windows when the reading belongs to a later one
+static void sketch_add(datamgr_sketch_t *sketch, time_t ts, double value) {
+    long window = ts / DATAMGR_SKETCH_WINDOW;
+    if (window < sketch->window - 1) return;    // a room reading older than both windows
+    seqlock_write_begin(&sketch->seq);
+    if (window > sketch->window) {
+        if (window == sketch->window + 1) sketch->previous = sketch->current;
+        else ddsketch_init(&sketch->previous);
+        ddsketch_init(&sketch->current);
+        sketch->window = window;
+    }
+    ddsketch_add(window == sketch->window ? &sketch->current : &sketch->previous, value);
+    seqlock_write_end(&sketch->seq);
+}
+
+static datamgr_sketch_t *sketch_get(_Atomic(datamgr_sketch_t *) *slot) {
+    datamgr_sketch_t *sketch = atomic_load_explicit(slot, memory_order_relaxed);
+    if (sketch == NULL) {
+        sketch = malloc(sizeof(datamgr_sketch_t));
+        ERROR_HANDLER(sketch == NULL, "malloc() error");
+        seqlock_init(&sketch->seq);
+        sketch->window = 0;
+        ddsketch_init(&sketch->current);
+        ddsketch_init(&sketch->previous);
+        atomic_store_explicit(slot, sketch, memory_order_release);
+    }
+    return sketch;
+}
+
+// copies a sketch consistently, returns 0 if there is none
+static int sketch_read(_Atomic(datamgr_sketch_t *) *slot, datamgr_sketch_t *copy) {
+    datamgr_sketch_t *sketch = atomic_load_explicit(slot, memory_order_acquire);
+    unsigned int seq;
+    if (sketch == NULL) return 0;
+    do {
+        seq = seqlock_read_begin(&sketch->seq);
+        copy->window = sketch->window;
+        copy->current = sketch->current;
+        copy->previous = sketch->previous;
+    } while (seqlock_read_retry(&sketch->seq, seq));
+    return 1;
+}
 
-void *element_copy(void *data) {
-    sensor_t *sensor_data = (sensor_t *) data;
-    sensor_t *copy = malloc(sizeof(sensor_t));
-    memcpy(copy, sensor_data, sizeof(sensor_t));
-    return copy;
+// updates the sensor and room rollups with a reading, only called by the worker owning the shard
+static void shard_rollup(datamgr_shard_t *shard, int slot, uint16_t room_id, const sensor_data_t *reading) {
+    datamgr_bucket_t *room_bucket = shard->room_bucket[room_id];
+    if (room_bucket == NULL) {
+        room_bucket = shard->room_bucket[room_id] = calloc(ROLLUP_PERIOD_COUNT, sizeof(datamgr_bucket_t));
+        ERROR_HANDLER(room_bucket == NULL, "malloc() error");
+    }
+    for (int p = 0; p < ROLLUP_PERIOD_COUNT; p++) {
+        rollup_add(&shard->bucket[slot * ROLLUP_PERIOD_COUNT + p], ROLLUP_SENSOR, reading->id, rollup_periods[p],
+                   reading->ts, reading->value);
+        rollup_add(&room_bucket[p], ROLLUP_ROOM, room_id, rollup_periods[p], reading->ts, reading->value);
+    }
+    sketch_add(sketch_get(&shard->sketch[slot]), reading->ts, reading->value);
+    sketch_add(sketch_get(&shard->room_sketch[room_id]), reading->ts, reading->value);
 }
 
-void element_free(void **data) {
-    free(*data);
-    *data = NULL;
+// emits every bucket that is still open, called by the worker when it stops
+static void shard_rollup_flush(datamgr_shard_t *shard, int slots) {
+    int index = shard - shards;
+    for (int slot = 0; slot < slots; slot++) {
+        for (int p = 0; p < ROLLUP_PERIOD_COUNT; p++) {
+            datamgr_bucket_t *bucket = &shard->bucket[slot * ROLLUP_PERIOD_COUNT + p];
+            if (bucket->count > 0) rollup_emit(ROLLUP_SENSOR, slot * shard_count + index, rollup_periods[p], bucket);
+        }
+    }
+    for (int room_id = 0; room_id < SENSOR_ID_SPACE; room_id++) {
+        if (shard->room_bucket[room_id] == NULL) continue;
+        for (int p = 0; p < ROLLUP_PERIOD_COUNT; p++) {
+            if (shard->room_bucket[room_id][p].count > 0) {
+                rollup_emit(ROLLUP_ROOM, room_id, rollup_periods[p], &shard->room_bucket[room_id][p]);
+            }
+        }
+    }
 }
 
-int element_compare(void *x, void *y) {
-    sensor_t *sensor_x = (sensor_t *) x;
-    sensor_t *sensor_y = (sensor_t *) y;
-    if (sensor_x->sensor_id < sensor_y->sensor_id) return -1;
-    else if (sensor_x->sensor_id > sensor_y->sensor_id) return 1;
-    else return 0;
+static void silence_event(sensor_id_t sensor_id, uint16_t room_id, uint8_t silent, time_t last_seen) {
+    datamgr_silence_t event = {sensor_id, room_id, silent, last_seen};
+    if (bqueue_try_push(silence_queue, &event) != BQUEUE_SUCCESS) {
+        atomic_fetch_add(&alerts_dropped, 1);
+    }
+}
+
+// a reading of the sensor arrived at 'now': learn its reporting interval and push its deadline back
+// must be called before the reading goes into the reorder buffer, which updates the newest timestamp
+static void shard_alive(datamgr_shard_t *shard, datamgr_table_t *current, const sensor_data_t *reading, time_t now) {
+    int slot = slot_of(reading->id);
+    if (shard->newest[slot] != 0 && reading->ts > shard->newest[slot]) {
+        float gap = reading->ts - shard->newest[slot];
+        shard->interval[slot] = shard->interval[slot] == 0 ? gap : (3 * shard->interval[slot] + gap) / 4;
+    }
+    if (shard->silent[slot]) {
+        shard->silent[slot] = 0;
+        atomic_fetch_sub(&sensors_silent, 1);
+        silence_event(reading->id, current->map->room_id[reading->id], 0, reading->ts);
+    }
+    double timeout = DATAMGR_SILENCE_FACTOR * shard->interval[slot];
+    if (timeout < DATAMGR_SILENCE_MIN) timeout = DATAMGR_SILENCE_MIN;
+    iheap_update(shard->deadline, slot, (double) now + timeout);
+}
+
+// milliseconds from 'now' until 'deadline' for a timed pop, a deadline far away (e.g. a sensor with a huge
+// interval) is capped instead of overflowing the int: the worker wakes up early and computes it again
+static int deadline_ms(double deadline, time_t now) {
+    double ms = (deadline - now) * 1000;
+    return ms < DATAMGR_MAX_WAIT_MS ? (int) ms : DATAMGR_MAX_WAIT_MS;
+}
+
+// declares every sensor whose deadline has passed silent, only the earliest deadlines are looked at
+// returns the milliseconds until the next deadline, -1 if no sensor is expected to report
+static int shard_expire(datamgr_shard_t *shard, datamgr_table_t *current, time_t now) {
+    int slot, index = shard - shards;
+    double deadline;
+    while (iheap_peek(shard->deadline, &slot, &deadline) == IHEAP_SUCCESS) {
+        if (deadline > now) return deadline_ms(deadline, now);
+        iheap_remove(shard->deadline, slot);
+        sensor_id_t sensor_id = slot * shard_count + index;
+        if (!current->map->present[sensor_id]) continue;    // removed from the map by a reload
+        shard->silent[slot] = 1;
+        atomic_fetch_add(&sensors_silent, 1);
+        atomic_fetch_add(&silence_events, 1);
+        silence_event(sensor_id, current->map->room_id[sensor_id], 1, shard->newest[slot]);
+    }
+    return -1;
+}
+
+// runs the anomaly checks on a raw reading, every anomaly goes to both the logger and the storagemgr
+static void shard_anomaly(datamgr_shard_t *shard, int slot, uint16_t room_id, const sensor_data_t *reading) {
+    double scores[3];
+    int found = anomaly_check(&shard->anomaly[slot], reading->value, scores);
+    for (int bit = 0; found != 0; bit++, found >>= 1) {
+        if (!(found & 1)) continue;
+        anomaly_event_t event = {reading->id, room_id, 1 << bit, reading->value, scores[bit], reading->ts};
+        atomic_fetch_add(&anomalies_found, 1);
+        if (bqueue_try_push(anomaly_queue, &event) != BQUEUE_SUCCESS) atomic_fetch_add(&alerts_dropped, 1);
+        if (bqueue_try_push(anomaly_db_queue, &event) != BQUEUE_SUCCESS) atomic_fetch_add(&anomalies_dropped, 1);
+    }
+}
+
+// applies the room changes of a batch to the shared room averages, one lock per batch
+static void shard_room_publish(datamgr_shard_t *shard) {
+    if (shard->room_delta_count == 0) return;
+    pthread_mutex_lock(&room_mutex);
+    for (int i = 0; i < shard->room_delta_count; i++) {
+        const datamgr_room_delta_t *delta = &shard->room_delta[i];
+        room_sensors[delta->room_id] += delta->sensors;
+        room_sum[delta->room_id] += delta->sum;
+        if (room_sensors[delta->room_id] <= 0) {
+            room_sensors[delta->room_id] = 0;
+            room_sum[delta->room_id] = 0;
+            iheap_remove(coldest_rooms, delta->room_id);
+            iheap_remove(hottest_rooms, delta->room_id);
+            continue;
+        }
+        double avg = room_sum[delta->room_id] / room_sensors[delta->room_id];
+        iheap_update(coldest_rooms, delta->room_id, avg);
+        iheap_update(hottest_rooms, delta->room_id, -avg);
+    }
+    pthread_mutex_unlock(&room_mutex);
+    shard->room_delta_count = 0;
+}
+
+static void room_delta_add(datamgr_shard_t *shard, uint16_t room_id, int sensors, double sum) {
+    int i = 0;
+    while (i < shard->room_delta_count && shard->room_delta[i].room_id != room_id) i++;
+    if (i == shard->room_delta_count) {
+        // a batch touches at most DATAMGR_BATCH_SIZE rooms, but a moved sensor touches two: make room
+        if (i == DATAMGR_BATCH_SIZE) shard_room_publish(shard);
+        i = shard->room_delta_count++;
+        shard->room_delta[i] = (datamgr_room_delta_t) {room_id, 0, 0};
+    }
+    shard->room_delta[i].sensors += sensors;
+    shard->room_delta[i].sum += sum;
+}
+
+// the running average of a full window changed from 'old_avg' to 'new_avg', update the average of its room
+static void shard_room_avg(datamgr_shard_t *shard, int slot, uint16_t room_id, double old_avg, double new_avg) {
+    if (shard->in_room[slot] && shard->room_of[slot] == room_id) {
+        room_delta_add(shard, room_id, 0, new_avg - old_avg);
+        return;
+    }
+    // first full window, or the sensor was moved to another room by a map reload
+    if (shard->in_room[slot]) room_delta_add(shard, shard->room_of[slot], -1, -old_avg);
+    room_delta_add(shard, room_id, 1, new_avg);
+    shard->in_room[slot] = 1;
+    shard->room_of[slot] = room_id;
+}
+
+// a new sensor map was swapped in: sensors that left the map stop counting towards their room and moved sensors
+// count towards their new room right away, instead of with their next reading that may never come
+static void shard_remap(datamgr_shard_t *shard, datamgr_table_t *current) {
+    int index = shard - shards;
+    int slots = (SENSOR_ID_SPACE + shard_count - 1) / shard_count;
+    for (int slot = 0; slot < slots; slot++) {
+        if (!shard->in_room[slot]) continue;
+        sensor_id_t sensor_id = slot * shard_count + index;
+        if (!current->map->present[sensor_id]) {
+            room_delta_add(shard, shard->room_of[slot], -1, -shard->running_avg[slot]);
+            shard->in_room[slot] = 0;
+        } else if (current->map->room_id[sensor_id] != shard->room_of[slot]) {
+            shard_room_avg(shard, slot, current->map->room_id[sensor_id], shard->running_avg[slot],
+                           shard->running_avg[slot]);
+        }
+    }
+    shard_room_publish(shard);
+    shard->generation = current->generation;
+}
+
+static inline int alarm_is_quiet(const threshold_state_t *alarm) {
+    return alarm->level == THRESHOLD_NORMAL && alarm->reported == THRESHOLD_NORMAL &&
+           alarm->pending == THRESHOLD_NORMAL;
+}
+
+// updates 'n' different sensors of the shard at once, only called by the worker owning the shard
+static void shard_update_lanes(datamgr_shard_t *shard, datamgr_table_t *current, int n) {
+    datamgr_lanes_t *lanes = &shard->lanes;
+
+    // write the new values into the windows and gather the windows and limits into the lanes
+    for (int i = 0; i < n; i++) {
+        int slot = lanes->slot[i];
+        const threshold_rule_t *rule = current->rule[lanes->reading[i]->id];
+        double *window = &shard->window[slot * RUN_AVG_LENGTH];
+        datamgr_history_t *history = shard->history[slot];
+        if (history == NULL) {
+            history = calloc(1, sizeof(datamgr_history_t));
+            ERROR_HANDLER(history == NULL, "malloc() error");
+        }
+        seqlock_write_begin(&shard->seq[slot]);
+        shard->history[slot] = history;
+        history->ts[history->count % DATAMGR_HISTORY_SIZE] = (uint32_t) lanes->reading[i]->ts;
+        history->value[history->count % DATAMGR_HISTORY_SIZE] = (float) lanes->reading[i]->value;
+        history->count++;
+        window[shard->readings[slot] % RUN_AVG_LENGTH] = lanes->reading[i]->value;
+        for (int k = 0; k < RUN_AVG_LENGTH; k++) {
+            lanes->window[k * n + i] = window[k];
+        }
+        lanes->min_temp[i] = rule->min_temp;
+        lanes->max_temp[i] = rule->max_temp;
+    }
+
+    batch_window_avg(lanes->window, RUN_AVG_LENGTH, n, lanes->min_temp, lanes->max_temp, lanes->avg, lanes->outside);
+
+    // scatter the results, a sensor that is in range and has no alarm going on skips the threshold state machine
+    for (int i = 0; i < n; i++) {
+        int slot = lanes->slot[i];
+        const sensor_data_t *reading = lanes->reading[i];
+        double old_avg = shard->running_avg[slot];
+        shard->running_avg[slot] = lanes->avg[i];
+        shard->last_modified[slot] = reading->ts;
+        shard->readings[slot]++;
+        seqlock_write_end(&shard->seq[slot]);
+        shard_rollup(shard, slot, current->map->room_id[reading->id], reading);
+        shard_anomaly(shard, slot, current->map->room_id[reading->id], reading);
+        if (shard->readings[slot] >= RUN_AVG_LENGTH) {
+            shard_room_avg(shard, slot, current->map->room_id[reading->id], old_avg, lanes->avg[i]);
+        }
+
+        threshold_state_t *alarm = &shard->alarm[slot];
+        if (shard->readings[slot] < RUN_AVG_LENGTH) continue;
+        if (lanes->outside[i] == 0 && alarm_is_quiet(alarm)) continue;
+        if (threshold_check(current->rule[reading->id], alarm, lanes->avg[i], reading->ts)) {
+            threshold_alert_t alert = {reading->id, current->map->room_id[reading->id], alarm->reported,
+                                       lanes->avg[i], reading->ts};
+            if (bqueue_try_push(alert_queue, &alert) != BQUEUE_SUCCESS) {
+                atomic_fetch_add(&alerts_dropped, 1);
+            }
+        }
+    }
+}
+
+// groups a batch by sensor: round r holds the r-th reading of every sensor, so a round never has a sensor twice
+// and the readings of one sensor are still applied in arrival order
+static void shard_process_batch(datamgr_shard_t *shard, datamgr_table_t *current, sensor_data_t *batch, int n) {
+    int keep[DATAMGR_BATCH_SIZE], rank[DATAMGR_BATCH_SIZE], order[DATAMGR_BATCH_SIZE];
+    int start[DATAMGR_BATCH_SIZE + 1] = {0};
+    int m = 0;
+
+    for (int i = 0; i < n; i++) {
+        sensor_id_t id = batch[i].id;
+        if (!current->map->present[id]) continue;
+        rank[m] = shard->occurrence[slot_of(id)]++;
+        start[rank[m] + 1]++;
+        keep[m++] = i;
+    }
+    for (int r = 0; r < m; r++) {
+        start[r + 1] += start[r];
+    }
+    for (int j = 0; j < m; j++) {
+        order[start[rank[j]]++] = keep[j];
+        shard->occurrence[slot_of(batch[keep[j]].id)] = 0;
+    }
+
+    // 'start' now holds the end of every round
+    for (int r = 0, first = 0; first < m; first = start[r++]) {
+        int lanes = start[r] - first;
+        for (int i = 0; i < lanes; i++) {
+            shard->lanes.reading[i] = &batch[order[first + i]];
+            shard->lanes.slot[i] = slot_of(batch[order[first + i]].id);
+        }
+        shard_update_lanes(shard, current, lanes);
+    }
+}
+
+// hands the released readings to the batch path
+static void shard_flush(datamgr_shard_t *shard, datamgr_table_t *current) {
+    if (shard->ready_count == 0) return;
+    shard_process_batch(shard, current, shard->ready, shard->ready_count);
+    shard->ready_count = 0;
+    shard_room_publish(shard);
+}
+
+static void shard_ready(datamgr_shard_t *shard, datamgr_table_t *current, const sensor_data_t *reading) {
+    shard->released[slot_of(reading->id)] = reading->ts;
+    shard->ready[shard->ready_count++] = *reading;
+    if (shard->ready_count == DATAMGR_BATCH_SIZE) shard_flush(shard, current);
+}
+
+// releases the buffered readings of a slot up to and including 'watermark'
+static void shard_release(datamgr_shard_t *shard, datamgr_table_t *current, int slot, time_t watermark) {
+    datamgr_reorder_t *pending = shard->pending[slot];
+    int n = 0;
+    while (n < pending->count && pending->reading[n].ts <= watermark) {
+        shard_ready(shard, current, &pending->reading[n++]);
+    }
+    memmove(pending->reading, pending->reading + n, (pending->count - n) * sizeof(sensor_data_t));
+    pending->count -= n;
+}
+
+// keeps the slot in the hold heap while it holds readings back, so the worker wakes up when the oldest one is due
+static void shard_hold(datamgr_shard_t *shard, int slot) {
+    const datamgr_reorder_t *pending = shard->pending[slot];
+    if (pending->count > 0) {
+        iheap_update(shard->hold, slot, (double) pending->reading[0].ts + DATAMGR_ALLOWED_LATENESS);
+    } else {
+        iheap_remove(shard->hold, slot);
+    }
+}
+
+// releases the held readings the gateway clock has passed by DATAMGR_ALLOWED_LATENESS, so the last readings of a
+// sensor are applied even if it sends nothing newer. Only the earliest due slots are looked at
+// returns the milliseconds until the next one is due, -1 if nothing is held back
+static int shard_release_due(datamgr_shard_t *shard, datamgr_table_t *current, time_t now) {
+    int slot;
+    double due;
+    while (iheap_peek(shard->hold, &slot, &due) == IHEAP_SUCCESS) {
+        if (due > now) return deadline_ms(due, now);
+        shard_release(shard, current, slot, now - DATAMGR_ALLOWED_LATENESS);
+        shard_hold(shard, slot);
+    }
+    return -1;
+}
+
+// puts a reading in the reorder buffer of its sensor and releases whatever the watermark has passed
+// the watermark follows the newest reading of the sensor and the gateway clock, whichever is ahead
+// a reading older than one that was already released can no longer be applied in order, it is counted and dropped
+static void shard_reorder(datamgr_shard_t *shard, datamgr_table_t *current, const sensor_data_t *reading, time_t now) {
+    int slot = slot_of(reading->id);
+    datamgr_reorder_t *pending = shard->pending[slot];
+
+    if (reading->ts < shard->released[slot]) {
+        atomic_fetch_add(&shard->late, 1);
+        return;
+    }
+    if (reading->ts > shard->newest[slot]) shard->newest[slot] = reading->ts;
+    time_t watermark = (shard->newest[slot] > now ? shard->newest[slot] : now) - DATAMGR_ALLOWED_LATENESS;
+
+    // the watermark has passed it already and nothing older is held back: apply it right away
+    if ((pending == NULL || pending->count == 0) && reading->ts <= watermark) {
+        shard_ready(shard, current, reading);
+        return;
+    }
+    if (pending == NULL) {
+        pending = shard->pending[slot] = malloc(sizeof(datamgr_reorder_t));
+        ERROR_HANDLER(pending == NULL, "malloc() error");
+        pending->count = 0;
+    }
+    if (pending->count == DATAMGR_REORDER_SIZE) {
+        // full: the oldest reading goes out before the watermark reaches it
+        atomic_fetch_add(&shard->forced, 1);
+        if (reading->ts < pending->reading[0].ts) {
+            shard_ready(shard, current, reading);
+            shard_release(shard, current, slot, watermark);
+            shard_hold(shard, slot);
+            return;
+        }
+        shard_release(shard, current, slot, pending->reading[0].ts);
+    }
+    int i = pending->count++;
+    while (i > 0 && pending->reading[i - 1].ts > reading->ts) {
+        pending->reading[i] = pending->reading[i - 1];
+        i--;
+    }
+    pending->reading[i] = *reading;
+    shard_release(shard, current, slot, watermark);
+    shard_hold(shard, slot);
+}
+
+// writes the queued threshold alerts and silence events to the log, called from the dispatching thread
+static void datamgr_log_alerts() {
+    threshold_alert_t alerts[16];
+    datamgr_silence_t events[16];
+    anomaly_event_t anomalies[16];
+    int n;
+    while ((n = bqueue_pop_batch(anomaly_queue, anomalies, 16, 0)) > 0) {
+        for (int i = 0; i < n; i++) {
+            char *log_string;
+            ASPRINTF_ERROR(asprintf(&log_string, "Sensor node %" PRIu16 " in room %" PRIu16
+                                    " reports an anomaly: %s (value = %g, score = %g)", anomalies[i].sensor_id,
+                                    anomalies[i].room_id, anomaly_name(anomalies[i].kind), anomalies[i].value,
+                                    anomalies[i].score));
+            fifomgr_write(log_string);
+            free(log_string);
+        }
+    }
+    while ((n = bqueue_pop_batch(silence_queue, events, 16, 0)) > 0) {
+        for (int i = 0; i < n; i++) {
+            char *log_string;
+            if (events[i].silent) {
+                ASPRINTF_ERROR(asprintf(&log_string, "Sensor node %" PRIu16 " in room %" PRIu16
+                                        " stopped reporting (last reading at %ld)", events[i].sensor_id,
+                                        events[i].room_id, (long) events[i].last_seen));
+            } else {
+                ASPRINTF_ERROR(asprintf(&log_string, "Sensor node %" PRIu16 " in room %" PRIu16 " is reporting again",
+                                        events[i].sensor_id, events[i].room_id));
+            }
+            fifomgr_write(log_string);
+            free(log_string);
+        }
+    }
+    while ((n = bqueue_pop_batch(alert_queue, alerts, 16, 0)) > 0) {
+        for (int i = 0; i < n; i++) {
+            char *log_string;
+            if (alerts[i].level == THRESHOLD_NORMAL) {
+                ASPRINTF_ERROR(asprintf(&log_string, "Sensor node %" PRIu16 " in room %" PRIu16
+                                        " is back within limits (avg temp = %g)", alerts[i].sensor_id,
+                                        alerts[i].room_id, alerts[i].value));
+            } else {
+                ASPRINTF_ERROR(asprintf(&log_string, "Sensor node %" PRIu16 " in room %" PRIu16
+                                        " reports it's too %s (avg temp = %g)", alerts[i].sensor_id, alerts[i].room_id,
+                                        alerts[i].level == THRESHOLD_TOO_HOT ? "hot" : "cold", alerts[i].value));
+            }
+            fifomgr_write(log_string);
+            free(log_string);
+        }
+        atomic_fetch_add(&alerts_logged, n);
+    }
+}
+
+static void *datamgr_worker(void *arg) {
+    datamgr_shard_t *shard = (datamgr_shard_t *) arg;
+    sensor_data_t batch[DATAMGR_BATCH_SIZE];
+    int n, timeout_ms = -1;
+
+    // wakes up at the earliest deadline even when no readings arrive, so silent sensors are noticed and held back
+    // readings are released in time
+    while ((n = bqueue_pop_batch(shard->queue, batch, DATAMGR_BATCH_SIZE, timeout_ms)) != BQUEUE_CLOSED) {
+        time_t now = time(NULL);
+        // one read-side critical section per batch, a reload never makes the worker wait
+        unsigned int epoch = rcu_read_lock(&table_rcu);
+        datamgr_table_t *current = atomic_load(&table);
+        if (current->generation != shard->generation) shard_remap(shard, current);
+        for (int i = 0; i < n; i++) {
+            if (!current->map->present[batch[i].id]) continue;
+            shard_alive(shard, current, &batch[i], now);
+            shard_reorder(shard, current, &batch[i], now);
+        }
+        int hold_ms = shard_release_due(shard, current, now);
+        shard_flush(shard, current);
+        timeout_ms = shard_expire(shard, current, now);
+        if (hold_ms >= 0 && (timeout_ms < 0 || hold_ms < timeout_ms)) timeout_ms = hold_ms;
+        // an idle worker still looks at a reloaded map in time
+        if (timeout_ms < 0 || timeout_ms > DATAMGR_RELOAD_POLL * 1000) timeout_ms = DATAMGR_RELOAD_POLL * 1000;
+        rcu_read_unlock(&table_rcu, epoch);
+    }
+
+    // no newer readings will come, release everything still held back
+    unsigned int epoch = rcu_read_lock(&table_rcu);
+    datamgr_table_t *current = atomic_load(&table);
+    int slots = (SENSOR_ID_SPACE + shard_count - 1) / shard_count;
+    for (int slot = 0; slot < slots; slot++) {
+        if (shard->pending[slot] != NULL && shard->pending[slot]->count > 0) {
+            shard_release(shard, current, slot, shard->pending[slot]->reading[shard->pending[slot]->count - 1].ts);
+        }
+    }
+    shard_flush(shard, current);
+    rcu_read_unlock(&table_rcu, epoch);
+    shard_rollup_flush(shard, slots);
+    return NULL;
+}
+
+// builds a new table from the map file and swaps it in, the old table is freed once no reader can see it anymore
+static int datamgr_reload_map(const char *path) {
+    sensor_map_t *map = NULL;
+    datamgr_table_t *new_table;
+    char *log_string;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        ASPRINTF_ERROR(asprintf(&log_string, "Error opening file %s, keeping the current sensor map", path));
+        fifomgr_write(log_string);
+        free(log_string);
+        return -1;
+    }
+    int status = sensor_map_load(&map, fp);
+    fclose(fp);
+    if (status != SENSOR_MAP_SUCCESS || (new_table = table_create(map)) == NULL) {
+        sensor_map_free(&map);
+        fifomgr_write("Sensor map reload failed, keeping the current sensor map");
+        return -1;
+    }
+
+    datamgr_table_t *old_table = atomic_exchange(&table, new_table);
+    rcu_synchronize(&table_rcu);
+    table_free(old_table);
+
+    ASPRINTF_ERROR(asprintf(&log_string, "Sensor map %s reloaded, %d sensors", path, map->total_sensors));
+    fifomgr_write(log_string);
+    free(log_string);
+    return 0;
+}
+
+static int map_file_changed(const char *path, struct stat *last) {
+    struct stat now;
+    if (stat(path, &now) != 0) return 0;
+    int changed = now.st_mtim.tv_sec != last->st_mtim.tv_sec || now.st_mtim.tv_nsec != last->st_mtim.tv_nsec ||
+                  now.st_size != last->st_size || now.st_ino != last->st_ino;
+    *last = now;
+    return changed;
+}
+
+static void *datamgr_reloader(void *arg) {
+    const char *path = (const char *) arg;
+    struct stat last;
+    struct timespec deadline;
+
+    memset(&last, 0, sizeof(last));
+    stat(path, &last);
+    pthread_mutex_lock(&reload_mutex);
+    while (!reloader_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += DATAMGR_RELOAD_POLL;
+        pthread_cond_timedwait(&reload_cond, &reload_mutex, &deadline);
+        if (reloader_stop) break;
+        int changed = map_file_changed(path, &last);
+        if (!atomic_exchange(&reload_requested, 0) && !changed) continue;
+        pthread_mutex_unlock(&reload_mutex);
+        datamgr_reload_map(path);
+        pthread_mutex_lock(&reload_mutex);
+    }
+    pthread_mutex_unlock(&reload_mutex);
+    return NULL;
+}
+
+static uint64_t checkpoint_hash(const void *data, size_t size) {
+    const unsigned char *p = data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// syncs the directory that holds 'path', so a rename into it survives a crash
+static int checkpoint_sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+    if (dir == NULL) return -1;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) return -1;
+    int status = fsync(fd);
+    close(fd);
+    return status;
+}
+
+// writes a snapshot of every sensor with readings to 'path', crash-consistent: the snapshot goes to a temporary file
+// that is synced and renamed over the old checkpoint, then the directory is synced so the rename is durable too.
+// 'path' always holds a complete checkpoint
+// safe to call while the workers run, every sensor is read consistently through its seqlock
+static int datamgr_write_checkpoint(const char *path) {
+    int slots = (SENSOR_ID_SPACE + shard_count - 1) / shard_count;
+    datamgr_checkpoint_record_t *records = calloc(SENSOR_ID_SPACE, sizeof(datamgr_checkpoint_record_t));
+    if (records == NULL) return -1;
+    datamgr_checkpoint_header_t header = {CHECKPOINT_MAGIC, RUN_AVG_LENGTH, 0};
+    for (int i = 0; i < shard_count; i++) {
+        datamgr_shard_t *shard = &shards[i];
+        for (int slot = 0; slot < slots; slot++) {
+            datamgr_checkpoint_record_t *record = &records[header.count];
+            unsigned int seq;
+            do {
+                seq = seqlock_read_begin(&shard->seq[slot]);
+                record->readings = shard->readings[slot];
+                record->last_modified = shard->last_modified[slot];
+                record->running_avg = shard->running_avg[slot];
+                memcpy(record->window, &shard->window[slot * RUN_AVG_LENGTH], sizeof(record->window));
+            } while (seqlock_read_retry(&shard->seq[slot], seq));
+            if (record->readings == 0) continue;
+            record->sensor_id = slot * shard_count + i;
+            header.count++;
+        }
+    }
+
+    char *tmp_path;
+    ASPRINTF_ERROR(asprintf(&tmp_path, "%s.tmp", path));
+    size_t size = header.count * sizeof(datamgr_checkpoint_record_t);
+    uint64_t hash = checkpoint_hash(records, size);
+    int status = -1;
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp != NULL) {
+        if (fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(records, 1, size, fp) == size &&
+            fwrite(&hash, sizeof(hash), 1, fp) == 1 && fflush(fp) == 0 && fsync(fileno(fp)) == 0) {
+            status = 0;
+        }
+        if (fclose(fp) != 0) status = -1;
+    }
+    if (status == 0) status = rename(tmp_path, path);
+    if (status != 0) unlink(tmp_path);
+    else status = checkpoint_sync_dir(path);
+    free(tmp_path);
+    free(records);
+    return status;
+}
+
+// restores the sensor state of a checkpoint in one pass over the mapped file, before the workers start
+// a missing, truncated or corrupt checkpoint is ignored and the datamgr starts cold
+static int datamgr_load_checkpoint(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) (sizeof(datamgr_checkpoint_header_t) + sizeof(uint64_t))) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    int restored = -1;
+    datamgr_checkpoint_header_t header;
+    memcpy(&header, data, sizeof(header));
+    size_t records_size = (size_t) header.count * sizeof(datamgr_checkpoint_record_t);
+    const char *records = data + sizeof(header);
+    uint64_t hash;
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 && header.run_avg_length == RUN_AVG_LENGTH &&
+        size == sizeof(header) + records_size + sizeof(hash)) {
+        memcpy(&hash, records + records_size, sizeof(hash));
+        if (hash == checkpoint_hash(records, records_size)) restored = 0;
+    }
+    for (uint32_t r = 0; restored >= 0 && r < header.count; r++) {
+        datamgr_checkpoint_record_t record;
+        memcpy(&record, records + r * sizeof(record), sizeof(record));
+        datamgr_shard_t *shard = shard_of(record.sensor_id);
+        int slot = slot_of(record.sensor_id);
+        shard->readings[slot] = record.readings;
+        shard->last_modified[slot] = record.last_modified;
+        shard->running_avg[slot] = record.running_avg;
+        memcpy(&shard->window[slot * RUN_AVG_LENGTH], record.window, sizeof(record.window));
+        // readings up to and including the last applied one count as late, a replay cannot apply them twice
+        shard->newest[slot] = record.last_modified;
+        shard->released[slot] = record.last_modified + 1;
+        restored++;
+    }
+    munmap(data, size);
+    return restored;
+}
+
+static void *datamgr_checkpointer(void *arg) {
+    const char *path = (const char *) arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&checkpoint_mutex);
+    while (!checkpointer_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += DATAMGR_CHECKPOINT_INTERVAL;
+        pthread_cond_timedwait(&checkpoint_cond, &checkpoint_mutex, &deadline);
+        if (checkpointer_stop) break;
+        pthread_mutex_unlock(&checkpoint_mutex);
+        if (datamgr_write_checkpoint(path) != 0) {
+            char *log_string;
+            ASPRINTF_ERROR(asprintf(&log_string, "Error writing checkpoint %s", path));
+            fifomgr_write(log_string);
+            free(log_string);
+        }
+        pthread_mutex_lock(&checkpoint_mutex);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return NULL;
+}
+
+void datamgr_request_reload() {
+    atomic_store(&reload_requested, 1);
+}
+
+void datamgr_init(int workers) {
+    if (shards != NULL) return;
+    if (workers < 1) workers = 1;
+    if (workers > DATAMGR_MAX_WORKERS) workers = DATAMGR_MAX_WORKERS;
+
+    shards = calloc(workers, sizeof(datamgr_shard_t));
+    ERROR_HANDLER(shards == NULL, "malloc() error");
+    shard_count = workers;
+    int slots = (SENSOR_ID_SPACE + workers - 1) / workers;
+    for (int i = 0; i < workers; i++) {
+        datamgr_shard_t *shard = &shards[i];
+        shard->seq = malloc(slots * sizeof(seqlock_t));
+        shard->running_avg = calloc(slots, sizeof(double));
+        shard->last_modified = calloc(slots, sizeof(time_t));
+        shard->readings = calloc(slots, sizeof(unsigned long));
+        shard->window = calloc((size_t) slots * RUN_AVG_LENGTH, sizeof(double));
+        shard->alarm = calloc(slots, sizeof(threshold_state_t));
+        shard->occurrence = calloc(slots, sizeof(uint8_t));
+        shard->newest = calloc(slots, sizeof(time_t));
+        shard->released = calloc(slots, sizeof(time_t));
+        shard->pending = calloc(slots, sizeof(datamgr_reorder_t *));
+        shard->history = calloc(slots, sizeof(datamgr_history_t *));
+        shard->bucket = calloc((size_t) slots * ROLLUP_PERIOD_COUNT, sizeof(datamgr_bucket_t));
+        shard->room_bucket = calloc(SENSOR_ID_SPACE, sizeof(datamgr_bucket_t *));
+        shard->interval = calloc(slots, sizeof(float));
+        shard->anomaly = calloc(slots, sizeof(anomaly_state_t));
+        shard->in_room = calloc(slots, sizeof(uint8_t));
+        shard->room_of = calloc(slots, sizeof(uint16_t));
+        shard->sketch = calloc(slots, sizeof(_Atomic(datamgr_sketch_t *)));
+        shard->room_sketch = calloc(SENSOR_ID_SPACE, sizeof(_Atomic(datamgr_sketch_t *)));
+        shard->silent = calloc(slots, sizeof(uint8_t));
+        ERROR_HANDLER(shard->seq == NULL || shard->running_avg == NULL || shard->last_modified == NULL ||
+                      shard->readings == NULL || shard->window == NULL || shard->alarm == NULL ||
+                      shard->occurrence == NULL || shard->newest == NULL || shard->released == NULL ||
+                      shard->pending == NULL || shard->history == NULL || shard->bucket == NULL ||
+                      shard->room_bucket == NULL || shard->interval == NULL || shard->silent == NULL ||
+                      shard->sketch == NULL || shard->room_sketch == NULL || shard->anomaly == NULL ||
+                      shard->in_room == NULL || shard->room_of == NULL ||
+                      iheap_init(&shard->deadline, slots) != IHEAP_SUCCESS ||
+                      iheap_init(&shard->hold, slots) != IHEAP_SUCCESS, "malloc() error");
+        atomic_init(&shard->late, 0);
+        atomic_init(&shard->forced, 0);
+        for (int slot = 0; slot < slots; slot++) {
+            seqlock_init(&shard->seq[slot]);
+        }
+        ERROR_HANDLER(bqueue_init(&shard->queue, sizeof(sensor_data_t), DATAMGR_QUEUE_SIZE) != BQUEUE_SUCCESS,
+                      "bqueue_init() error");
+    }
+    room_sum = calloc(SENSOR_ID_SPACE, sizeof(double));
+    room_sensors = calloc(SENSOR_ID_SPACE, sizeof(int));
+    ERROR_HANDLER(room_sum == NULL || room_sensors == NULL ||
+                  iheap_init(&coldest_rooms, SENSOR_ID_SPACE) != IHEAP_SUCCESS ||
+                  iheap_init(&hottest_rooms, SENSOR_ID_SPACE) != IHEAP_SUCCESS, "malloc() error");
+    ERROR_HANDLER(bqueue_init(&alert_queue, sizeof(threshold_alert_t), DATAMGR_ALERT_QUEUE_SIZE) != BQUEUE_SUCCESS,
+                  "bqueue_init() error");
+    ERROR_HANDLER(bqueue_init(&rollup_queue, sizeof(sensor_rollup_t), DATAMGR_ROLLUP_QUEUE_SIZE) != BQUEUE_SUCCESS,
+                  "bqueue_init() error");
+    atomic_init(&rollups_closed, 0);
+    atomic_init(&rollups_dropped, 0);
+    ERROR_HANDLER(bqueue_init(&silence_queue, sizeof(datamgr_silence_t), DATAMGR_ALERT_QUEUE_SIZE) != BQUEUE_SUCCESS,
+                  "bqueue_init() error");
+    ERROR_HANDLER(bqueue_init(&anomaly_queue, sizeof(anomaly_event_t), DATAMGR_ALERT_QUEUE_SIZE) != BQUEUE_SUCCESS ||
+                  bqueue_init(&anomaly_db_queue, sizeof(anomaly_event_t), DATAMGR_ANOMALY_QUEUE_SIZE) != BQUEUE_SUCCESS,
+                  "bqueue_init() error");
+    atomic_init(&anomalies_found, 0);
+    atomic_init(&anomalies_dropped, 0);
+    atomic_init(&silence_events, 0);
+    atomic_init(&sensors_silent, 0);
+    atomic_init(&alerts_logged, 0);
+    atomic_init(&alerts_dropped, 0);
+    atomic_init(&reload_requested, 0);
+    rcu_init(&table_rcu);
+}
+
+int datamgr_load_thresholds(FILE *fp) {
+    threshold_config_free(&thresholds);
+    return threshold_config_load(&thresholds, fp);
 }
 
 void datamgr_parse_sensor_data(FILE *fp_sensor_map, sbuffer_t **buffer) {
-    //initialize list_mutex with 
-    pthread_mutex_init(&list_mutex, NULL);
+    sensor_map_t *map;
 
-    list = dpl_create(element_copy, element_free, element_compare);
-    // all the above callback functions that I have provided you before, these function use the dplist.h library,
-    // they will be used to make deep copy, free the elements and compare the elements of the list
+    if (shards == NULL) datamgr_init(DATAMGR_WORKERS);
+    if (thresholds == NULL) {
+        ERROR_HANDLER(threshold_config_load(&thresholds, NULL) != THRESHOLD_SUCCESS, "malloc() error");
+    }
 
-    // read sensor information from file and create list of sensors
-    int room_id;
-    uint16_t sensor_id;
-    while (fscanf(fp_sensor_map, "%"SCNu16
-    ",%d", &sensor_id, &room_id) == 2) {
-        sensor_t *sensor = malloc(sizeof(sensor_t));
-        ERROR_HANDLER(sensor == NULL, "malloc() error");
-        sensor->sensor_id = sensor_id;
-        sensor->room_id = room_id;
-        sensor->running_avg = 0.0;
-        sensor->last_modified = 0;
-        memset(sensor->temperatures, 0, sizeof(double) * RUN_AVG_LENGTH);
-        pthread_mutex_lock(&list_mutex);
-        dpl_insert_at_index(list, sensor, dpl_size(list), true);
-        pthread_mutex_unlock(&list_mutex);
-    }
-
-    sensor_data_t sensor_data;
+    // read sensor information from file, the workers only see the map through the published table
+    ERROR_HANDLER(sensor_map_load(&map, fp_sensor_map) != SENSOR_MAP_SUCCESS, "malloc() error");
+    datamgr_table_t *first_table = table_create(map);
+    ERROR_HANDLER(first_table == NULL, "malloc() error");
+    atomic_store(&table, first_table);
+
+    // warm restart: the running averages continue from the last checkpoint
+    int restored = datamgr_load_checkpoint(DATAMGR_CHECKPOINT_FILE);
+    if (restored >= 0) {
+        char *log_string;
+        ASPRINTF_ERROR(asprintf(&log_string, "Checkpoint %s loaded, %d sensors restored", DATAMGR_CHECKPOINT_FILE,
+                                restored));
+        fifomgr_write(log_string);
+        free(log_string);
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        ERROR_HANDLER(pthread_create(&shards[i].thread, NULL, datamgr_worker, &shards[i]) != 0,
+                      "pthread_create() error");
+    }
+    reloader_stop = 0;
+    ERROR_HANDLER(pthread_create(&reloader, NULL, datamgr_reloader, DATAMGR_MAP_FILE) != 0,
+                  "pthread_create() error");
+    checkpointer_stop = 0;
+    ERROR_HANDLER(pthread_create(&checkpointer, NULL, datamgr_checkpointer, DATAMGR_CHECKPOINT_FILE) != 0,
+                  "pthread_create() error");
+
+    // dispatch: this thread only routes readings and logs alerts, the workers do the aggregation
+    // readings leave the sbuffer in blocks and go to every shard as one chunk, keeping their order per sensor
+    sensor_data_t block[DATAMGR_BATCH_SIZE];
+    sensor_data_t *routed = malloc((size_t) shard_count * DATAMGR_BATCH_SIZE * sizeof(sensor_data_t));
+    int *routed_count = malloc(shard_count * sizeof(int));
+    ERROR_HANDLER(routed == NULL || routed_count == NULL, "malloc() error");
     while (*buffer) {
-        // read sensor data from buffer
-        int status = sbuffer_remove(*buffer, &sensor_data);
-        if (status == SBUFFER_SUCCESS) {
-            // find corresponding sensor in list
-            pthread_mutex_lock(&list_mutex);
-            sensor_t search = {sensor_data.id};
-            int index = dpl_get_index_of_element(list, &search);
-            if (index != -1) {
-                sensor_t *sensor = (sensor_t *) dpl_get_element_at_index(list, index);
-                if (sensor) {
-                    // update sensor data
-                    sensor->last_modified = sensor_data.ts;
-                    memmove(&sensor->temperatures[1], &sensor->temperatures[0], sizeof(double) * (RUN_AVG_LENGTH - 1));
-                    sensor->temperatures[0] = sensor_data.value;
-                    double sum = 0.0;
-                    for (int i = 0; i < RUN_AVG_LENGTH; i++) {
-                        sum += sensor->temperatures[i];
-                    }
-                    sensor->running_avg = sum / RUN_AVG_LENGTH;
+        int n = sbuffer_remove_batch(*buffer, block, DATAMGR_BATCH_SIZE);
+        if (n > 0) {
+            memset(routed_count, 0, shard_count * sizeof(int));
+            for (int i = 0; i < n; i++) {
+                int index = block[i].id % shard_count;
+                routed[index * DATAMGR_BATCH_SIZE + routed_count[index]++] = block[i];
+            }
+            for (int i = 0; i < shard_count; i++) {
+                if (routed_count[i] > 0) {
+                    bqueue_push_batch(shards[i].queue, &routed[i * DATAMGR_BATCH_SIZE], routed_count[i]);
                 }
             }
-            pthread_mutex_unlock(&list_mutex);
         }
+        datamgr_log_alerts();
+    }
+    free(routed);
+    free(routed_count);
+
+    // stop the reloader, let the workers drain their queues and stop
+    pthread_mutex_lock(&reload_mutex);
+    reloader_stop = 1;
+    pthread_cond_signal(&reload_cond);
+    pthread_mutex_unlock(&reload_mutex);
+    pthread_join(reloader, NULL);
+    for (int i = 0; i < shard_count; i++) {
+        bqueue_close(shards[i].queue);
+    }
+    for (int i = 0; i < shard_count; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+    // the last checkpoint holds everything the workers applied
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpointer_stop = 1;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_mutex);
+    pthread_join(checkpointer, NULL);
+    if (datamgr_write_checkpoint(DATAMGR_CHECKPOINT_FILE) != 0) {
+        fifomgr_write("Error writing the final checkpoint");
     }
+    datamgr_log_alerts();
 }
 
 void datamgr_free() {
-    dpl_free(&list, true);
-    pthread_mutex_destroy(&list_mutex);
+    if (shards == NULL) return;
+    int slots = (SENSOR_ID_SPACE + shard_count - 1) / shard_count;
+    for (int i = 0; i < shard_count; i++) {
+        for (int slot = 0; slot < slots; slot++) {
+            free(shards[i].pending[slot]);
+            free(shards[i].history[slot]);
+            free(atomic_load(&shards[i].sketch[slot]));
+        }
+        bqueue_free(&shards[i].queue);
+        free(shards[i].seq);
+        free(shards[i].running_avg);
+        free(shards[i].last_modified);
+        free(shards[i].readings);
+        free(shards[i].window);
+        free(shards[i].alarm);
+        free(shards[i].occurrence);
+        free(shards[i].newest);
+        free(shards[i].released);
+        free(shards[i].pending);
+        free(shards[i].history);
+        for (int room_id = 0; room_id < SENSOR_ID_SPACE; room_id++) {
+            free(shards[i].room_bucket[room_id]);
+            free(atomic_load(&shards[i].room_sketch[room_id]));
+        }
+        free(shards[i].bucket);
+        free(shards[i].room_bucket);
+        free(shards[i].sketch);
+        free(shards[i].room_sketch);
+        free(shards[i].interval);
+        free(shards[i].silent);
+        free(shards[i].anomaly);
+        free(shards[i].in_room);
+        free(shards[i].room_of);
+        iheap_free(&shards[i].deadline);
+        iheap_free(&shards[i].hold);
+    }
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+    table_free(atomic_exchange(&table, NULL));
+    bqueue_free(&alert_queue);
+    bqueue_free(&rollup_queue);
+    bqueue_free(&silence_queue);
+    bqueue_free(&anomaly_queue);
+    bqueue_free(&anomaly_db_queue);
+    pthread_mutex_lock(&room_mutex);
+    free(room_sum);
+    free(room_sensors);
+    room_sum = NULL;
+    room_sensors = NULL;
+    iheap_free(&coldest_rooms);
+    iheap_free(&hottest_rooms);
+    pthread_mutex_unlock(&room_mutex);
+    threshold_config_free(&thresholds);
+}
+
+// finds the shard and slot of a mapped sensor, returns NULL if the sensor is unknown
+static datamgr_shard_t *datamgr_find(sensor_id_t sensor_id, int *slot) {
+    if (shard_count == 0) return NULL;
+    unsigned int epoch = rcu_read_lock(&table_rcu);
+    datamgr_table_t *current = atomic_load(&table);
+    int mapped = current != NULL && current->map->present[sensor_id];
+    rcu_read_unlock(&table_rcu, epoch);
+    if (!mapped) return NULL;
+    *slot = slot_of(sensor_id);
+    return shard_of(sensor_id);
 }
 
 uint16_t datamgr_get_room_id(sensor_id_t sensor_id) {
-    //find corresponding sensor in list
-    pthread_mutex_lock(&list_mutex);
-    sensor_t search = {sensor_id};
-    int index = dpl_get_index_of_element(list, &search);
     uint16_t room_id = -1;
-    if (index != -1) {
-        sensor_t *sensor = (sensor_t *) dpl_get_element_at_index(list, index);
-        if (sensor) {
-            room_id = sensor->room_id;
-        }
+    unsigned int epoch = rcu_read_lock(&table_rcu);
+    datamgr_table_t *current = atomic_load(&table);
+    if (current != NULL && current->map->present[sensor_id]) {
+        room_id = current->map->room_id[sensor_id];
     }
-    pthread_mutex_unlock(&list_mutex);
+    rcu_read_unlock(&table_rcu, epoch);
     return room_id;
 }
 
 double datamgr_get_avg(sensor_id_t sensor_id) {
-    //find corresponding sensor in list
-    pthread_mutex_lock(&list_mutex);
-    sensor_t search = {sensor_id};
-    int index = dpl_get_index_of_element(list, &search);
-    double avg = 0.0;
-    if (index != -1) {
-        sensor_t *sensor = (sensor_t *) dpl_get_element_at_index(list, index);
-        if (sensor) {
-            avg = sensor->running_avg;
-        }
-    }
-    pthread_mutex_unlock(&list_mutex);
+    int slot;
+    unsigned int seq;
+    double avg;
+    datamgr_shard_t *shard = datamgr_find(sensor_id, &slot);
+    if (shard == NULL) return 0.0;
+    do {
+        seq = seqlock_read_begin(&shard->seq[slot]);
+        avg = shard->running_avg[slot];
+    } while (seqlock_read_retry(&shard->seq[slot], seq));
     return avg;
 }
 
 time_t datamgr_get_last_modified(sensor_id_t sensor_id) {
-    //find corresponding sensor in list
-    pthread_mutex_lock(&list_mutex);
-    sensor_t search = {sensor_id};
-    int index = dpl_get_index_of_element(list, &search);
-    time_t last_modified = 0;
-    if (index != -1) {
-        sensor_t *sensor = (sensor_t *) dpl_get_element_at_index(list, index);
-        if (sensor) {
-            last_modified = sensor->last_modified;
-        }
-    }
-    pthread_mutex_unlock(&list_mutex);
+    int slot;
+    unsigned int seq;
+    time_t last_modified;
+    datamgr_shard_t *shard = datamgr_find(sensor_id, &slot);
+    if (shard == NULL) return 0;
+    do {
+        seq = seqlock_read_begin(&shard->seq[slot]);
+        last_modified = shard->last_modified[slot];
+    } while (seqlock_read_retry(&shard->seq[slot], seq));
     return last_modified;
 }
 
+int datamgr_get_range(sensor_id_t sensor_id, time_t from, time_t to, sensor_data_t *out, int max) {
+    int slot, n;
+    unsigned int seq;
+    datamgr_shard_t *shard = datamgr_find(sensor_id, &slot);
+    if (shard == NULL || max <= 0) return 0;
+    do {
+        seq = seqlock_read_begin(&shard->seq[slot]);
+        n = 0;
+        const datamgr_history_t *history = shard->history[slot];
+        if (history == NULL) continue;
+        uint32_t count = history->count;
+        uint32_t oldest = count > DATAMGR_HISTORY_SIZE ? count - DATAMGR_HISTORY_SIZE : 0;
+        // newest first, the history is in timestamp order so the walk stops at the first reading before 'from'
+        for (uint32_t r = count; r > oldest && n < max; r--) {
+            time_t ts = history->ts[(r - 1) % DATAMGR_HISTORY_SIZE];
+            if (ts < from) break;
+            if (ts > to) continue;
+            out[max - 1 - n].id = sensor_id;
+            out[max - 1 - n].ts = ts;
+            out[max - 1 - n].value = history->value[(r - 1) % DATAMGR_HISTORY_SIZE];
+            n++;
+        }
+    } while (seqlock_read_retry(&shard->seq[slot], seq));
+    // the readings were filled in from the end of 'out'
+    memmove(out, out + max - n, n * sizeof(sensor_data_t));
+    return n;
+}
+
+double datamgr_get_percentile(sensor_id_t sensor_id, double q) {
+    int slot;
+    datamgr_sketch_t copy;
+    datamgr_shard_t *shard = datamgr_find(sensor_id, &slot);
+    if (shard == NULL || !sketch_read(&shard->sketch[slot], &copy)) return NAN;
+    ddsketch_merge(&copy.current, &copy.previous);
+    return ddsketch_quantile(&copy.current, q);
+}
+
+double datamgr_get_room_percentile(uint16_t room_id, double q) {
+    datamgr_sketch_t *copies = malloc(shard_count * sizeof(datamgr_sketch_t));
+    int *present = calloc(shard_count, sizeof(int));
+    ddsketch_t merged;
+    long newest = LONG_MIN;
+    if (copies == NULL || present == NULL) {
+        free(copies);
+        free(present);
+        return NAN;
+    }
+    // every shard has a partial sketch of the room, only the windows near the newest one are merged
+    for (int i = 0; i < shard_count; i++) {
+        present[i] = sketch_read(&shards[i].room_sketch[room_id], &copies[i]);
+        if (present[i] && copies[i].window > newest) newest = copies[i].window;
+    }
+    ddsketch_init(&merged);
+    for (int i = 0; i < shard_count; i++) {
+        if (!present[i]) continue;
+        if (copies[i].window == newest) {
+            ddsketch_merge(&merged, &copies[i].current);
+            ddsketch_merge(&merged, &copies[i].previous);
+        } else if (copies[i].window == newest - 1) {
+            ddsketch_merge(&merged, &copies[i].current);
+        }
+    }
+    free(copies);
+    free(present);
+    return ddsketch_quantile(&merged, q);
+}
+
 int datamgr_get_total_sensors() {
-    int total_sensors;
-    pthread_mutex_lock(&list_mutex);
-    total_sensors = dpl_size(list);
-    pthread_mutex_unlock(&list_mutex);
+    int total_sensors = 0;
+    unsigned int epoch = rcu_read_lock(&table_rcu);
+    datamgr_table_t *current = atomic_load(&table);
+    if (current != NULL) total_sensors = current->map->total_sensors;
+    rcu_read_unlock(&table_rcu, epoch);
     return total_sensors;
 }
+
+void datamgr_get_alert_stats(unsigned long *logged, unsigned long *dropped) {
+    *logged = atomic_load(&alerts_logged);
+    *dropped = atomic_load(&alerts_dropped);
+}
+
+void datamgr_get_reorder_stats(unsigned long *late, unsigned long *forced) {
+    *late = 0;
+    *forced = 0;
+    for (int i = 0; i < shard_count; i++) {
+        *late += atomic_load(&shards[i].late);
+        *forced += atomic_load(&shards[i].forced);
+    }
+}
+
+int datamgr_get_rollups(sensor_rollup_t *rollups, int max) {
+    if (rollup_queue == NULL) return 0;
+    int n = bqueue_pop_batch(rollup_queue, rollups, max, 0);
+    return n > 0 ? n : 0;
+}
+
+void datamgr_get_rollup_stats(unsigned long *closed, unsigned long *dropped) {
+    *closed = atomic_load(&rollups_closed);
+    *dropped = atomic_load(&rollups_dropped);
+}
+
+void datamgr_get_silence_stats(unsigned long *events, long *silent) {
+    *events = atomic_load(&silence_events);
+    *silent = atomic_load(&sensors_silent);
+}
+
+int datamgr_get_anomalies(anomaly_event_t *anomalies, int max) {
+    if (anomaly_db_queue == NULL) return 0;
+    int n = bqueue_pop_batch(anomaly_db_queue, anomalies, max, 0);
+    return n > 0 ? n : 0;
+}
+
+void datamgr_get_anomaly_stats(unsigned long *found, unsigned long *dropped) {
+    *found = atomic_load(&anomalies_found);
+    *dropped = atomic_load(&anomalies_dropped);
+}
+
+int datamgr_top_k(int k, int hottest, uint16_t *rooms, double *averages) {
+    int *items = malloc((k > 0 ? k : 1) * sizeof(int));
+    double *keys = malloc((k > 0 ? k : 1) * sizeof(double));
+    int n = 0;
+    if (items != NULL && keys != NULL) {
+        pthread_mutex_lock(&room_mutex);
+        if (coldest_rooms != NULL) n = iheap_smallest(hottest ? hottest_rooms : coldest_rooms, k, items, keys);
+        pthread_mutex_unlock(&room_mutex);
+    }
+    for (int i = 0; i < n; i++) {
+        rooms[i] = items[i];
+        if (averages != NULL) averages[i] = hottest ? -keys[i] : keys[i];
+    }
+    free(items);
+    free(keys);
+    return n;
+}
@@ -6,14 +6,85 @@
 #include <stdio.h>
 #include "config.h"
 #include "sbuffer.h"
+#include "threshold.h"
+#include "anomaly.h"
 #include "main.h"
 #include "datamgr.h"
-#include "lib/dplist.h"
 
 #ifndef RUN_AVG_LENGTH
 #define RUN_AVG_LENGTH 5
 #endif
 
+#ifndef DATAMGR_MAP_FILE
+#define DATAMGR_MAP_FILE "room_sensor.map"
+#endif
+
+#ifndef DATAMGR_RELOAD_POLL
+#define DATAMGR_RELOAD_POLL 1   // seconds between two checks of DATAMGR_MAP_FILE for changes
+#endif
+
+#ifndef DATAMGR_CHECKPOINT_FILE
+#define DATAMGR_CHECKPOINT_FILE "datamgr.ckpt"
+#endif
+
+#ifndef DATAMGR_CHECKPOINT_INTERVAL
+#define DATAMGR_CHECKPOINT_INTERVAL 30  // seconds between two checkpoints of the sensor state
+#endif
+
+#ifndef DATAMGR_WORKERS
+#define DATAMGR_WORKERS 1   // default number of aggregation threads (shards)
+#endif
+
+#define DATAMGR_MAX_WORKERS 64
+
+#ifndef DATAMGR_QUEUE_SIZE
+#define DATAMGR_QUEUE_SIZE 1024   // readings that can wait in front of one worker
+#endif
+
+#ifndef DATAMGR_BATCH_SIZE
+#define DATAMGR_BATCH_SIZE 64     // readings taken from the sbuffer or a worker queue at once, at most 255
+#endif
+
+#ifndef DATAMGR_ALLOWED_LATENESS
+#define DATAMGR_ALLOWED_LATENESS 2    // seconds a reading may arrive behind the newest one of its sensor or the clock
+#endif
+
+#ifndef DATAMGR_REORDER_SIZE
+#define DATAMGR_REORDER_SIZE 16   // readings one sensor can hold back while waiting for the watermark
+#endif
+
+#ifndef DATAMGR_HISTORY_SIZE
+#define DATAMGR_HISTORY_SIZE 512  // recent readings kept in memory per sensor for datamgr_get_range()
+#endif
+
+#ifndef DATAMGR_ROLLUP_PERIODS
+#define DATAMGR_ROLLUP_PERIODS {60, 3600}  // lengths in seconds of the tumbling rollup buckets
+#endif
+
+#ifndef DATAMGR_ROLLUP_QUEUE_SIZE
+#define DATAMGR_ROLLUP_QUEUE_SIZE 4096  // closed rollup buckets waiting for the storagemgr, more are dropped
+#endif
+
+#ifndef DATAMGR_SKETCH_WINDOW
+#define DATAMGR_SKETCH_WINDOW 300   // seconds per percentile sketch window, queries cover the last one to two windows
+#endif
+
+#ifndef DATAMGR_SILENCE_FACTOR
+#define DATAMGR_SILENCE_FACTOR 3  // a sensor is silent after this many of its reporting intervals without a reading
+#endif
+
+#ifndef DATAMGR_SILENCE_MIN
+#define DATAMGR_SILENCE_MIN TIMEOUT   // but never after less than this many seconds
+#endif
+
+#ifndef DATAMGR_ANOMALY_QUEUE_SIZE
+#define DATAMGR_ANOMALY_QUEUE_SIZE 1024   // anomalies waiting for the storagemgr, more are dropped
+#endif
+
+#ifndef DATAMGR_ALERT_QUEUE_SIZE
+#define DATAMGR_ALERT_QUEUE_SIZE 256    // threshold alerts or silence events waiting for the logger, more are dropped
+#endif
+
 #ifndef SET_MAX_TEMP
 #error SET_MAX_TEMP not set
 #endif
@@ -30,25 +101,6 @@
 #define MEMORY_ERROR "b" // error due to mem alloc failure
 #define INVALID_ERROR "a" //error due to sensor not found
 
-//global variables
-dplist_t *list;
-
-//callback functions
-void *element_copy(void *);
-
-void element_free(void **);
-
-int element_compare(void *, void *); //compares the ID of the element
-
-//struct with information about each sensor
-typedef struct sensors {
-    uint16_t sensor_id;
-    uint16_t room_id;
-    double running_avg;
-    time_t last_modified;
-    double temperatures[RUN_AVG_LENGTH];
-} sensor_t;
-
 /*
  * Use ERROR_HANDLER() for handling memory allocation problems, invalid sensor IDs, non-existing files, etc.
  */
@@ -59,13 +111,54 @@ typedef struct sensors {
                       }    \
                     } while(0)
 
+/**
+ * Prepares the datamgr to aggregate with 'workers' threads
+ * Sensors are partitioned over the workers by sensor id (sensor_id % workers), every worker owns
+ * the state of its own shard so workers never share a lock
+ * Queries read sensor state through per-sensor seqlocks: they never block a worker and a worker never waits on them
+ * Values outside [1, DATAMGR_MAX_WORKERS] are clamped. If not called, datamgr_parse_sensor_data uses DATAMGR_WORKERS
+ * \param workers the number of aggregation threads
+ */
+void datamgr_init(int workers);
+
+/**
+ * Loads per-room and per-sensor temperature limits, the file format is described in threshold.h
+ * Must be called before datamgr_parse_sensor_data(). Without it every sensor uses SET_MIN_TEMP and SET_MAX_TEMP
+ * \param fp the threshold configuration file
+ * \return zero for success, and non-zero if an error occurs
+ */
+int datamgr_load_thresholds(FILE *fp);
+
 /**
  * Reads continiously all data from the shared buffer data structure, parse the room_id's
  * and calculate the running avarage for all sensor ids
+ * Readings are routed to the worker owning their shard, the calling thread only dispatches and logs threshold alerts
+ * A sensor raises an alert when its running average leaves its limits and again when it returns, subject to the
+ * hysteresis, debouncing and rate limit of its rule. Alerts wait in a bounded queue, when it is full they are dropped
+ * Readings are applied in timestamp order per sensor: a reading is held back until a reading of the same sensor
+ * at least DATAMGR_ALLOWED_LATENESS seconds newer arrives, until the gateway clock is DATAMGR_ALLOWED_LATENESS seconds
+ * past its timestamp, or until DATAMGR_REORDER_SIZE readings are held back.
+ * Readings older than one that was already applied are dropped, see datamgr_get_reorder_stats()
+ * Every sensor learns its reporting interval from its timestamps. When nothing arrives from a sensor for
+ * DATAMGR_SILENCE_FACTOR intervals (at least DATAMGR_SILENCE_MIN seconds) it is logged as silent, and logged again
+ * when it reports again. The workers keep the deadlines in a heap, so they never scan all sensors
+ * Every reading also goes through the anomaly checks of anomaly.h (outliers, stuck values, sudden steps),
+ * anomalies are logged and handed to the storagemgr, see datamgr_get_anomalies()
+ * At startup the running averages are restored from DATAMGR_CHECKPOINT_FILE, which a background thread rewrites
+ * every DATAMGR_CHECKPOINT_INTERVAL seconds and once more when the method finishes
  * When *buffer becomes NULL the method finishes. This method will NOT automatically free all used memory
  **/
 void datamgr_parse_sensor_data(FILE *fp_sensor_map, sbuffer_t **buffer);
 
+/**
+ * Asks the datamgr to reload DATAMGR_MAP_FILE, safe to call from a signal handler (e.g. on SIGHUP)
+ * The map is also reloaded when the file changes. The new sensor to room table is built by a background thread
+ * and swapped in atomically: readings and queries never wait for it and the running averages of sensors
+ * that stay in the map are kept. Sensors that left the map stop counting towards their room in datamgr_top_k(), within
+ * DATAMGR_RELOAD_POLL seconds of the swap
+ */
+void datamgr_request_reload();
+
 /**
  * This method should be called to clean up the datamgr, and to free all used memory. 
  * After this, any call to datamgr_get_room_id, datamgr_get_avg, datamgr_get_last_modified 
@@ -97,10 +190,111 @@ double datamgr_get_avg(sensor_id_t sensor_id);
  */
 time_t datamgr_get_last_modified(sensor_id_t sensor_id);
 
+/**
+ * Copies the recent readings of a sensor with a timestamp in [from, to] out of the in-memory history,
+ * without touching the database. Only the last DATAMGR_HISTORY_SIZE readings of every sensor are kept
+ * (values as float), older readings have to be read from the database
+ * If more than 'max' readings match, the most recent 'max' are returned
+ * \param sensor_id the sensor id to look for
+ * \param from the oldest timestamp to return
+ * \param to the newest timestamp to return
+ * \param out filled out with the readings, oldest first
+ * \param max the size of 'out'
+ * \return the number of readings copied to 'out', 0 if the sensor is unknown
+ */
+int datamgr_get_range(sensor_id_t sensor_id, time_t from, time_t to, sensor_data_t *out, int max);
+
+/**
+ * Estimates a percentile of the readings of a sensor over the last DATAMGR_SKETCH_WINDOW to 2*DATAMGR_SKETCH_WINDOW
+ * seconds (counted from its newest reading), from a DDSketch: the result is within DDSKETCH_ALPHA (relative)
+ * \param sensor_id the sensor id to look for
+ * \param q the percentile as a fraction, e.g. 0.95 for p95
+ * \return the estimated percentile, NAN if the sensor is unknown or has no readings
+ */
+double datamgr_get_percentile(sensor_id_t sensor_id, double q);
+
+/**
+ * Estimates a percentile of the readings of all sensors in a room, like datamgr_get_percentile()
+ * The windows are counted from the newest reading in the room, the sketches of all workers are merged
+ * \param room_id the room id to look for
+ * \param q the percentile as a fraction, e.g. 0.95 for p95
+ * \return the estimated percentile, NAN if the room has no readings
+ */
+double datamgr_get_room_percentile(uint16_t room_id, double q);
+
+/**
+ * Returns the hottest or coldest rooms without scanning the sensors
+ * The average of a room is the mean of the running averages of its sensors that have a full window. The workers keep
+ * the rooms in a min-heap and a max-heap that are updated once per batch, so the result is at most a batch behind
+ * \param k the number of rooms wanted
+ * \param hottest non-zero for the hottest rooms (hottest first), zero for the coldest rooms (coldest first)
+ * \param rooms filled out with up to 'k' room ids
+ * \param averages filled out with the average of every room, may be NULL
+ * \return the number of rooms copied, less than 'k' if fewer rooms have an average
+ */
+int datamgr_top_k(int k, int hottest, uint16_t *rooms, double *averages);
+
 /**
  *  Return the total amount of unique sensor ID's recorded by the datamgr
  *  \return the total amount of sensors
  */
 int datamgr_get_total_sensors();
 
+/**
+ * Returns how many threshold alerts were logged and how many alerts or silence events were dropped because
+ * their queue was full
+ * \param logged filled out with the number of logged alerts
+ * \param dropped filled out with the number of dropped alerts
+ */
+void datamgr_get_alert_stats(unsigned long *logged, unsigned long *dropped);
+
+/**
+ * Returns how many readings were dropped for arriving too late, and how many were applied before the watermark
+ * passed them because the reorder buffer of their sensor was full
+ * \param late filled out with the number of dropped readings
+ * \param forced filled out with the number of readings released early
+ */
+void datamgr_get_reorder_stats(unsigned long *late, unsigned long *forced);
+
+/**
+ * Takes closed rollup buckets out of the datamgr without blocking, meant to be called by the storagemgr
+ * Every reading is added to one bucket per DATAMGR_ROLLUP_PERIODS period of its sensor and of its room.
+ * A bucket is closed by the first reading of its sensor or room that belongs to a later bucket, the buckets
+ * that are still open when the datamgr stops are closed as well. A room can get several partial buckets for the
+ * same period and start (one per worker), they have to be added up when stored
+ * \param rollups a pointer to pre-allocated space for at least 'max' buckets
+ * \param max the maximum number of buckets to take
+ * \return the number of buckets copied into 'rollups'
+ */
+int datamgr_get_rollups(sensor_rollup_t *rollups, int max);
+
+/**
+ * Returns how many rollup buckets were closed and how many of them were dropped because nobody took them in time
+ * \param closed filled out with the number of closed buckets
+ * \param dropped filled out with the number of dropped buckets
+ */
+void datamgr_get_rollup_stats(unsigned long *closed, unsigned long *dropped);
+
+/**
+ * Takes anomalies out of the datamgr without blocking, meant to be called by the storagemgr
+ * \param anomalies a pointer to pre-allocated space for at least 'max' anomalies
+ * \param max the maximum number of anomalies to take
+ * \return the number of anomalies copied into 'anomalies'
+ */
+int datamgr_get_anomalies(anomaly_event_t *anomalies, int max);
+
+/**
+ * Returns how many anomalies were found and how many of them were dropped before the storagemgr took them
+ * \param found filled out with the number of anomalies found
+ * \param dropped filled out with the number of anomalies the storagemgr never got
+ */
+void datamgr_get_anomaly_stats(unsigned long *found, unsigned long *dropped);
+
+/**
+ * Returns how many times a sensor went silent and how many sensors are silent right now
+ * \param events filled out with the number of times a sensor was declared silent
+ * \param silent filled out with the number of sensors that are silent now
+ */
+void datamgr_get_silence_stats(unsigned long *events, long *silent);
+
 #endif  //DATAMGR_H_
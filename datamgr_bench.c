@@ -0,0 +1,160 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+/*
+ * Measures how fast the datamgr ingests readings while other threads query it, to check that queries through the
+ * seqlocks do not slow the workers down. Every round feeds the same readings through the sbuffer, first without
+ * queries and then with the query threads running, and prints the ingest rate of both and the query rate
+ *
+ * usage: ./datamgr_bench [-w workers] [-q query threads] [-s sensors] [-n readings]
+ */
+
+#define _GNU_SOURCE     // needed for getopt with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "datamgr.h"
+
+#define BENCH_ROOMS 100     // sensors are spread over this many rooms
+
+typedef struct bench_feed {
+    sbuffer_t **buffer;
+    int sensors;
+    long readings;
+} bench_feed_t;
+
+static atomic_int queries_stop;
+static atomic_ulong queries_done;
+
+// the gateway logs through the fifo of main.c, here the messages are dropped
+void fifomgr_write(char *text) {
+    (void) text;
+}
+
+// milliseconds on the monotonic clock
+static double bench_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// plays the connmgr: inserts the readings, one per sensor per second, and stops the datamgr once they are taken
+static void *bench_feeder(void *arg) {
+    bench_feed_t *feed = arg;
+    sbuffer_t *buffer = *feed->buffer;
+    sensor_data_t data;
+    for (long i = 0; i < feed->readings; i++) {
+        data.id = 1 + i % feed->sensors;
+        data.value = 15 + i % 7;
+        data.ts = 1000000 + i / feed->sensors;
+        ERROR_HANDLER(sbuffer_insert(buffer, &data) != SBUFFER_SUCCESS, "sbuffer_insert() error");
+    }
+    while (sbuffer_size(buffer) > 0) usleep(100);
+    *feed->buffer = NULL;
+    return NULL;
+}
+
+// a client of the datamgr: mostly point lookups, now and then a range or a top-k query
+static void *bench_query(void *arg) {
+    int sensors = *(int *) arg;
+    unsigned int seed = (unsigned int) pthread_self();
+    sensor_data_t range[16];
+    uint16_t rooms[10];
+    unsigned long n = 0;
+    double sum = 0;
+    while (!atomic_load(&queries_stop)) {
+        sensor_id_t id = 1 + rand_r(&seed) % sensors;
+        sum += datamgr_get_avg(id);
+        sum += datamgr_get_last_modified(id);
+        if (n % 64 == 0) sum += datamgr_get_range(id, 0, INT32_MAX, range, 16);
+        if (n % 256 == 0) sum += datamgr_top_k(10, 1, rooms, NULL);
+        n += 2;
+    }
+    atomic_fetch_add(&queries_done, n);
+    return sum == -1 ? arg : NULL;      // keeps the calls from being optimised away
+}
+
+// one round: the ingest rate in readings per second, with 'queriers' query threads running meanwhile
+static double bench_round(int workers, int queriers, int sensors, long readings, double *query_rate) {
+    sbuffer_t *buffer;
+    pthread_t feeder, *query = malloc((queriers > 0 ? queriers : 1) * sizeof(pthread_t));
+    ERROR_HANDLER(query == NULL || sbuffer_init(&buffer) != SBUFFER_SUCCESS, "malloc() error");
+
+    // the sensor map, BENCH_ROOMS rooms
+    FILE *map = tmpfile();
+    ERROR_HANDLER(map == NULL, "tmpfile() error");
+    for (int id = 1; id <= sensors; id++) {
+        fprintf(map, "%d %d\n", 1 + id % BENCH_ROOMS, id);
+    }
+    rewind(map);
+
+    unlink(DATAMGR_CHECKPOINT_FILE);    // every round starts cold
+    datamgr_init(workers);
+    atomic_store(&queries_stop, 0);
+    atomic_store(&queries_done, 0);
+    for (int i = 0; i < queriers; i++) {
+        ERROR_HANDLER(pthread_create(&query[i], NULL, bench_query, &sensors) != 0, "pthread_create() error");
+    }
+    bench_feed_t feed = {&buffer, sensors, readings};
+    double start = bench_now_ms();
+    ERROR_HANDLER(pthread_create(&feeder, NULL, bench_feeder, &feed) != 0, "pthread_create() error");
+    sbuffer_t *owner = buffer;
+    datamgr_parse_sensor_data(map, &buffer);
+    double seconds = (bench_now_ms() - start) / 1e3;
+    atomic_store(&queries_stop, 1);
+    for (int i = 0; i < queriers; i++) {
+        pthread_join(query[i], NULL);
+    }
+    pthread_join(feeder, NULL);
+
+    *query_rate = atomic_load(&queries_done) / seconds;
+    datamgr_free();
+    sbuffer_free(&owner);
+    fclose(map);
+    free(query);
+    unlink(DATAMGR_CHECKPOINT_FILE);
+    return readings / seconds;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-w workers] [-q query threads] [-s sensors] [-n readings]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int workers = 4, queriers = 8, sensors = 1000, opt;
+    long readings = 2000000;
+    double query_rate;
+
+    while ((opt = getopt(argc, argv, "w:q:s:n:")) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'q':
+                queriers = atoi(optarg);
+                break;
+            case 's':
+                sensors = atoi(optarg);
+                break;
+            case 'n':
+                readings = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (workers < 1 || queriers < 0 || sensors < 1 || sensors >= UINT16_MAX || readings < 1) usage(argv[0]);
+
+    double alone = bench_round(workers, 0, sensors, readings, &query_rate);
+    printf("%d workers, no queries:         %.0f readings/s\n", workers, alone);
+    double loaded = bench_round(workers, queriers, sensors, readings, &query_rate);
+    printf("%d workers, %d query threads: %.0f readings/s (%.0f%%), %.0f queries/s\n", workers, queriers, loaded,
+           100 * loaded / alone, query_rate);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+/*
+ * Checks of the datamgr that need its worker threads running: readings go in through the sbuffer as from the connmgr
+ * and the results are read back with the query functions while the datamgr is still running
+ *
+ * usage: ./datamgr_test, exits with a non-zero status if a check fails
+ */
+
+#define _GNU_SOURCE     // needed for fmemopen and usleep with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "datamgr.h"
+
+#define TEST_WAIT_MS (1000 * (DATAMGR_ALLOWED_LATENESS + 3))    // how long a check waits for a reading to be applied
+
+static sbuffer_t *buffer;
+static int failures = 0;
+
+// the gateway logs through the fifo of main.c, here the messages are dropped
+void fifomgr_write(char *text) {
+    (void) text;
+}
+
+static void *test_datamgr(void *arg) {
+    datamgr_parse_sensor_data((FILE *) arg, &buffer);
+    return NULL;
+}
+
+static void test_insert(sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    sensor_data_t data = {id, value, ts};
+    ERROR_HANDLER(sbuffer_insert(buffer, &data) != SBUFFER_SUCCESS, "sbuffer_insert() error");
+}
+
+// waits until the newest applied reading of a sensor has timestamp 'ts', returns 0 if it does not happen in time
+static int test_wait_applied(sensor_id_t id, sensor_ts_t ts) {
+    for (int ms = 0; ms < TEST_WAIT_MS; ms += 10) {
+        if (datamgr_get_last_modified(id) == ts) return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+static void test_check(int ok, const char *name) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", name);
+    if (!ok) failures++;
+}
+
+// waits until datamgr_top_k() knows 'count' rooms, returns 0 if it does not happen in time
+static int test_wait_rooms(int count) {
+    uint16_t rooms[4];
+    for (int ms = 0; ms < TEST_WAIT_MS; ms += 10) {
+        if (datamgr_top_k(4, 1, rooms, NULL) == count) return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t datamgr;
+    sbuffer_t *owner;
+    unsigned long late, forced;
+    char map_text[] = "1 15\n1 21\n2 37\n2 40\n";
+
+    FILE *map = fmemopen(map_text, sizeof(map_text) - 1, "r");
+    ERROR_HANDLER(map == NULL || sbuffer_init(&buffer) != SBUFFER_SUCCESS, "malloc() error");
+    owner = buffer;
+    unlink(DATAMGR_CHECKPOINT_FILE);
+    datamgr_init(2);
+    ERROR_HANDLER(pthread_create(&datamgr, NULL, test_datamgr, map) != 0, "pthread_create() error");
+
+    // a single reading with nothing after it, from a sensor whose clock runs with the gateway
+    sensor_ts_t now = time(NULL);
+    test_insert(15, 18, now);
+    test_check(test_wait_applied(15, now), "a single live reading is applied without a newer one");
+
+    // a replayed reading from the past is already behind the watermark
+    test_insert(21, 18, 1000);
+    test_check(test_wait_applied(21, 1000), "a single old reading is applied without a newer one");
+
+    // two readings within the allowed lateness that arrive swapped are still applied in timestamp order
+    now = time(NULL);
+    test_insert(37, 18, now + 1);
+    test_insert(37, 19, now);
+    test_check(test_wait_applied(37, now + 1), "readings arriving out of order are applied in order");
+    datamgr_get_reorder_stats(&late, &forced);
+    test_check(late == 0 && forced == 0, "no reading was dropped or released early");
+
+    // a sensor removed from the map by a reload no longer counts towards its room
+    for (int i = 0; i < RUN_AVG_LENGTH; i++) {
+        test_insert(21, 18, 2000 + i);
+        test_insert(40, 18, 2000 + i);
+    }
+    test_check(test_wait_rooms(2), "both rooms have an average");
+    FILE *fp = fopen(DATAMGR_MAP_FILE, "w");
+    ERROR_HANDLER(fp == NULL, "fopen() error");
+    fputs("1 15\n1 21\n", fp);
+    fclose(fp);
+    datamgr_request_reload();
+    test_check(test_wait_rooms(1), "a room without sensors left has no average after a reload");
+
+    // stop the datamgr once it took everything from the sbuffer
+    while (sbuffer_size(owner) > 0) usleep(1000);
+    buffer = NULL;
+    pthread_join(datamgr, NULL);
+    datamgr_free();
+    sbuffer_free(&owner);
+    fclose(map);
+    unlink(DATAMGR_CHECKPOINT_FILE);
+    unlink(DATAMGR_MAP_FILE);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
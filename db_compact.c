@@ -0,0 +1,158 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+/*
+ * Converts the readings of a sensor database to the compact layout of sensor_db.c: every SensorData_<start>
+ * partition becomes a WITHOUT ROWID table keyed on (sensor_id, timestamp) with fixed-point values, and the rows of
+ * an unpartitioned SensorData table are moved to compact partitions. Everything happens in one transaction, so an
+ * interrupted run leaves the database as it was. Prints the size and bytes per reading before and after
+ *
+ * usage: ./db_compact [database], DB_NAME (Sensor.db) by default, with the gateway stopped
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include "sensor_db_layout.h"
+
+// the layout of sensor_db_layout.h as string literals, to paste into the SQL
+#define TABLE TO_STRING(TABLE_NAME)
+#define VALUE_SCALE TO_STRING(DB_VALUE_SCALE)
+
+#define CREATE_COMPACT "CREATE TABLE IF NOT EXISTS \"%s\" (sensor_id INT NOT NULL, timestamp INT NOT NULL," \
+                       " sensor_value INT, PRIMARY KEY (sensor_id, timestamp)) WITHOUT ROWID;"
+
+#define DB_ERROR(rc, db, error_msg)    do {                                  \
+                      if ((rc) != SQLITE_OK) {                               \
+                        printf("%s: %s\n", (error_msg), sqlite3_errmsg(db)); \
+                        sqlite3_close(db);                                   \
+                        exit(EXIT_FAILURE);                                  \
+                      }                                                      \
+                    } while(0)
+
+// runs a query that returns one integer
+static long long query_int(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt;
+    long long value = 0;
+    DB_ERROR(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL), db, "Query failed");
+    if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+// readings in the partitions and the unpartitioned table
+static long long count_readings(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    char sql[128];
+    long long rows = 0;
+    DB_ERROR(sqlite3_prepare_v2(db, "SELECT name FROM sqlite_master WHERE type = 'table' AND (name = '" TABLE
+                                    "' OR name GLOB '" TABLE "_[0-9-]*')", -1, &stmt, NULL), db, "Query failed");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        snprintf(sql, sizeof(sql), "SELECT count(*) FROM \"%s\"", (const char *) sqlite3_column_text(stmt, 0));
+        rows += query_int(db, sql);
+    }
+    sqlite3_finalize(stmt);
+    return rows;
+}
+
+static void report(sqlite3 *db, const char *when) {
+    long long bytes = query_int(db, "PRAGMA page_count") * query_int(db, "PRAGMA page_size");
+    long long rows = count_readings(db);
+    printf("%s: %lld bytes, %lld readings, %.1f bytes per reading\n", when, bytes, rows,
+           rows ? (double) bytes / rows : 0.0);
+}
+
+// rebuilds the rowid partition 'name' as a compact table with the same name
+static void convert_partition(sqlite3 *db, const char *name) {
+    char sql[1024], tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s_compact", name);
+    int n = snprintf(sql, sizeof(sql), CREATE_COMPACT, tmp);
+    snprintf(sql + n, sizeof(sql) - n,
+             " INSERT OR REPLACE INTO \"%s\" (sensor_id, sensor_value, timestamp)"
+             " SELECT sensor_id, CAST(round(sensor_value * " VALUE_SCALE ") AS INTEGER), timestamp"
+             " FROM \"%s\" ORDER BY sensor_id, timestamp;"
+             " DROP TABLE \"%s\"; ALTER TABLE \"%s\" RENAME TO \"%s\";", tmp, name, name, tmp, name);
+    DB_ERROR(sqlite3_exec(db, sql, 0, 0, 0), db, "Converting a partition failed");
+}
+
+// moves the rows of the unpartitioned table to compact partitions, in one pass over the table
+static long long split_unpartitioned(sqlite3 *db) {
+    sqlite3_stmt *select, *insert = NULL;
+    long long current = 0, rows = 0;
+    char sql[512], name[64];
+    DB_ERROR(sqlite3_prepare_v2(db, "SELECT sensor_id, sensor_value, timestamp FROM " TABLE, -1, &select, NULL),
+             db, "Reading " TABLE " failed");
+    while (sqlite3_step(select) == SQLITE_ROW) {
+        long long ts = sqlite3_column_int64(select, 2);
+        long long start = ts - ((ts % DB_PARTITION_SECONDS) + DB_PARTITION_SECONDS) % DB_PARTITION_SECONDS;
+        if (insert == NULL || start != current) {   // readings mostly arrive in time order, so this is rare
+            sqlite3_finalize(insert);
+            snprintf(name, sizeof(name), TABLE "_%lld", start);
+            snprintf(sql, sizeof(sql), CREATE_COMPACT, name);
+            DB_ERROR(sqlite3_exec(db, sql, 0, 0, 0), db, "Creating a partition failed");
+            snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO \"%s\" (sensor_id, sensor_value, timestamp)"
+                                       " VALUES (?, CAST(round(? * " VALUE_SCALE ") AS INTEGER), ?)", name);
+            DB_ERROR(sqlite3_prepare_v2(db, sql, -1, &insert, NULL), db, "Creating a partition failed");
+            current = start;
+        }
+        sqlite3_bind_int(insert, 1, sqlite3_column_int(select, 0));
+        sqlite3_bind_double(insert, 2, sqlite3_column_double(select, 1));
+        sqlite3_bind_int64(insert, 3, ts);
+        int rc = sqlite3_step(insert);
+        sqlite3_reset(insert);
+        DB_ERROR(rc == SQLITE_DONE ? SQLITE_OK : rc, db, "Moving a reading failed");
+        rows++;
+    }
+    sqlite3_finalize(insert);
+    sqlite3_finalize(select);
+    DB_ERROR(sqlite3_exec(db, "DROP TABLE " TABLE ";", 0, 0, 0), db, "Dropping " TABLE " failed");
+    return rows;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : TO_STRING(DB_NAME);
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+
+    DB_ERROR(sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL), db, "Couldn't open the database");
+    report(db, "before");
+    DB_ERROR(sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0), db, "Couldn't lock the database");
+
+    // the rowid partitions first, so the unpartitioned rows only meet compact ones
+    DB_ERROR(sqlite3_prepare_v2(db, "SELECT name FROM sqlite_master WHERE type = 'table'"
+                                    " AND name GLOB '" TABLE "_[0-9-]*' AND sql NOT LIKE '%WITHOUT ROWID%'",
+                                -1, &stmt, NULL), db, "Query failed");
+    int count = 0, capacity = 16;
+    char (*names)[64] = malloc(capacity * sizeof(*names));
+    while (names != NULL && sqlite3_step(stmt) == SQLITE_ROW) {
+        if (count == capacity) {
+            capacity *= 2;
+            names = realloc(names, capacity * sizeof(*names));
+            if (names == NULL) break;
+        }
+        snprintf(names[count++], sizeof(*names), "%s", (const char *) sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    if (names == NULL) {
+        printf("malloc() error\n");
+        sqlite3_close(db);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) convert_partition(db, names[i]);
+    free(names);
+
+    long long moved = 0;
+    if (query_int(db, "SELECT count(*) FROM sqlite_master WHERE type = 'table' AND name = '" TABLE "'")) {
+        moved = split_unpartitioned(db);
+    }
+    DB_ERROR(sqlite3_exec(db, "COMMIT;", 0, 0, 0), db, "Commit failed");
+    printf("converted %d partitions, moved %lld unpartitioned readings\n", count, moved);
+
+    // give the pages of the old tables back
+    DB_ERROR(sqlite3_exec(db, "VACUUM;", 0, 0, 0), db, "VACUUM failed");
+    report(db, "after");
+    sqlite3_close(db);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+/*
+ * Loads binary sensor_data files, as written by file_creator, into the sensor database with bulk_load(), to backfill
+ * readings without replaying them over TCP. The database is DB_NAME and its durability profile is taken from
+ * SENSOR_DB_DURABILITY, as in the gateway. Prints the counts and the load rate of every file
+ *
+ * usage: ./db_load [-j threads] [-n readings per commit] [-i] sensor_data...
+ *   -i creates the indexes of new partitions once at the end instead of with every row
+ */
+
+#define _GNU_SOURCE     // needed for getopt with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "bulk_load.h"
+
+// sensor_db.c logs through the gateway's log_event(), here the messages go to stdout
+void log_event(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-j threads] [-n readings per commit] [-i] sensor_data...\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    bulk_load_options_t options = {0};
+    bulk_load_stats_t stats;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:n:i")) != -1) {
+        switch (opt) {
+            case 'j':
+                options.threads = atoi(optarg);
+                break;
+            case 'n':
+                options.commit_rows = atoi(optarg);
+                break;
+            case 'i':
+                options.defer_index = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind == argc) usage(argv[0]);
+
+    DBCONN *conn = init_connection(0);
+    if (conn == NULL) {
+        printf("Couldn't open the database\n");
+        exit(EXIT_FAILURE);
+    }
+    int failures = 0;
+    for (int i = optind; i < argc; i++) {
+        if (bulk_load(conn, argv[i], &options, &stats) != 0) failures++;
+        printf("%s: %.0f records/s\n", argv[i], stats.seconds > 0 ? stats.records / stats.seconds : 0.0);
+    }
+    disconnect(conn);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
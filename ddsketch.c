@@ -0,0 +1,137 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#include <math.h>
+#include <string.h>
+#include "ddsketch.h"
+
+#define LOG_GAMMA log((1 + DDSKETCH_ALPHA) / (1 - DDSKETCH_ALPHA))
+
+static inline int32_t ddsketch_key(double magnitude) {
+    return (int32_t) ceil(log(magnitude) / LOG_GAMMA);
+}
+
+// the value a bin stands for, in the middle of its range so the relative error is at most alpha both ways
+static inline double ddsketch_value(int32_t key) {
+    double gamma = (1 + DDSKETCH_ALPHA) / (1 - DDSKETCH_ALPHA);
+    return exp(key * LOG_GAMMA) * 2 / (gamma + 1);
+}
+
+static void store_init(ddsketch_store_t *store) {
+    memset(store, 0, sizeof(ddsketch_store_t));
+}
+
+// moves the bins so keys lo .. hi fit, keys below lo are added to bin lo
+static void store_rebase(ddsketch_store_t *store, int32_t lo, int32_t hi) {
+    uint32_t bins[DDSKETCH_BINS] = {0};
+    int32_t offset = lo - (DDSKETCH_BINS - 1 - (hi - lo)) / 2;  // leave room on both sides
+    if (store->count > 0) {
+        for (int32_t key = store->lo; key <= store->hi; key++) {
+            uint32_t n = store->bins[key - store->offset];
+            if (n > 0) bins[(key < lo ? lo : key) - offset] += n;
+        }
+    }
+    memcpy(store->bins, bins, sizeof(bins));
+    store->offset = offset;
+}
+
+// makes room for the keys lo .. hi, returns the smallest key that is kept
+static int32_t store_reserve(ddsketch_store_t *store, int32_t lo, int32_t hi) {
+    if (store->count > 0) {
+        if (store->lo < lo) lo = store->lo;
+        if (store->hi > hi) hi = store->hi;
+    }
+    if (lo < hi - (DDSKETCH_BINS - 1)) lo = hi - (DDSKETCH_BINS - 1);   // collapse the smallest magnitudes
+    if (store->count == 0 || lo < store->offset || hi >= store->offset + DDSKETCH_BINS || lo > store->lo) {
+        store_rebase(store, lo, hi);
+    }
+    store->lo = lo;
+    store->hi = hi;
+    return lo;
+}
+
+static void store_add(ddsketch_store_t *store, int32_t key, uint32_t n) {
+    int32_t lo = store_reserve(store, key, key);
+    store->bins[(key < lo ? lo : key) - store->offset] += n;
+    store->count += n;
+}
+
+static void store_merge(ddsketch_store_t *dst, const ddsketch_store_t *src) {
+    if (src->count == 0) return;
+    int32_t lo = store_reserve(dst, src->lo, src->hi);
+    for (int32_t key = src->lo; key <= src->hi; key++) {
+        dst->bins[(key < lo ? lo : key) - dst->offset] += src->bins[key - src->offset];
+    }
+    dst->count += src->count;
+}
+
+void ddsketch_init(ddsketch_t *sketch) {
+    sketch->count = 0;
+    sketch->zero_count = 0;
+    sketch->min = INFINITY;
+    sketch->max = -INFINITY;
+    store_init(&sketch->positive);
+    store_init(&sketch->negative);
+}
+
+void ddsketch_add(ddsketch_t *sketch, double value) {
+    if (isnan(value)) return;
+    if (value > DDSKETCH_ZERO) {
+        store_add(&sketch->positive, ddsketch_key(value), 1);
+    } else if (value < -DDSKETCH_ZERO) {
+        store_add(&sketch->negative, ddsketch_key(-value), 1);
+    } else {
+        sketch->zero_count++;
+    }
+    sketch->count++;
+    if (value < sketch->min) sketch->min = value;
+    if (value > sketch->max) sketch->max = value;
+}
+
+void ddsketch_merge(ddsketch_t *dst, const ddsketch_t *src) {
+    if (src->count == 0) return;
+    store_merge(&dst->positive, &src->positive);
+    store_merge(&dst->negative, &src->negative);
+    dst->zero_count += src->zero_count;
+    dst->count += src->count;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+double ddsketch_quantile(const ddsketch_t *sketch, double q) {
+    if (sketch->count == 0) return NAN;
+    if (q <= 0) return sketch->min;
+    if (q >= 1) return sketch->max;
+    double rank = q * (sketch->count - 1);
+    double value = sketch->max;
+    uint64_t seen = 0;
+
+    // negative values come first, the largest magnitude first
+    const ddsketch_store_t *negative = &sketch->negative;
+    const ddsketch_store_t *positive = &sketch->positive;
+    if (rank < negative->count) {
+        for (int32_t key = negative->hi; key >= negative->lo; key--) {
+            seen += negative->bins[key - negative->offset];
+            if (seen > rank) {
+                value = -ddsketch_value(key);
+                break;
+            }
+        }
+    } else if (rank < negative->count + sketch->zero_count) {
+        value = 0;
+    } else {
+        seen = negative->count + sketch->zero_count;
+        for (int32_t key = positive->lo; key <= positive->hi; key++) {
+            seen += positive->bins[key - positive->offset];
+            if (seen > rank) {
+                value = ddsketch_value(key);
+                break;
+            }
+        }
+    }
+    // the extremes are known exactly
+    if (value < sketch->min) value = sketch->min;
+    if (value > sketch->max) value = sketch->max;
+    return value;
+}
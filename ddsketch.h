@@ -0,0 +1,76 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _DDSKETCH_H_
+#define _DDSKETCH_H_
+
+#include <stdint.h>
+
+#ifndef DDSKETCH_ALPHA
+#define DDSKETCH_ALPHA 0.02     // relative accuracy of the quantiles
+#endif
+
+#ifndef DDSKETCH_BINS
+#define DDSKETCH_BINS 128       // bins per sign, with DDSKETCH_ALPHA 0.02 they span a factor 160 in magnitude
+#endif
+
+#define DDSKETCH_ZERO 1e-9      // values closer to zero than this are counted as zero
+
+/**
+ * the bins of one sign: bin i counts the values with key 'offset + i'
+ * When a key does not fit, the bins of the smallest magnitudes are collapsed, so the memory stays fixed and only
+ * the quantiles near zero lose accuracy
+ */
+typedef struct ddsketch_store {
+    int32_t offset;             /**< key of bins[0] */
+    int32_t lo;                 /**< smallest key in use */
+    int32_t hi;                 /**< largest key in use */
+    uint32_t count;             /**< values in this store */
+    uint32_t bins[DDSKETCH_BINS];
+} ddsketch_store_t;
+
+/**
+ * a DDSketch: a mergeable quantile sketch with relative error DDSKETCH_ALPHA and a fixed size
+ * A value v > 0 goes to bin ceil(log(v) / log(gamma)) with gamma = (1 + alpha) / (1 - alpha), negative values
+ * go to a second store by magnitude. Adding a value is O(1), merging and quantiles are O(DDSKETCH_BINS)
+ * Two sketches can be merged if they were built with the same DDSKETCH_ALPHA
+ */
+typedef struct ddsketch {
+    uint32_t count;             /**< all values */
+    uint32_t zero_count;        /**< values counted as zero */
+    double min;
+    double max;
+    ddsketch_store_t positive;
+    ddsketch_store_t negative;
+} ddsketch_t;
+
+/**
+ * Empties a sketch
+ * \param sketch a pointer to the sketch
+ */
+void ddsketch_init(ddsketch_t *sketch);
+
+/**
+ * Adds a value to a sketch
+ * \param sketch a pointer to the sketch
+ * \param value the value
+ */
+void ddsketch_add(ddsketch_t *sketch, double value);
+
+/**
+ * Adds all values of 'src' to 'dst'
+ * \param dst a pointer to the sketch that is updated
+ * \param src a pointer to the sketch that is added
+ */
+void ddsketch_merge(ddsketch_t *dst, const ddsketch_t *src);
+
+/**
+ * Estimates a quantile, the result is within DDSKETCH_ALPHA (relative) of the exact quantile
+ * \param sketch a pointer to the sketch
+ * \param q the quantile in [0, 1], e.g. 0.95 for p95
+ * \return the estimated quantile, NAN if the sketch is empty
+ */
+double ddsketch_quantile(const ddsketch_t *sketch, double q);
+
+#endif  //_DDSKETCH_H_
@@ -0,0 +1,173 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#include <string.h>
+#include "gorilla.h"
+
+// the most bits one reading can take: a '1111' timestamp with 64 bits and a '11' value with 5 + 6 + 64 bits
+#define GORILLA_MAX_READING_BITS (4 + 64 + 2 + 5 + 6 + 64)
+
+#define GORILLA_NO_WINDOW 0xFF      // 'leading' before the first XOR is stored
+
+// doubles are XORed as their bit patterns
+static inline uint64_t value_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline double bits_value(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// appends the 'n' (<= 64) lowest bits of 'value', most significant first
+static void put_bits(gorilla_block_t *block, uint64_t value, int n) {
+    while (n > 0) {
+        int room = 8 - (block->bits & 7);
+        int take = n < room ? n : room;
+        uint8_t chunk = (uint8_t) ((value >> (n - take)) & ((1u << take) - 1));
+        block->data[block->bits >> 3] |= (uint8_t) (chunk << (room - take));
+        block->bits += take;
+        n -= take;
+    }
+}
+
+// reads 'n' (<= 64) bits, 0 past the end of the data (gorilla_next() checks for that)
+static uint64_t get_bits(gorilla_reader_t *reader, int n) {
+    uint64_t value = 0;
+    if (reader->pos + n > reader->size * 8) {
+        reader->pos = reader->size * 8 + 1;
+        return 0;
+    }
+    while (n > 0) {
+        int room = 8 - (reader->pos & 7);
+        int take = n < room ? n : room;
+        uint8_t byte = reader->data[reader->pos >> 3];
+        value = (value << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+        reader->pos += take;
+        n -= take;
+    }
+    return value;
+}
+
+void gorilla_init(gorilla_block_t *block) {
+    memset(block, 0, sizeof(gorilla_block_t));
+    block->leading = GORILLA_NO_WINDOW;
+}
+
+// delta-of-delta: '0' for 0, else a prefix and the value offset into a window of 7, 9 or 12 bits, or all 64 bits
+static void put_timestamp(gorilla_block_t *block, int64_t ts) {
+    int64_t delta = (int64_t) ((uint64_t) ts - (uint64_t) block->last_ts);
+    int64_t dod = (int64_t) ((uint64_t) delta - (uint64_t) block->last_delta);
+    if (dod == 0) {
+        put_bits(block, 0x0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        put_bits(block, 0x2, 2);
+        put_bits(block, (uint64_t) (dod + 63), 7);
+    } else if (dod >= -255 && dod <= 256) {
+        put_bits(block, 0x6, 3);
+        put_bits(block, (uint64_t) (dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        put_bits(block, 0xE, 4);
+        put_bits(block, (uint64_t) (dod + 2047), 12);
+    } else {
+        put_bits(block, 0xF, 4);
+        put_bits(block, (uint64_t) dod, 64);
+    }
+    block->last_delta = delta;
+    block->last_ts = ts;
+}
+
+// XOR with the previous value: '0' if equal, '10' and the bits in the previous window if they fit in it,
+// else '11', 5 bits of leading zeros, 6 bits of length (64 stored as 0) and the meaningful bits
+static void put_value(gorilla_block_t *block, uint64_t bits) {
+    uint64_t xor = bits ^ block->last_value;
+    block->last_value = bits;
+    if (xor == 0) {
+        put_bits(block, 0x0, 1);
+        return;
+    }
+    int leading = __builtin_clzll(xor);
+    int trailing = __builtin_ctzll(xor);
+    if (leading > 31) leading = 31;
+    if (block->leading != GORILLA_NO_WINDOW && leading >= block->leading && trailing >= block->trailing) {
+        put_bits(block, 0x2, 2);
+        put_bits(block, xor >> block->trailing, 64 - block->leading - block->trailing);
+        return;
+    }
+    int length = 64 - leading - trailing;
+    put_bits(block, 0x3, 2);
+    put_bits(block, (uint64_t) leading, 5);
+    put_bits(block, (uint64_t) (length & 63), 6);
+    put_bits(block, xor >> trailing, length);
+    block->leading = (uint8_t) leading;
+    block->trailing = (uint8_t) trailing;
+}
+
+int gorilla_append(gorilla_block_t *block, int64_t ts, double value) {
+    if (block->count == GORILLA_BLOCK_READINGS ||
+        block->bits + GORILLA_MAX_READING_BITS > GORILLA_BLOCK_BYTES * 8) {
+        return GORILLA_FULL;
+    }
+    if (block->count == 0) {
+        put_bits(block, (uint64_t) ts, 64);
+        put_bits(block, value_bits(value), 64);
+        block->last_ts = ts;
+        block->last_delta = 0;
+        block->last_value = value_bits(value);
+    } else {
+        put_timestamp(block, ts);
+        put_value(block, value_bits(value));
+    }
+    block->count++;
+    return GORILLA_SUCCESS;
+}
+
+void gorilla_reader_init(gorilla_reader_t *reader, const void *data, size_t size, int count) {
+    memset(reader, 0, sizeof(gorilla_reader_t));
+    reader->data = data;
+    reader->size = size;
+    reader->remaining = count;
+}
+
+int gorilla_next(gorilla_reader_t *reader, int64_t *ts, double *value) {
+    if (reader->remaining <= 0) return 0;
+    if (reader->pos == 0) {
+        reader->last_ts = (int64_t) get_bits(reader, 64);
+        reader->last_value = get_bits(reader, 64);
+    } else {
+        // timestamp: count the 1s of the prefix, up to 4
+        int prefix = 0;
+        while (prefix < 4 && get_bits(reader, 1)) prefix++;
+        static const int widths[] = {0, 7, 9, 12, 64};
+        static const int64_t offsets[] = {0, 63, 255, 2047, 0};
+        int64_t dod = 0;
+        if (prefix > 0) dod = (int64_t) (get_bits(reader, widths[prefix]) - (uint64_t) offsets[prefix]);
+        reader->last_delta = (int64_t) ((uint64_t) reader->last_delta + (uint64_t) dod);
+        reader->last_ts = (int64_t) ((uint64_t) reader->last_ts + (uint64_t) reader->last_delta);
+
+        // value
+        if (get_bits(reader, 1)) {
+            if (get_bits(reader, 1)) {
+                reader->leading = (uint8_t) get_bits(reader, 5);
+                int length = (int) get_bits(reader, 6);
+                if (length == 0) length = 64;
+                if (reader->leading + length > 64) return 0;    // not something gorilla_append() writes
+                reader->trailing = (uint8_t) (64 - reader->leading - length);
+            }
+            int length = 64 - reader->leading - reader->trailing;
+            reader->last_value ^= get_bits(reader, length) << reader->trailing;
+        }
+    }
+    if (reader->pos > reader->size * 8) {
+        reader->remaining = 0;
+        return 0;
+    }
+    reader->remaining--;
+    *ts = reader->last_ts;
+    *value = bits_value(reader->last_value);
+    return 1;
+}
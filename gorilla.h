@@ -0,0 +1,92 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _GORILLA_H_
+#define _GORILLA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef GORILLA_BLOCK_BYTES
+#define GORILLA_BLOCK_BYTES 4000    // encoded size of a block, with its row it still fits a 4096-byte SQLite page
+#endif
+
+#ifndef GORILLA_BLOCK_READINGS
+#define GORILLA_BLOCK_READINGS 2048 // readings of a block, bounds what a reader has to decode at once
+#endif
+
+#define GORILLA_SUCCESS 0
+#define GORILLA_FULL 1
+
+/**
+ * a block of readings of one sensor, compressed as in Facebook's Gorilla:
+ * the first timestamp and value are stored in full, after that every timestamp as the difference between its
+ * delta and the previous delta (0 bits for a steady interval) and every value as the XOR with the previous value,
+ * of which only the bits between the leading and trailing zeros are stored (1 bit for an unchanged value)
+ * Readings are kept in the order they are appended, late ones just give a negative delta
+ */
+typedef struct gorilla_block {
+    uint8_t data[GORILLA_BLOCK_BYTES];
+    uint32_t bits;              /**< bits of 'data' in use */
+    uint16_t count;             /**< readings in the block */
+    int64_t last_ts;
+    int64_t last_delta;
+    uint64_t last_value;        /**< bits of the previous value */
+    uint8_t leading;            /**< leading zeros of the previous stored XOR, the window the next one may reuse */
+    uint8_t trailing;           /**< trailing zeros of the previous stored XOR */
+} gorilla_block_t;
+
+/**
+ * reads the readings back from an encoded block, see gorilla_reader_init()
+ */
+typedef struct gorilla_reader {
+    const uint8_t *data;
+    size_t size;                /**< bytes of 'data' */
+    size_t pos;                 /**< next bit to read */
+    int remaining;              /**< readings not read yet */
+    int64_t last_ts;
+    int64_t last_delta;
+    uint64_t last_value;
+    uint8_t leading;
+    uint8_t trailing;
+} gorilla_reader_t;
+
+/**
+ * Empties a block
+ * \param block a pointer to the block
+ */
+void gorilla_init(gorilla_block_t *block);
+
+/**
+ * Appends a reading to a block
+ * \param block a pointer to the block
+ * \param ts the timestamp of the reading
+ * \param value the value of the reading
+ * \return GORILLA_SUCCESS, or GORILLA_FULL if the reading may not fit, the block is unchanged then
+ */
+int gorilla_append(gorilla_block_t *block, int64_t ts, double value);
+
+/**
+ * Starts reading an encoded block, e.g. one that was stored as a BLOB
+ * \param reader a pointer to the reader
+ * \param data the encoded block, gorilla_size() bytes of 'data' of a gorilla_block_t
+ * \param size the number of bytes of 'data'
+ * \param count the number of readings in the block
+ */
+void gorilla_reader_init(gorilla_reader_t *reader, const void *data, size_t size, int count);
+
+/**
+ * Reads the next reading of a block
+ * \param reader a pointer to the reader
+ * \param ts filled out with the timestamp
+ * \param value filled out with the value
+ * \return 1 if a reading was read, 0 at the end of the block or if the data ends too soon
+ */
+int gorilla_next(gorilla_reader_t *reader, int64_t *ts, double *value);
+
+static inline size_t gorilla_size(const gorilla_block_t *block) {
+    return (block->bits + 7) / 8;
+}
+
+#endif  //_GORILLA_H_
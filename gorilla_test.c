@@ -0,0 +1,140 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+/*
+ * Checks that gorilla_next() reads back exactly what gorilla_append() stored, timestamps and the bits of every value,
+ * for blocks filled until they are full with steady, late, far apart and special readings
+ *
+ * usage: ./gorilla_test, exits with a non-zero status if a check fails
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gorilla.h"
+
+#define TEST_ROUNDS 200         // blocks filled per kind of readings
+
+typedef enum {
+    TEST_STEADY,                // one reading a minute, temperatures with two decimals
+    TEST_LATE,                  // timestamps that go back as often as forward, random values
+    TEST_FAR,                   // timestamps anywhere in int64_t, the delta-of-delta takes all 64 bits
+    TEST_SPECIAL                // NaN, -0.0, infinities and denormals between ordinary values
+} test_kind_t;
+
+static int failures = 0;
+static gorilla_block_t block;
+static int64_t ts[GORILLA_BLOCK_READINGS];
+static double values[GORILLA_BLOCK_READINGS];
+
+static int64_t test_random64(void) {
+    return (int64_t) (((uint64_t) rand() << 62) ^ ((uint64_t) rand() << 31) ^ (uint64_t) rand());
+}
+
+// t + step, wrapping around like the deltas of the encoder instead of overflowing
+static int64_t test_step(int64_t t, int64_t step) {
+    return (int64_t) ((uint64_t) t + (uint64_t) step);
+}
+
+static double test_special(int i) {
+    static const double special[] = {NAN, -0.0, INFINITY, -INFINITY, 0.0, 5e-324, -NAN, 21.5};
+    return special[(i + rand() % 2) % (sizeof(special) / sizeof(special[0]))];
+}
+
+// fills the block until it is full, returns the number of readings appended
+static int test_fill(test_kind_t kind, int round) {
+    int64_t t = round % 4 == 0 ? INT64_MAX - 100000 : round % 4 == 1 ? INT64_MIN : 1700000000 + round * 3600;
+    double x = 20;
+    int n = 0;
+    gorilla_init(&block);
+    while (n < GORILLA_BLOCK_READINGS) {
+        switch (kind) {
+            case TEST_STEADY:
+                t = test_step(t, 60);
+                x = round % 2 ? x + (rand() % 3 - 1) * 0.01 : x;
+                break;
+            case TEST_LATE:
+                t = test_step(t, rand() % 7200 - 3600);
+                x = (double) rand() / RAND_MAX * 1e6 - 5e5;
+                break;
+            case TEST_FAR:
+                t = n % 3 == 0 ? (n % 2 ? INT64_MAX : INT64_MIN) : test_random64();
+                x = -x;
+                break;
+            case TEST_SPECIAL:
+                t = test_step(t, 60 + rand() % 3 - 1);
+                x = test_special(n);
+                break;
+        }
+        uint32_t before_bits = block.bits;
+        if (gorilla_append(&block, t, x) != GORILLA_SUCCESS) {
+            if (block.bits != before_bits || block.count != n) return -1;   // a full block is left as it was
+            break;
+        }
+        ts[n] = t;
+        values[n] = x;
+        n++;
+    }
+    return n;
+}
+
+// reads the block back, returns 1 if every reading has its timestamp and the same bits as its value
+static int test_read_back(int n) {
+    gorilla_reader_t reader;
+    int64_t t;
+    double x;
+    int i = 0;
+    gorilla_reader_init(&reader, block.data, gorilla_size(&block), block.count);
+    while (gorilla_next(&reader, &t, &x)) {
+        if (i == n || t != ts[i] || memcmp(&x, &values[i], sizeof(double)) != 0) return 0;
+        i++;
+    }
+    return i == n;
+}
+
+// reads the first half of the encoded block, returns 1 if the reader stops before the readings it does not have
+static int test_read_truncated(int n) {
+    gorilla_reader_t reader;
+    int64_t t;
+    double x;
+    int i = 0;
+    gorilla_reader_init(&reader, block.data, gorilla_size(&block) / 2, block.count);
+    while (gorilla_next(&reader, &t, &x)) {
+        if (i == n || t != ts[i] || memcmp(&x, &values[i], sizeof(double)) != 0) return 0;
+        i++;
+    }
+    return i < n;
+}
+
+static void test_check(int ok, const char *name) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", name);
+    if (!ok) failures++;
+}
+
+static void test_kind(test_kind_t kind, const char *name, const char *truncated_name) {
+    int ok = 1, truncated_ok = 1;
+    for (int round = 0; round < TEST_ROUNDS; round++) {
+        int n = test_fill(kind, round);
+        if (n <= 0 || !test_read_back(n)) ok = 0;
+        if (n > 1 && !test_read_truncated(n)) truncated_ok = 0;
+    }
+    test_check(ok, name);
+    if (truncated_name != NULL) test_check(truncated_ok, truncated_name);
+}
+
+int main(int argc, char *argv[]) {
+    srand(1);
+    test_kind(TEST_STEADY, "steady readings read back as appended", NULL);
+    test_kind(TEST_LATE, "late readings with negative deltas read back as appended",
+              "a truncated block stops early instead of reading past its data");
+    test_kind(TEST_FAR, "timestamps with 64-bit delta-of-deltas read back as appended", NULL);
+    test_kind(TEST_SPECIAL, "NaN, -0.0, infinities and denormals keep their bits", NULL);
+
+    // a steady minute interval with a value that does not change takes 2 bits a reading
+    test_fill(TEST_STEADY, 2);
+    test_check(block.count == GORILLA_BLOCK_READINGS && gorilla_size(&block) < GORILLA_BLOCK_READINGS,
+               "a steady, unchanged sensor fits a whole block in under a byte a reading");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
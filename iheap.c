@@ -0,0 +1,120 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#include <stdlib.h>
+#include "iheap.h"
+
+static inline void iheap_place(iheap_t *heap, int index, int item) {
+    heap->heap[index] = item;
+    heap->pos[item] = index;
+}
+
+static void iheap_sift_up(iheap_t *heap, int index) {
+    int item = heap->heap[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (heap->key[heap->heap[parent]] <= heap->key[item]) break;
+        iheap_place(heap, index, heap->heap[parent]);
+        index = parent;
+    }
+    iheap_place(heap, index, item);
+}
+
+static void iheap_sift_down(iheap_t *heap, int index) {
+    int item = heap->heap[index];
+    for (;;) {
+        int child = 2 * index + 1;
+        if (child >= heap->size) break;
+        if (child + 1 < heap->size && heap->key[heap->heap[child + 1]] < heap->key[heap->heap[child]]) child++;
+        if (heap->key[item] <= heap->key[heap->heap[child]]) break;
+        iheap_place(heap, index, heap->heap[child]);
+        index = child;
+    }
+    iheap_place(heap, index, item);
+}
+
+int iheap_init(iheap_t **heap, int capacity) {
+    if (heap == NULL || capacity <= 0) return IHEAP_FAILURE;
+    *heap = malloc(sizeof(iheap_t));
+    if (*heap == NULL) return IHEAP_FAILURE;
+    (*heap)->heap = malloc(capacity * sizeof(int));
+    (*heap)->pos = malloc(capacity * sizeof(int));
+    (*heap)->key = malloc(capacity * sizeof(double));
+    if ((*heap)->heap == NULL || (*heap)->pos == NULL || (*heap)->key == NULL) {
+        iheap_free(heap);
+        return IHEAP_FAILURE;
+    }
+    for (int i = 0; i < capacity; i++) {
+        (*heap)->pos[i] = -1;
+    }
+    (*heap)->size = 0;
+    (*heap)->capacity = capacity;
+    return IHEAP_SUCCESS;
+}
+
+void iheap_free(iheap_t **heap) {
+    if (heap == NULL || *heap == NULL) return;
+    free((*heap)->heap);
+    free((*heap)->pos);
+    free((*heap)->key);
+    free(*heap);
+    *heap = NULL;
+}
+
+void iheap_update(iheap_t *heap, int item, double key) {
+    int index = heap->pos[item];
+    if (index < 0) {
+        heap->key[item] = key;
+        iheap_place(heap, heap->size++, item);
+        iheap_sift_up(heap, heap->size - 1);
+        return;
+    }
+    double old_key = heap->key[item];
+    heap->key[item] = key;
+    if (key < old_key) iheap_sift_up(heap, index);
+    else iheap_sift_down(heap, index);
+}
+
+void iheap_remove(iheap_t *heap, int item) {
+    int index = heap->pos[item];
+    if (index < 0) return;
+    heap->pos[item] = -1;
+    int last = heap->heap[--heap->size];
+    if (index == heap->size) return;
+    // move the last item into the hole, it can have to go either way
+    iheap_place(heap, index, last);
+    iheap_sift_up(heap, index);
+    iheap_sift_down(heap, heap->pos[last]);
+}
+
+int iheap_peek(const iheap_t *heap, int *item, double *key) {
+    if (heap->size == 0) return IHEAP_EMPTY;
+    *item = heap->heap[0];
+    if (key != NULL) *key = heap->key[*item];
+    return IHEAP_SUCCESS;
+}
+
+int iheap_smallest(const iheap_t *heap, int k, int *items, double *keys) {
+    if (k <= 0 || heap->size == 0) return 0;
+    // best-first walk from the root: the next smallest item is always a child of one already taken
+    int *candidates = malloc((2 * k + 1) * sizeof(int));
+    if (candidates == NULL) return 0;
+    int n = 0, count = 1;
+    candidates[0] = 0;
+    while (n < k && count > 0) {
+        int best = 0;
+        for (int i = 1; i < count; i++) {
+            if (heap->key[heap->heap[candidates[i]]] < heap->key[heap->heap[candidates[best]]]) best = i;
+        }
+        int index = candidates[best];
+        candidates[best] = candidates[--count];
+        items[n] = heap->heap[index];
+        if (keys != NULL) keys[n] = heap->key[items[n]];
+        n++;
+        if (2 * index + 1 < heap->size) candidates[count++] = 2 * index + 1;
+        if (2 * index + 2 < heap->size) candidates[count++] = 2 * index + 2;
+    }
+    free(candidates);
+    return n;
+}
@@ -0,0 +1,83 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _IHEAP_H_
+#define _IHEAP_H_
+
+#include <stdlib.h>
+
+#define IHEAP_FAILURE -1
+#define IHEAP_SUCCESS 0
+#define IHEAP_EMPTY 1
+
+/**
+ * an indexed binary min-heap of the items 0 .. capacity-1, each with a key
+ * The position of every item is tracked, so the key of an item can be changed or the item removed in O(log n)
+ * Not thread-safe, the owner serialises access. For a max-heap, store negated keys
+ */
+typedef struct iheap {
+    int *heap;                  /**< items in heap order, heap[0] has the smallest key */
+    int *pos;                   /**< position of every item in 'heap', -1 if the item is not in the heap */
+    double *key;                /**< key of every item */
+    int size;                   /**< number of items in the heap */
+    int capacity;               /**< items are numbered 0 .. capacity-1 */
+} iheap_t;
+
+/**
+ * Allocates and initializes a new, empty heap
+ * \param heap a double pointer to the heap that needs to be initialized
+ * \param capacity the number of different items
+ * \return IHEAP_SUCCESS on success and IHEAP_FAILURE if an error occurred
+ */
+int iheap_init(iheap_t **heap, int capacity);
+
+/**
+ * All allocated resources are freed and cleaned up
+ * \param heap a double pointer to the heap that needs to be freed
+ */
+void iheap_free(iheap_t **heap);
+
+/**
+ * Inserts 'item' with 'key', or changes its key if it is already in the heap
+ * \param heap a pointer to the heap that is used
+ * \param item the item, in 0 .. capacity-1
+ * \param key the new key of the item
+ */
+void iheap_update(iheap_t *heap, int item, double key);
+
+/**
+ * Removes 'item' from the heap, nothing happens if it is not in the heap
+ * \param heap a pointer to the heap that is used
+ * \param item the item, in 0 .. capacity-1
+ */
+void iheap_remove(iheap_t *heap, int item);
+
+/**
+ * Returns the item with the smallest key without removing it
+ * \param heap a pointer to the heap that is used
+ * \param item filled out with the item
+ * \param key filled out with its key, may be NULL
+ * \return IHEAP_SUCCESS on success and IHEAP_EMPTY if the heap is empty
+ */
+int iheap_peek(const iheap_t *heap, int *item, double *key);
+
+/**
+ * Copies the 'k' items with the smallest keys, smallest first, without changing the heap, in O(k^2) whatever its size
+ * \param heap a pointer to the heap that is used
+ * \param k the number of items wanted
+ * \param items filled out with up to 'k' items
+ * \param keys filled out with their keys, may be NULL
+ * \return the number of items copied, less than 'k' if the heap holds fewer items
+ */
+int iheap_smallest(const iheap_t *heap, int k, int *items, double *keys);
+
+static inline int iheap_contains(const iheap_t *heap, int item) {
+    return heap->pos[item] >= 0;
+}
+
+static inline int iheap_size(const iheap_t *heap) {
+    return heap->size;
+}
+
+#endif  //_IHEAP_H_
@@ -1,4 +1,6 @@
+#include <stdarg.h>
 #include "main.h"
+#include "storage.h"
 
 void* start_conmgr(void * port) {
 int port_number;
@@ -22,20 +24,18 @@ return NULL;
 
 
 void* start_storagemgr(void * arg){
-DBCONN *conn = NULL;
+storage_t storage = {NULL, NULL};
 int connection_tries = 0;
     while(connection_tries < 3){
-            // open a connection to the database
-            conn = init_connection(1);
-
-            if(conn != NULL){
+            // open the storage backend chosen by STORAGE_BACKEND_ENV, Sensor.db by default
+            if(storage_open(&storage, 1) == 0){
                     break;
             }
             connection_tries++;
             sleep(1);
     }
 
-    if(conn == NULL){
+    if(storage.handle == NULL){
             
             log_event("Failed to connect to the database after 3 attempts\n");
             terminate();
@@ -48,10 +48,10 @@ int connection_tries = 0;
             log_event("Connection to SQL server established\n");
     }
     // let the storagemgr check the buffer and store the data to the database
-    storagemgr_parse_sensor_data(conn, &sbuffer);
+    storagemgr_parse_sensor_data(&storage, &sbuffer);
 
     // close the database connection
-    disconnect(conn);
+    storage_close(&storage);
 
     #ifdef DEBUG
     printf("Terminate storagemgr\n");
@@ -61,9 +61,14 @@ int connection_tries = 0;
         return NULL;
 }
 
+void handle_sighup(int signum){
+// only flags the reload, the datamgr rebuilds the sensor map on its own thread
+datamgr_request_reload();
+}
+
 void* start_datamgr(void * arg){
 //open the file with the sensor mapping
-FILE * fp= fopen("room_sensor.map","r");
+FILE * fp= fopen(DATAMGR_MAP_FILE,"r");
 if(fp == NULL){
 char* log_string;
 asprintf(&log_string, "Error opening file room_sensor.map in datamgr");
@@ -72,7 +77,15 @@ free(log_string);
 pthread_exit(NULL);
 }
 // Create datamgr
-datamgr_init();
+datamgr_init(DATAMGR_WORKERS);
+// load the per-room limits, without this file every room uses SET_MIN_TEMP/SET_MAX_TEMP
+FILE * fp_thresholds = fopen(THRESHOLD_FILE, "r");
+if(fp_thresholds != NULL){
+datamgr_load_thresholds(fp_thresholds);
+fclose(fp_thresholds);
+}
+// reload room_sensor.map on SIGHUP without restarting the gateway
+signal(SIGHUP, handle_sighup);
 //let the datamgr check the sbuffer
 datamgr_parse_sensor_data(fp, &sbuffer);
 
@@ -149,7 +162,7 @@ printf("[port_number] is the port number on which the gateway will listen for in
 }
 
 int log_sequence_number = 0;
-void log_event(char* log_message){
+void log_event(const char *fmt, ...){
     FILE* fp = fopen("gateway.log", "a"); //open file in append mode
     if(fp == NULL){
         printf("Error opening log file\n");
@@ -162,8 +175,12 @@ void log_event(char* log_message){
     strftime(timestamp, 20, "%Y-%m-%d %H:%M:%S", time_info);
     
     log_sequence_number++;
-    //write log message to file
-    fprintf(fp, "%d %s %s\n", log_sequence_number, timestamp, log_message);
+    //write log message to file, callers end their messages with a newline
+    va_list args;
+    va_start(args, fmt);
+    fprintf(fp, "%d %s ", log_sequence_number, timestamp);
+    vfprintf(fp, fmt, args);
+    va_end(args);
     fclose(fp);
 }
 
@@ -13,6 +13,7 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
 #include "connmgr.h"
 #include "sbuffer.h"
 #include "config.h"
@@ -39,6 +40,11 @@ void *start_conmgr(void *port);
 */
 void *start_datamgr(void *arg);
 
+/*
+* SIGHUP handler, asks the datamgr to reload the sensor map
+*/
+void handle_sighup(int signum);
+
 /*
 * This method handles the storagemgr 
 and tries to connect DB three times if first try failed.
@@ -88,4 +94,10 @@ void fifomgr_read();
  */
 void fifomgr_write(char *text);
 
+/*
+ * append a printf-style message to gateway.log, prefixed with a sequence number and a timestamp
+ * Defined by the gateway, tools that link sensor_db.c bring their own
+ */
+void log_event(const char *fmt, ...);
+
 #endif  //MAIN_H_
@@ -0,0 +1,56 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+#include <stdatomic.h>
+#include <sched.h>
+
+/**
+ * minimal read-copy-update for data that is replaced as a whole behind an atomic pointer
+ * Readers announce themselves in the counter of the current epoch and never wait for the updater
+ * The updater swaps the pointer, calls rcu_synchronize() and can then free the old data
+ */
+typedef struct rcu {
+    atomic_uint epoch;          /**< only the lowest bit is used to select a reader counter */
+    atomic_long readers[2];     /**< number of readers active in each epoch */
+} rcu_t;
+
+static inline void rcu_init(rcu_t *rcu) {
+    atomic_init(&rcu->epoch, 0);
+    atomic_init(&rcu->readers[0], 0);
+    atomic_init(&rcu->readers[1], 0);
+}
+
+/**
+ * Enters a read-side critical section, pointers loaded inside it stay valid until rcu_read_unlock()
+ * \return the epoch to pass to rcu_read_unlock()
+ */
+static inline unsigned int rcu_read_lock(rcu_t *rcu) {
+    for (;;) {
+        unsigned int epoch = atomic_load(&rcu->epoch) & 1u;
+        atomic_fetch_add(&rcu->readers[epoch], 1);
+        // the updater may have flipped the epoch in between, then register in the new one
+        if ((atomic_load(&rcu->epoch) & 1u) == epoch) return epoch;
+        atomic_fetch_sub(&rcu->readers[epoch], 1);
+    }
+}
+
+static inline void rcu_read_unlock(rcu_t *rcu, unsigned int epoch) {
+    atomic_fetch_sub(&rcu->readers[epoch], 1);
+}
+
+/**
+ * Waits until every reader that could still see the old pointer has left its critical section
+ * Call after publishing the new pointer, only one thread may update at a time
+ */
+static inline void rcu_synchronize(rcu_t *rcu) {
+    unsigned int epoch = atomic_fetch_add(&rcu->epoch, 1) & 1u;
+    while (atomic_load(&rcu->readers[epoch]) != 0) {
+        sched_yield();
+    }
+}
+
+#endif  //_RCU_H_
@@ -11,6 +11,7 @@ int sbuffer_init(sbuffer_t **buffer) {
     if (*buffer == NULL) return SBUFFER_FAILURE;
     (*buffer)->head = NULL;
     (*buffer)->tail = NULL;
+    (*buffer)->count = 0;
 
     // initialize mutex and condition variable
     if (pthread_mutex_init(&(*buffer)->mutex, NULL) != 0) {
@@ -19,6 +20,9 @@ int sbuffer_init(sbuffer_t **buffer) {
     if (pthread_cond_init(&(*buffer)->cond_var, NULL) != 0) {
         return SBUFFER_FAILURE;
     }
+    if (pthread_cond_init(&(*buffer)->not_full, NULL) != 0) {
+        return SBUFFER_FAILURE;
+    }
 
     return SBUFFER_SUCCESS;
 }
@@ -36,6 +40,9 @@ int sbuffer_free(sbuffer_t **buffer) {
     if (pthread_cond_destroy(&(*buffer)->cond_var) != 0) {
         return SBUFFER_FAILURE;
     }
+    if (pthread_cond_destroy(&(*buffer)->not_full) != 0) {
+        return SBUFFER_FAILURE;
+    }
 
     while ((*buffer)->head) {
         dummy = (*buffer)->head;
@@ -71,6 +78,8 @@ int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data) {
         buffer->head = buffer->head->next;
     }
     free(dummy);
+    buffer->count--;
+    pthread_cond_signal(&(buffer->not_full));
 
     // release mutex
     pthread_mutex_unlock(&(buffer->mutex));
@@ -78,6 +87,33 @@ int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data) {
     return SBUFFER_SUCCESS;
 }
 
+int sbuffer_remove_batch(sbuffer_t *buffer, sensor_data_t *data, int max) {
+    sbuffer_node_t *dummy;
+    int count = 0;
+    if (buffer == NULL || data == NULL) return SBUFFER_FAILURE;
+
+    // take the nodes off the list while holding the mutex, free them afterwards
+    pthread_mutex_lock(&(buffer->mutex));
+    sbuffer_node_t *first = buffer->head;
+    sbuffer_node_t *last = NULL;
+    while (buffer->head != NULL && count < max) {
+        last = buffer->head;
+        data[count++] = last->data;
+        buffer->head = last->next;
+    }
+    if (buffer->head == NULL) buffer->tail = NULL;
+    buffer->count -= count;
+    if (count > 0) pthread_cond_broadcast(&(buffer->not_full));
+    pthread_mutex_unlock(&(buffer->mutex));
+
+    while (count > 0 && first != NULL) {
+        dummy = first;
+        first = (dummy == last) ? NULL : dummy->next;
+        free(dummy);
+    }
+    return count;
+}
+
 
 int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
     sbuffer_node_t *dummy;
@@ -87,8 +123,11 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
     dummy->data = *data;
     dummy->next = NULL;
 
-    // lock the mutex before inserting data into the buffer
+    // lock the mutex before inserting data into the buffer, and wait for room if it is full
     pthread_mutex_lock(&buffer->mutex);
+    while (buffer->count >= SBUFFER_CAPACITY) {
+        pthread_cond_wait(&buffer->not_full, &buffer->mutex);
+    }
 
     if (buffer->tail == NULL) // buffer empty (buffer->head should also be NULL
     {
@@ -98,6 +137,7 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
         buffer->tail->next = dummy;
         buffer->tail = buffer->tail->next;
     }
+    buffer->count++;
 
     // unlock the mutex after inserting data into the buffer
     pthread_mutex_unlock(&buffer->mutex);
@@ -109,11 +149,11 @@ int sbuffer_get_data(sbuffer_t *buffer, sensor_data_t *data) {
     if (buffer == NULL) return SBUFFER_FAILURE;
 
     // Lock the buffer against writer threads
-    pthread_mutex_lock(&buffer_mutex);
+    pthread_mutex_lock(&buffer->mutex);
 
     // Check if there is any data available in the buffer
     if (buffer->head == NULL) {
-        pthread_mutex_unlock(&buffer_mutex);
+        pthread_mutex_unlock(&buffer->mutex);
         return SBUFFER_NO_DATA;
     }
 
@@ -121,7 +161,15 @@ int sbuffer_get_data(sbuffer_t *buffer, sensor_data_t *data) {
     *data = buffer->head->data;
 
     // Unlock the buffer
-    pthread_mutex_unlock(&buffer_mutex);
+    pthread_mutex_unlock(&buffer->mutex);
 
     return SBUFFER_SUCCESS;
 }
+
+size_t sbuffer_size(sbuffer_t *buffer) {
+    if (buffer == NULL) return 0;
+    pthread_mutex_lock(&buffer->mutex);
+    size_t count = buffer->count;
+    pthread_mutex_unlock(&buffer->mutex);
+    return count;
+}
@@ -15,6 +15,10 @@
 #define SBUFFER_SUCCESS 0
 #define SBUFFER_NO_DATA 1
 
+#ifndef SBUFFER_CAPACITY
+#define SBUFFER_CAPACITY 65536  // readings the buffer holds, sbuffer_insert waits while it is full
+#endif
+
 
 /**
  * basic node for the buffer, these nodes are linked together to create the buffer
@@ -32,6 +36,8 @@ typedef struct sbuffer {
     sbuffer_node_t *tail;       /**< a pointer to the last node in the buffer */
     pthread_mutex_t mutex;      /**< mutex to protect the shared data structure */
     pthread_cond_t cond_var;    /**< condition variable to signal availability of data in the shared buffer */
+    pthread_cond_t not_full;    /**< condition variable to signal free space to a waiting sbuffer_insert */
+    size_t count;               /**< number of nodes in the buffer, at most SBUFFER_CAPACITY */
 } sbuffer_t;
 
 
@@ -58,8 +64,20 @@ int sbuffer_free(sbuffer_t **buffer);
  */
 int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data);
 
+/**
+ * Removes up to 'max' sensor data from the head of 'buffer' in one locked operation
+ * If 'buffer' is empty, the function doesn't block but returns 0
+ * \param buffer a pointer to the buffer that is used
+ * \param data a pointer to pre-allocated space for at least 'max' sensor_data_t
+ * \param max the maximum number of sensor data to remove
+ * \return the number of sensor data copied into 'data', or SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_remove_batch(sbuffer_t *buffer, sensor_data_t *data, int max);
+
 /**
  * Inserts the sensor data in 'data' at the end of 'buffer' (at the 'tail')
+ * If 'buffer' already holds SBUFFER_CAPACITY sensor data, the function blocks until a reader removes some, so slow
+ * readers hold back the writers instead of growing the buffer
  * \param buffer a pointer to the buffer that is used
  * \param data a pointer to sensor_data_t data, that will be copied into the buffer
  * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occured
@@ -75,4 +93,12 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data);
 
 int sbuffer_get_data(sbuffer_t *buffer, sensor_data_t *data);
 
+/**
+ * Returns the number of sensor data in 'buffer', read under its mutex so it can be polled while other threads insert
+ * and remove
+ * \param buffer a pointer to the buffer that is used
+ * \return the number of sensor data in the buffer, 0 if 'buffer' is NULL
+ */
+size_t sbuffer_size(sbuffer_t *buffer);
+
 #endif  //_SBUFFER_H_
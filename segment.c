@@ -0,0 +1,467 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#define _GNU_SOURCE     // needed for mmap, msync and ftruncate with -std=c11
+
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "segment.h"
+
+#define SEGMENT_SENSOR_IDS (UINT16_MAX + 1)     // sensor_id_t is a uint16_t
+#define SEGMENT_SCAN_BATCH 256                  // readings a scan hands to its callback at once
+
+_Static_assert(sizeof(segment_header_t) == 64, "segment_header_t must stay 64 bytes");
+
+// a mapped segment file and where its parts are
+typedef struct segment_view {
+    uint8_t *map;
+    size_t size;
+    segment_header_t *header;
+    segment_zone_t *zones;
+    int64_t *ts;
+    double *values;
+} segment_view_t;
+
+// a full segment, its time range is kept so a scan skips it without opening the file
+typedef struct segment_closed {
+    uint32_t seq;
+    int64_t min_ts;
+    int64_t max_ts;
+} segment_closed_t;
+
+// the segment a sensor appends to, and the sensor's full ones
+typedef struct segment_file {
+    sensor_id_t id;
+    uint32_t seq;               // the file is SEGMENT_DIR/<id>-<seq>.seg
+    segment_view_t view;        // mapped read-write
+    uint32_t count;             // rows appended, the first header->count of them are committed
+    int64_t min_ts;             // oldest and newest appended timestamp
+    int64_t max_ts;
+    segment_closed_t *closed;   // oldest first
+    int closed_count;
+    int closed_capacity;
+} segment_file_t;
+
+struct segment_store {
+    segment_file_t *by_id[SEGMENT_SENSOR_IDS];
+    segment_file_t **open;      // the files of by_id that exist, to commit them
+    int count;
+    int capacity;
+    int64_t expire_after;       // lowest max_ts of a closed segment, segment_expire has nothing to do before it
+};
+
+static size_t segment_file_size(uint32_t rows, uint32_t stride) {
+    size_t zones = (rows + stride - 1) / stride;
+    return sizeof(segment_header_t) + zones * sizeof(segment_zone_t) + rows * (sizeof(int64_t) + sizeof(double));
+}
+
+static void segment_path(char *path, size_t size, sensor_id_t id, uint32_t seq) {
+    snprintf(path, size, TO_STRING(SEGMENT_DIR) "/%u-%u.seg", (unsigned) id, (unsigned) seq);
+}
+
+// reads <id>-<seq>.seg, returns 0 if 'name' is a segment file
+static int segment_parse_name(const char *name, unsigned *id, unsigned *seq) {
+    int end = 0;
+    if (sscanf(name, "%u-%u.seg%n", id, seq, &end) != 2 || name[end] != '\0' || *id >= SEGMENT_SENSOR_IDS) return -1;
+    return 0;
+}
+
+// points 'view' at the parts of a mapping after checking its header
+static int segment_view(segment_view_t *view, uint8_t *map, size_t size) {
+    segment_header_t *header = (segment_header_t *) map;
+    if (size < sizeof(segment_header_t) || header->magic != SEGMENT_MAGIC || header->rows == 0 ||
+        header->stride == 0 || header->count > header->rows || size < segment_file_size(header->rows, header->stride)) {
+        return -1;
+    }
+    size_t zones = (header->rows + header->stride - 1) / header->stride;
+    view->map = map;
+    view->size = size;
+    view->header = header;
+    view->zones = (segment_zone_t *) (map + sizeof(segment_header_t));
+    view->ts = (int64_t *) (view->zones + zones);
+    view->values = (double *) (view->ts + header->rows);
+    return 0;
+}
+
+// reads the header of a segment without mapping it
+static int segment_read_header(sensor_id_t id, uint32_t seq, segment_header_t *header) {
+    char path[64];
+    segment_path(path, sizeof(path), id, seq);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, header, sizeof(segment_header_t), 0);
+    close(fd);
+    return n == sizeof(segment_header_t) && header->magic == SEGMENT_MAGIC ? 0 : -1;
+}
+
+static int segment_map(const char *path, int writable, segment_view_t *view) {
+    struct stat st;
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps the file open
+    if (map == MAP_FAILED) return -1;
+    if (segment_view(view, map, st.st_size) != 0) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    return 0;
+}
+
+// creates the empty file SEGMENT_DIR/<id>-<seq>.seg, sparse until rows are written, and maps it into 'file'
+static int segment_create(segment_file_t *file, sensor_id_t id, uint32_t seq) {
+    char path[64];
+    size_t size = segment_file_size(SEGMENT_ROWS, SEGMENT_STRIDE);
+    segment_path(path, sizeof(path), id, seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_event("Creating segment %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_event("Creating segment %s failed: %s\n", path, strerror(errno));
+        unlink(path);
+        return -1;
+    }
+    segment_header_t *header = map;
+    header->magic = SEGMENT_MAGIC;
+    header->rows = SEGMENT_ROWS;
+    header->stride = SEGMENT_STRIDE;
+    header->sensor_id = id;
+    header->count = 0;
+    header->min_ts = INT64_MAX;
+    header->max_ts = INT64_MIN;
+    segment_view(&file->view, map, size);
+    file->id = id;
+    file->seq = seq;
+    file->count = 0;
+    file->min_ts = INT64_MAX;
+    file->max_ts = INT64_MIN;
+    return 0;
+}
+
+// maps the newest segment of a sensor to append to it, the rows after the committed ones are overwritten
+static int segment_reopen(segment_file_t *file, sensor_id_t id, uint32_t seq) {
+    char path[64];
+    segment_path(path, sizeof(path), id, seq);
+    if (segment_map(path, 1, &file->view) != 0) return -1;
+    segment_header_t *header = file->view.header;
+    file->id = id;
+    file->seq = seq;
+    file->count = header->count;
+    file->min_ts = header->min_ts;
+    file->max_ts = header->max_ts;
+    // the zone of the last rows may also hold timestamps of rows that were never committed
+    uint32_t first = file->count - file->count % header->stride;
+    if (first < file->count) {
+        segment_zone_t *zone = &file->view.zones[first / header->stride];
+        zone->min_ts = INT64_MAX;
+        zone->max_ts = INT64_MIN;
+        for (uint32_t i = first; i < file->count; i++) {
+            if (file->view.ts[i] < zone->min_ts) zone->min_ts = file->view.ts[i];
+            if (file->view.ts[i] > zone->max_ts) zone->max_ts = file->view.ts[i];
+        }
+    }
+    return 0;
+}
+
+// commits a segment: the rows reach the disk before the header that counts them
+static int segment_sync(segment_file_t *file) {
+    segment_header_t *header = file->view.header;
+    if (header->count == file->count) return 0;
+    if (msync(file->view.map, file->view.size, MS_SYNC) != 0) return -1;
+    header->min_ts = file->min_ts;
+    header->max_ts = file->max_ts;
+    header->count = file->count;
+    return msync(file->view.map, sizeof(segment_header_t), MS_SYNC);
+}
+
+static void segment_add_closed(segment_store_t *store, segment_file_t *file, uint32_t seq, int64_t min_ts,
+                               int64_t max_ts) {
+    if (file->closed_count == file->closed_capacity) {
+        file->closed_capacity = file->closed_capacity ? file->closed_capacity * 2 : 16;
+        file->closed = realloc(file->closed, file->closed_capacity * sizeof(segment_closed_t));
+        ERROR_HANDLER(file->closed == NULL, "malloc() error");
+    }
+    segment_closed_t *closed = &file->closed[file->closed_count++];
+    closed->seq = seq;
+    closed->min_ts = min_ts;
+    closed->max_ts = max_ts;
+    if (max_ts < store->expire_after) store->expire_after = max_ts;
+}
+
+static int segment_compare_seq(const void *a, const void *b) {
+    uint32_t x = ((const segment_closed_t *) a)->seq, y = ((const segment_closed_t *) b)->seq;
+    return (x > y) - (x < y);
+}
+
+static void segment_track(segment_store_t *store, segment_file_t *file) {
+    if (store->count == store->capacity) {
+        store->capacity = store->capacity ? store->capacity * 2 : 16;
+        store->open = realloc(store->open, store->capacity * sizeof(segment_file_t *));
+        ERROR_HANDLER(store->open == NULL, "malloc() error");
+    }
+    store->open[store->count++] = file;
+    store->by_id[file->id] = file;
+}
+
+segment_store_t *segment_open(char clear_up_flag) {
+    const char *dir_name = TO_STRING(SEGMENT_DIR);
+    if (mkdir(dir_name, 0755) != 0 && errno != EEXIST) {
+        log_event("Creating %s failed: %s\n", dir_name, strerror(errno));
+        return NULL;
+    }
+    DIR *dir = opendir(dir_name);
+    if (dir == NULL) {
+        log_event("Opening %s failed: %s\n", dir_name, strerror(errno));
+        return NULL;
+    }
+    segment_store_t *store = calloc(1, sizeof(segment_store_t));
+    uint32_t *next_seq = calloc(SEGMENT_SENSOR_IDS, sizeof(uint32_t));  // newest seq + 1 of every sensor, 0 if none
+    ERROR_HANDLER(store == NULL || next_seq == NULL, "malloc() error");
+    store->expire_after = INT64_MAX;
+
+    struct dirent *entry;
+    char path[64];
+    unsigned id, seq;
+    int removed = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (segment_parse_name(entry->d_name, &id, &seq) != 0) continue;
+        if (clear_up_flag) {
+            segment_path(path, sizeof(path), id, seq);
+            if (unlink(path) == 0) removed++;
+        } else if (seq + 1 > next_seq[id]) {
+            next_seq[id] = seq + 1;
+        }
+    }
+    if (clear_up_flag) log_event("Segments cleared up, %d files removed.\n", removed);
+
+    for (id = 0; id < SEGMENT_SENSOR_IDS; id++) {
+        if (next_seq[id] == 0) continue;
+        segment_file_t *file = calloc(1, sizeof(segment_file_t));
+        ERROR_HANDLER(file == NULL, "malloc() error");
+        // a newest file that cannot be read is left for inspection, the sensor continues in a new one
+        if (segment_reopen(file, id, next_seq[id] - 1) != 0 && segment_create(file, id, next_seq[id]) != 0) {
+            free(file);
+            continue;
+        }
+        segment_track(store, file);
+    }
+    free(next_seq);
+
+    // the time ranges of the full segments, from their headers
+    segment_header_t header;
+    rewinddir(dir);
+    while ((entry = readdir(dir)) != NULL) {
+        if (segment_parse_name(entry->d_name, &id, &seq) != 0) continue;
+        segment_file_t *file = store->by_id[id];
+        if (file == NULL || file->seq == seq) continue;
+        if (segment_read_header(id, seq, &header) != 0) {
+            log_event("Skipping segment %s, its header is damaged.\n", entry->d_name);
+            continue;
+        }
+        segment_add_closed(store, file, seq, header.min_ts, header.max_ts);
+    }
+    closedir(dir);
+    for (int i = 0; i < store->count; i++) {
+        segment_file_t *file = store->open[i];
+        if (file->closed_count > 1) qsort(file->closed, file->closed_count, sizeof(segment_closed_t), segment_compare_seq);
+    }
+    log_event("Segments opened, %d sensors.\n", store->count);
+    return store;
+}
+
+void segment_close(segment_store_t *store) {
+    segment_commit(store);
+    for (int i = 0; i < store->count; i++) {
+        munmap(store->open[i]->view.map, store->open[i]->view.size);
+        free(store->open[i]->closed);
+        free(store->open[i]);
+    }
+    free(store->open);
+    free(store);
+}
+
+int segment_insert(segment_store_t *store, const sensor_data_t *reading) {
+    segment_file_t *file = store->by_id[reading->id];
+    if (file == NULL) {
+        file = calloc(1, sizeof(segment_file_t));
+        ERROR_HANDLER(file == NULL, "malloc() error");
+        if (segment_create(file, reading->id, 0) != 0) {
+            free(file);
+            return -1;
+        }
+        segment_track(store, file);
+    } else if (file->count == file->view.header->rows) {
+        // full: commit it now, it is not mapped any more at the next commit
+        if (segment_sync(file) != 0) {
+            log_event("Committing segment %u-%u failed: %s\n", (unsigned) file->id, (unsigned) file->seq,
+                      strerror(errno));
+            return -1;
+        }
+        segment_view_t full = file->view;
+        segment_closed_t closed = {file->seq, file->min_ts, file->max_ts};
+        if (segment_create(file, file->id, file->seq + 1) != 0) return -1;
+        munmap(full.map, full.size);
+        segment_add_closed(store, file, closed.seq, closed.min_ts, closed.max_ts);
+    }
+
+    uint32_t row = file->count;
+    int64_t ts = reading->ts;
+    file->view.ts[row] = ts;
+    file->view.values[row] = reading->value;
+    segment_zone_t *zone = &file->view.zones[row / file->view.header->stride];
+    if (row % file->view.header->stride == 0) {
+        zone->min_ts = ts;
+        zone->max_ts = ts;
+    } else {
+        if (ts < zone->min_ts) zone->min_ts = ts;
+        if (ts > zone->max_ts) zone->max_ts = ts;
+    }
+    if (ts < file->min_ts) file->min_ts = ts;
+    if (ts > file->max_ts) file->max_ts = ts;
+    file->count++;
+    return 0;
+}
+
+int segment_commit(segment_store_t *store) {
+    int rc = 0;
+    for (int i = 0; i < store->count; i++) {
+        segment_file_t *file = store->open[i];
+        if (file->count == file->view.header->count) continue;
+        if (segment_sync(file) != 0) {
+            log_event("Committing segment %u-%u failed: %s\n", (unsigned) file->id, (unsigned) file->seq,
+                      strerror(errno));
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+// hands the rows of one mapped segment in [from, to) to 'f', returns 1 if 'f' stopped the scan
+static int segment_scan_view(const segment_view_t *view, uint32_t count, sensor_id_t id, sensor_ts_t from,
+                             sensor_ts_t to, segment_scan_t f, void *arg) {
+    sensor_data_t batch[SEGMENT_SCAN_BATCH];
+    int n = 0;
+    uint32_t stride = view->header->stride;
+    for (uint32_t first = 0; first < count; first += stride) {
+        const segment_zone_t *zone = &view->zones[first / stride];
+        if (zone->max_ts < from || zone->min_ts >= to) continue;    // the time index skips the whole zone
+        uint32_t last = first + stride < count ? first + stride : count;
+        for (uint32_t i = first; i < last; i++) {
+            if (view->ts[i] < from || view->ts[i] >= to) continue;
+            batch[n].id = id;
+            batch[n].value = view->values[i];
+            batch[n].ts = view->ts[i];
+            if (++n == SEGMENT_SCAN_BATCH) {
+                if (f(arg, batch, n) != 0) return 1;
+                n = 0;
+            }
+        }
+    }
+    return n > 0 && f(arg, batch, n) != 0;
+}
+
+int segment_scan(segment_store_t *store, sensor_id_t id, sensor_ts_t from, sensor_ts_t to, segment_scan_t f,
+                 void *arg) {
+    segment_file_t *file = store->by_id[id];
+    if (file == NULL) return 0;
+    int rc = 0;
+    char path[64];
+    for (int i = 0; i < file->closed_count; i++) {
+        const segment_closed_t *closed = &file->closed[i];
+        if (closed->max_ts < from || closed->min_ts >= to) continue;
+        segment_view_t view;
+        segment_path(path, sizeof(path), id, closed->seq);
+        if (segment_map(path, 0, &view) != 0) {
+            log_event("Reading segment %s failed.\n", path);
+            rc = -1;
+            continue;
+        }
+        madvise(view.map, view.size, MADV_SEQUENTIAL);
+        int stop = segment_scan_view(&view, view.header->count, id, from, to, f, arg);
+        munmap(view.map, view.size);
+        if (stop) return rc;
+    }
+    // the segment being appended to, with the rows of the open transaction
+    if (file->count > 0 && file->max_ts >= from && file->min_ts < to) {
+        segment_scan_view(&file->view, file->count, id, from, to, f, arg);
+    }
+    return rc;
+}
+
+int segment_expire(segment_store_t *store, sensor_ts_t ts) {
+    char path[64];
+    int dropped = 0;
+    if (ts <= store->expire_after) return 0;
+    store->expire_after = INT64_MAX;
+    for (int i = 0; i < store->count; i++) {
+        segment_file_t *file = store->open[i];
+        int kept = 0;
+        for (int j = 0; j < file->closed_count; j++) {
+            segment_closed_t *closed = &file->closed[j];
+            segment_path(path, sizeof(path), file->id, closed->seq);
+            if (closed->max_ts < ts && (unlink(path) == 0 || errno == ENOENT)) {
+                dropped++;
+            } else {
+                file->closed[kept++] = *closed;
+                if (closed->max_ts < store->expire_after) store->expire_after = closed->max_ts;
+            }
+        }
+        file->closed_count = kept;
+    }
+    return dropped;
+}
+
+// the storage_backend_t of the segment files
+
+static void *segment_backend_open(char clear_up_flag) {
+    return segment_open(clear_up_flag);
+}
+
+static void segment_backend_close(void *handle) {
+    segment_close(handle);
+}
+
+static int segment_backend_begin(void *handle) {
+    (void) handle;
+    return 0;   // rows become visible after a crash only once segment_commit() counts them
+}
+
+static int segment_backend_insert(void *handle, const sensor_data_t *reading) {
+    return segment_insert(handle, reading);
+}
+
+static int segment_backend_commit(void *handle) {
+    return segment_commit(handle);
+}
+
+static int segment_backend_expire(void *handle, sensor_ts_t ts) {
+    return segment_expire(handle, ts);
+}
+
+const storage_backend_t segment_backend = {
+        .name = "segment",
+        .open = segment_backend_open,
+        .close = segment_backend_close,
+        .begin = segment_backend_begin,
+        .insert = segment_backend_insert,
+        .commit = segment_backend_commit,
+        .expire = segment_backend_expire,
+        .insert_rollup = NULL,      // the segment files only hold readings
+        .insert_anomaly = NULL,
+};
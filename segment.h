@@ -0,0 +1,112 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#include <stdint.h>
+#include "storage.h"
+
+#ifndef SEGMENT_DIR
+#define SEGMENT_DIR segments        // directory of the segment files, <id>-<seq>.seg
+#endif
+
+#ifndef SEGMENT_ROWS
+#define SEGMENT_ROWS 65536          // readings of one segment file, a full segment is closed and the next one started
+#endif
+
+#ifndef SEGMENT_STRIDE
+#define SEGMENT_STRIDE 512          // readings per entry of the sparse time index of a segment
+#endif
+
+#define SEGMENT_MAGIC 0x31474553    // "SEG1"
+
+/**
+ * the first 64 bytes of a segment file
+ * After it come the time index, one segment_zone_t per SEGMENT_STRIDE rows, then the timestamp column, int64_t[rows],
+ * then the value column, double[rows]. Rows past 'count' were not committed and are ignored
+ */
+typedef struct segment_header {
+    uint32_t magic;
+    uint32_t rows;              /**< capacity of the columns */
+    uint32_t stride;            /**< rows per zone of the time index */
+    uint32_t sensor_id;
+    uint64_t count;             /**< committed rows, written after the rows themselves are on the disk */
+    int64_t min_ts;             /**< oldest and newest committed timestamp */
+    int64_t max_ts;
+    uint8_t reserved[24];
+} segment_header_t;
+
+/**
+ * an entry of the sparse time index: the oldest and newest timestamp of SEGMENT_STRIDE consecutive rows
+ * Rows are kept in the order they arrived, so a late reading only widens its zone
+ */
+typedef struct segment_zone {
+    int64_t min_ts;
+    int64_t max_ts;
+} segment_zone_t;
+
+typedef struct segment_store segment_store_t;
+
+/**
+ * a callback that receives the readings of a range scan, a batch at a time
+ * \return 0 to continue the scan, non-zero to stop it
+ */
+typedef int (*segment_scan_t)(void *arg, const sensor_data_t *readings, int count);
+
+/**
+ * Opens the segment files in SEGMENT_DIR, which is created if needed
+ * The newest segment of every sensor is mapped again to append to, after its last committed row
+ * \param clear_up_flag 1 deletes the segment files that are already there
+ * \return the store, NULL if an error occurs
+ */
+segment_store_t *segment_open(char clear_up_flag);
+
+/**
+ * Commits and unmaps the open segments and frees the store
+ * \param store the store
+ */
+void segment_close(segment_store_t *store);
+
+/**
+ * Appends a reading to the open segment of its sensor through the memory map, without a system call
+ * A full segment is committed and closed and the next one created
+ * \param store the store
+ * \param reading the reading
+ * \return zero for success, and non-zero if an error occurs
+ */
+int segment_insert(segment_store_t *store, const sensor_data_t *reading);
+
+/**
+ * Makes the readings appended since the previous commit durable: the rows are synced before the counts in the
+ * headers that make them visible after a crash
+ * \param store the store
+ * \return zero for success, and non-zero if a segment could not be synced
+ */
+int segment_commit(segment_store_t *store);
+
+/**
+ * Hands the readings of one sensor with from <= ts < to to 'f', segment by segment in the order they were written
+ * Closed segments are mapped read-only, segments and zones of the time index outside the range are skipped
+ * \param store the store
+ * \param id the sensor id
+ * \param from the oldest timestamp, inclusive
+ * \param to the newest timestamp, exclusive
+ * \param f the callback, returns non-zero to stop the scan
+ * \param arg passed to 'f'
+ * \return zero for success, and non-zero if a segment could not be read
+ */
+int segment_scan(segment_store_t *store, sensor_id_t id, sensor_ts_t from, sensor_ts_t to, segment_scan_t f,
+                 void *arg);
+
+/**
+ * Deletes the closed segments that only hold readings older than 'ts'
+ * Returns at once while 'ts' has not passed the newest reading of the oldest closed segment
+ * \param store the store
+ * \param ts the oldest timestamp to keep
+ * \return the number of segments deleted, -1 if an error occurs
+ */
+int segment_expire(segment_store_t *store, sensor_ts_t ts);
+
+#endif  //_SEGMENT_H_
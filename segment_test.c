@@ -0,0 +1,110 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+/*
+ * Checks of the segment store through a full cycle: readings are appended and committed, the store is closed and
+ * opened again, read back with segment_scan() and the full segments expired. Built with small segments, so a few
+ * thousand readings span several files
+ *
+ * usage: ./segment_test, exits with a non-zero status if a check fails
+ */
+
+#include "main.h"
+#include "segment.h"
+
+#define TEST_READINGS 3000      // readings of sensor 1, more than two segments of SEGMENT_ROWS
+#define TEST_FIRST_TS 1000      // timestamp of the first reading, the i-th one has TEST_FIRST_TS + i
+
+static int failures = 0;
+
+// the gateway logs to gateway.log, here the messages are dropped
+void log_event(const char *fmt, ...) {
+    (void) fmt;
+}
+
+// what a scan handed to its callback
+typedef struct test_scan {
+    int count;
+    int ordered;                // every reading has the timestamp and value it was appended with, in that order
+    sensor_ts_t first;
+    sensor_ts_t next;
+    int stop_after;             // readings after which the callback stops the scan, 0 to take all of them
+} test_scan_t;
+
+static int test_scan_cb(void *arg, const sensor_data_t *readings, int count) {
+    test_scan_t *scan = arg;
+    for (int i = 0; i < count; i++) {
+        if (scan->count == 0) {
+            scan->first = readings[i].ts;
+            scan->next = readings[i].ts;
+        }
+        if (readings[i].ts != scan->next || readings[i].value != (readings[i].ts - TEST_FIRST_TS) * 0.5) scan->ordered = 0;
+        scan->next = readings[i].ts + 1;
+        scan->count++;
+    }
+    return scan->stop_after > 0 && scan->count >= scan->stop_after;
+}
+
+static test_scan_t test_scan(segment_store_t *store, sensor_id_t id, sensor_ts_t from, sensor_ts_t to, int stop_after) {
+    test_scan_t scan = {0, 1, 0, 0, stop_after};
+    if (segment_scan(store, id, from, to, test_scan_cb, &scan) != 0) scan.ordered = 0;
+    return scan;
+}
+
+static void test_insert(segment_store_t *store, sensor_id_t id, int first, int last) {
+    for (int i = first; i < last; i++) {
+        sensor_data_t data = {id, i * 0.5, TEST_FIRST_TS + i};
+        ERROR_HANDLER(segment_insert(store, &data) != 0, "segment_insert() error");
+    }
+}
+
+static void test_check(int ok, const char *name) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", name);
+    if (!ok) failures++;
+}
+
+int main(int argc, char *argv[]) {
+    test_scan_t scan;
+    segment_store_t *store = segment_open(1);
+    ERROR_HANDLER(store == NULL, "segment_open() error");
+    test_insert(store, 1, 0, TEST_READINGS);
+    test_insert(store, 2, 0, 100);
+    test_check(segment_commit(store) == 0, "the appended readings are committed");
+    segment_close(store);
+
+    // the closed segments are found again from their headers, the open one is mapped after its last committed row
+    store = segment_open(0);
+    ERROR_HANDLER(store == NULL, "segment_open() error");
+    scan = test_scan(store, 1, 0, INT64_MAX, 0);
+    test_check(scan.count == TEST_READINGS && scan.ordered && scan.first == TEST_FIRST_TS,
+               "a reopened store scans every committed reading in order");
+    scan = test_scan(store, 1, TEST_FIRST_TS + 1500, TEST_FIRST_TS + 2500, 0);
+    test_check(scan.count == 1000 && scan.ordered && scan.first == TEST_FIRST_TS + 1500,
+               "a range scan returns from <= ts < to across segments");
+    scan = test_scan(store, 1, 0, INT64_MAX, 10);
+    test_check(scan.count < TEST_READINGS, "the callback stops a scan");
+    scan = test_scan(store, 3, 0, INT64_MAX, 0);
+    test_check(scan.count == 0 && scan.ordered, "a sensor without segments scans nothing");
+
+    // appending continues in the reopened segment
+    test_insert(store, 1, TEST_READINGS, TEST_READINGS + 10);
+    ERROR_HANDLER(segment_commit(store) != 0, "segment_commit() error");
+    scan = test_scan(store, 1, 0, INT64_MAX, 0);
+    test_check(scan.count == TEST_READINGS + 10 && scan.ordered, "readings appended after a reopen follow the others");
+
+    // expiring up to the start of the open segment deletes the two full ones, not the open one or other sensors
+    int dropped = segment_expire(store, TEST_FIRST_TS + 2 * SEGMENT_ROWS);
+    scan = test_scan(store, 1, 0, INT64_MAX, 0);
+    test_check(dropped == 2 && scan.count == TEST_READINGS + 10 - 2 * SEGMENT_ROWS &&
+               scan.first == TEST_FIRST_TS + 2 * SEGMENT_ROWS && scan.ordered, "expire deletes the full segments only");
+    scan = test_scan(store, 2, 0, INT64_MAX, 0);
+    test_check(scan.count == 100 && scan.ordered, "expire keeps the open segment of another sensor");
+    segment_close(store);
+
+    store = segment_open(1);
+    ERROR_HANDLER(store == NULL, "segment_open() error");
+    segment_close(store);
+    rmdir(TO_STRING(SEGMENT_DIR));
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
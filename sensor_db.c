@@ -1,139 +1,966 @@
+#define _GNU_SOURCE     // needed for clock_gettime with -std=c11
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include "sensor_db.h"
+#include "storage.h"
+#include "gorilla.h"
+
+#define DB_SENSOR_IDS (UINT16_MAX + 1)  // sensor_id_t is a uint16_t
+
+// the block one sensor is filling, written to its row again whenever it changed. Until it is closed the row ends
+// with the period, so the index entry of the row stays put while readings are appended
+typedef struct db_open_block {
+    sensor_id_t id;
+    sqlite3_int64 rowid;        // the row of the block, 0 until it is first written
+    int dirty;                  // readings were appended since the row was written
+    int moved;                  // a late reading moved 'first', so the index entry of the row must be updated
+    sensor_ts_t period;         // start of the DB_BLOCK_SECONDS the block covers, late readings still go in
+    sensor_ts_t first;          // oldest and newest reading
+    sensor_ts_t last;
+    gorilla_block_t block;
+} db_open_block_t;
+
+// the open blocks of a connection, looked up by sensor id, only allocated with DB_BLOCK_SECONDS > 0
+struct db_blocks {
+    db_open_block_t *by_id[DB_SENSOR_IDS];
+    db_open_block_t **open;     // the blocks of by_id that exist, to write the dirty ones
+    int count;
+    int capacity;
+};
+
+// SQL of every db_stmt_t, prepared once per connection
+static const char *db_stmt_sql[STMT_COUNT] = {
+        [STMT_INSERT_ROLLUP] = "INSERT INTO " TO_STRING(ROLLUP_TABLE_NAME)
+                               " (scope, id, period, start, count, sum, min, max)"
+                               " VALUES (?,?,?,?,?,?,?,?) ON CONFLICT (scope, id, period, start) DO UPDATE SET"
+                               " count = count + excluded.count, sum = sum + excluded.sum,"
+                               " min = MIN(min, excluded.min), max = MAX(max, excluded.max)",
+        [STMT_INSERT_ANOMALY] = "INSERT INTO " TO_STRING(ANOMALY_TABLE_NAME)
+                                " (sensor_id, room_id, kind, sensor_value, score, timestamp) VALUES (?,?,?,?,?,?)",
+        [STMT_FIND_ROLLUP_AFTER_TIMESTAMP] = "SELECT * FROM " TO_STRING(ROLLUP_TABLE_NAME)
+                                             " WHERE scope = ? AND id = ? AND period = ? AND start >= ? ORDER BY start",
+        [STMT_BEGIN] = "BEGIN IMMEDIATE",
+        [STMT_COMMIT] = "COMMIT",
+        [STMT_ROLLBACK] = "ROLLBACK",
+        [STMT_SCHEMA_VERSION] = "PRAGMA schema_version",
+        [STMT_LIST_PARTITIONS] = "SELECT name, sql LIKE '%WITHOUT ROWID%' FROM sqlite_master WHERE type = 'table' AND name GLOB '"
+                                 TO_STRING(TABLE_NAME) "_*'",
+        [STMT_INSERT_BLOCK] = "INSERT INTO " TO_STRING(BLOCK_TABLE_NAME)
+                              " (sensor_id, block_start, block_end, count, data) VALUES (?,?,?,?,?)",
+        [STMT_UPDATE_BLOCK] = "UPDATE " TO_STRING(BLOCK_TABLE_NAME)
+                              " SET block_start = ?, block_end = ?, count = ?, data = ? WHERE id = ? AND sensor_id = ?",
+        // leaves the indexed columns alone, so SQLite does not touch the index
+        [STMT_UPDATE_BLOCK_DATA] = "UPDATE " TO_STRING(BLOCK_TABLE_NAME)
+                                   " SET count = ?, data = ? WHERE id = ? AND sensor_id = ?",
+        [STMT_DROP_BLOCKS] = "DELETE FROM " TO_STRING(BLOCK_TABLE_NAME) " WHERE block_end < ?",
+        // the blocks that overlap [:from, :to), named parameters like the db_part_stmt_t
+        [STMT_FIND_BLOCKS_ALL] = "SELECT sensor_id, count, data FROM " TO_STRING(BLOCK_TABLE_NAME)
+                                 " WHERE block_end >= :from AND block_start < :to",
+        [STMT_FIND_BLOCKS_SENSOR] = "SELECT sensor_id, count, data FROM " TO_STRING(BLOCK_TABLE_NAME)
+                                    " WHERE sensor_id = :id AND block_end >= :from AND block_start < :to"
+                                    " ORDER BY block_end",
+        [STMT_FIND_BLOCKS_LATEST] = "SELECT sensor_id, count, data FROM " TO_STRING(BLOCK_TABLE_NAME)
+                                    " WHERE sensor_id = :id AND block_end >= :from AND block_start < :to"
+                                    " ORDER BY block_end DESC",
+        [STMT_CURSOR_BLOCKS_ALL] = "SELECT sensor_id, count, data FROM " TO_STRING(BLOCK_TABLE_NAME)
+                                   " WHERE block_end >= :from AND block_start < :to",
+        [STMT_CURSOR_BLOCKS_SENSOR] = "SELECT sensor_id, count, data FROM " TO_STRING(BLOCK_TABLE_NAME)
+                                      " WHERE sensor_id = :id AND block_end >= :from AND block_start < :to"
+                                      " ORDER BY block_end"
+};
+
+// SQL of every db_part_stmt_t for both layouts, %s is the quoted name of the partition table
+// the parameters are named so db_bind_args can bind any of them. Compact partitions return the same columns, with
+// a NULL id and the value scaled back, so callbacks do not see the difference
+#define DB_COMPACT_VALUE "sensor_value / " TO_STRING(DB_VALUE_SCALE) ".0"
+#define DB_COMPACT_COLUMNS "NULL AS id, sensor_id, " DB_COMPACT_VALUE " AS sensor_value, timestamp"
+
+static const char *db_part_stmt_sql[2][PSTMT_COUNT] = {
+        {
+                [PSTMT_INSERT] = "INSERT INTO %s (sensor_id, sensor_value, timestamp) VALUES (:id, :value, :ts)",
+                [PSTMT_FIND_ALL] = "SELECT * FROM %s",
+                [PSTMT_FIND_BY_VALUE] = "SELECT * FROM %s WHERE sensor_value = :value",
+                [PSTMT_FIND_EXCEED_VALUE] = "SELECT * FROM %s WHERE sensor_value > :value",
+                [PSTMT_FIND_BY_TIMESTAMP] = "SELECT * FROM %s WHERE timestamp = :ts",
+                [PSTMT_FIND_AFTER_TIMESTAMP] = "SELECT * FROM %s WHERE timestamp > :ts",
+                [PSTMT_FIND_RANGE] = "SELECT id, sensor_id, sensor_value, timestamp FROM %s"
+                                     " WHERE sensor_id = :id AND timestamp >= :from AND timestamp < :to"
+                                     " ORDER BY timestamp LIMIT :limit",
+                [PSTMT_FIND_LATEST] = "SELECT id, sensor_id, sensor_value, timestamp FROM %s"
+                                      " WHERE sensor_id = :id ORDER BY timestamp DESC LIMIT :limit",
+                [PSTMT_CURSOR_ALL] = "SELECT sensor_id, sensor_value, timestamp FROM %s"
+                                     " WHERE timestamp >= :from AND timestamp < :to",
+                [PSTMT_CURSOR_SENSOR] = "SELECT sensor_id, sensor_value, timestamp FROM %s"
+                                        " WHERE sensor_id = :id AND timestamp >= :from AND timestamp < :to"
+                                        " ORDER BY timestamp"
+        },
+        {
+                // :value is bound already scaled by insert_sensor, the queries scale it themselves
+                [PSTMT_INSERT] = "INSERT OR REPLACE INTO %s (sensor_id, sensor_value, timestamp) VALUES (:id, :value, :ts)",
+                [PSTMT_FIND_ALL] = "SELECT " DB_COMPACT_COLUMNS " FROM %s",
+                [PSTMT_FIND_BY_VALUE] = "SELECT " DB_COMPACT_COLUMNS " FROM %s"
+                                        " WHERE sensor_value = round(:value * " TO_STRING(DB_VALUE_SCALE) ")",
+                [PSTMT_FIND_EXCEED_VALUE] = "SELECT " DB_COMPACT_COLUMNS " FROM %s"
+                                            " WHERE sensor_value > :value * " TO_STRING(DB_VALUE_SCALE),
+                [PSTMT_FIND_BY_TIMESTAMP] = "SELECT " DB_COMPACT_COLUMNS " FROM %s WHERE timestamp = :ts",
+                [PSTMT_FIND_AFTER_TIMESTAMP] = "SELECT " DB_COMPACT_COLUMNS " FROM %s WHERE timestamp > :ts",
+                [PSTMT_FIND_RANGE] = "SELECT " DB_COMPACT_COLUMNS " FROM %s"
+                                     " WHERE sensor_id = :id AND timestamp >= :from AND timestamp < :to"
+                                     " ORDER BY timestamp LIMIT :limit",
+                [PSTMT_FIND_LATEST] = "SELECT " DB_COMPACT_COLUMNS " FROM %s"
+                                      " WHERE sensor_id = :id ORDER BY timestamp DESC LIMIT :limit",
+                [PSTMT_CURSOR_ALL] = "SELECT sensor_id, " DB_COMPACT_VALUE ", timestamp FROM %s"
+                                     " WHERE timestamp >= :from AND timestamp < :to",
+                [PSTMT_CURSOR_SENSOR] = "SELECT sensor_id, " DB_COMPACT_VALUE ", timestamp FROM %s"
+                                        " WHERE sensor_id = :id AND timestamp >= :from AND timestamp < :to"
+                                        " ORDER BY timestamp"
+        }
+};
+
+// a partition table and its covering index for the per-sensor range queries, %s is the quoted table name and
+// %lld the partition start (the rowid id is part of every index, so the range queries never read the table)
+#define DB_CREATE_PARTITION "CREATE TABLE IF NOT EXISTS %s (id INTEGER PRIMARY KEY, sensor_id INT," \
+                            " sensor_value DECIMAL(4, 2), timestamp TIMESTAMP);"
+#define DB_CREATE_PARTITION_INDEX " CREATE INDEX IF NOT EXISTS \"" TO_STRING(TABLE_NAME) "_%lld_sensor_ts\" ON %s" \
+                                  " (sensor_id, timestamp, sensor_value);"
+
+// a compact partition: the table is its own (sensor_id, timestamp) index, about a third of the bytes per reading
+#define DB_CREATE_COMPACT_PARTITION "CREATE TABLE IF NOT EXISTS %s (sensor_id INT NOT NULL, timestamp INT NOT NULL," \
+                                    " sensor_value INT, PRIMARY KEY (sensor_id, timestamp)) WITHOUT ROWID;"
+
+#define DB_TS_MIN ((sensor_ts_t) INT64_MIN)     // sensor_ts_t is a 64-bit time_t
+#define DB_TS_MAX ((sensor_ts_t) INT64_MAX)
+
+#define DB_BLOCK_PERIOD (DB_BLOCK_SECONDS > 0 ? DB_BLOCK_SECONDS : 1)   // never divide by 0 when blocks are off
+
+// the values db_bind_args binds to the named parameters of a db_part_stmt_t
+typedef struct db_args {
+    sensor_id_t id;
+    sensor_value_t value;
+    sensor_ts_t ts;
+    sensor_ts_t from;
+    sensor_ts_t to;
+    int limit;
+} db_args_t;
+
+// the pragmas of every db_durability_t, each profile sets all of them so profiles can be switched at run time
+static const char *db_durability_sql[] = {
+        [DB_SAFE] = "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL; PRAGMA temp_store=DEFAULT;"
+                    " PRAGMA cache_size=-2000; PRAGMA mmap_size=0;",
+        [DB_BALANCED] = "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL; PRAGMA temp_store=DEFAULT;"
+                        " PRAGMA cache_size=-2000; PRAGMA mmap_size=0;",
+        [DB_FAST] = "PRAGMA journal_mode=WAL; PRAGMA synchronous=OFF; PRAGMA temp_store=MEMORY;"
+                    " PRAGMA cache_size=-" TO_STRING(DB_FAST_CACHE_KB) "; PRAGMA mmap_size=" TO_STRING(DB_FAST_MMAP_SIZE) ";"
+};
+
+static const char *db_durability_names[] = {
+        [DB_SAFE] = "safe",
+        [DB_BALANCED] = "balanced",
+        [DB_FAST] = "fast"
+};
+
+// finalizes the statements that were prepared and closes the database, returns the sqlite3_close result
+static int db_close(DBCONN *conn) {
+    for (int i = 0; i < STMT_COUNT; i++) {
+        sqlite3_finalize(conn->stmt[i]);    // a no-op for NULL
+        conn->stmt[i] = NULL;
+    }
+    for (int i = 0; i < conn->partition_count; i++) {
+        for (int j = 0; j < PSTMT_COUNT; j++) {
+            sqlite3_finalize(conn->partitions[i].stmt[j]);
+        }
+    }
+    free(conn->partitions);
+    conn->partitions = NULL;
+    conn->partition_count = conn->partition_capacity = 0;
+    if (conn->blocks != NULL) {
+        for (int i = 0; i < conn->blocks->count; i++) {
+            free(conn->blocks->open[i]);
+        }
+        free(conn->blocks->open);
+        free(conn->blocks);
+        conn->blocks = NULL;
+    }
+    free(conn->decoded);
+    conn->decoded = NULL;
+    return sqlite3_close(conn->db);
+}
+
+// milliseconds on the monotonic clock
+static double db_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// runs one of the statements without parameters or rows, BEGIN, COMMIT or ROLLBACK
+static int db_step(DBCONN *conn, db_stmt_t id) {
+    int rc = sqlite3_step(conn->stmt[id]);
+    sqlite3_reset(conn->stmt[id]);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+sensor_ts_t partition_start(sensor_ts_t ts) {
+    sensor_ts_t offset = ts % DB_PARTITION_SECONDS;
+    if (offset < 0) offset += DB_PARTITION_SECONDS;
+    return ts - offset;
+}
+
+// the quoted name of the partition table that starts at 'start'
+static void db_partition_name(char *name, size_t size, sensor_ts_t start) {
+    snprintf(name, size, "\"" TO_STRING(TABLE_NAME) "_%lld\"", (long long) start);
+}
+
+static void db_partition_finalize(db_partition_t *partition) {
+    for (int i = 0; i < PSTMT_COUNT; i++) {
+        sqlite3_finalize(partition->stmt[i]);
+        partition->stmt[i] = NULL;
+    }
+}
+
+// index of the first partition that ends after 'ts', partition_count if there is none
+static int db_partition_search(DBCONN *conn, sensor_ts_t ts) {
+    int lo = 0, hi = conn->partition_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (conn->partitions[mid].start + DB_PARTITION_SECONDS <= ts) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// inserts an empty partition at 'index' of the sorted array
+static void db_partition_add(DBCONN *conn, int index, sensor_ts_t start, int compact) {
+    if (conn->partition_count == conn->partition_capacity) {
+        conn->partition_capacity = conn->partition_capacity ? conn->partition_capacity * 2 : 16;
+        conn->partitions = realloc(conn->partitions, conn->partition_capacity * sizeof(db_partition_t));
+        ERROR_HANDLER(conn->partitions == NULL, "malloc() error");
+    }
+    memmove(&conn->partitions[index + 1], &conn->partitions[index],
+            (conn->partition_count - index) * sizeof(db_partition_t));
+    memset(&conn->partitions[index], 0, sizeof(db_partition_t));
+    conn->partitions[index].start = start;
+    conn->partitions[index].compact = compact;
+    conn->partition_count++;
+}
+
+static int db_compare_start(const void *a, const void *b) {
+    sensor_ts_t x = ((const db_partition_t *) a)->start, y = ((const db_partition_t *) b)->start;
+    return (x > y) - (x < y);
+}
+
+// re-reads the partition tables if the schema changed since they were listed, e.g. another connection added or
+// dropped one. The statements of the partitions that still exist are kept. Not while a cursor reads a partition
+static int db_refresh_partitions(DBCONN *conn) {
+    if (conn->cursors) return SQLITE_OK;
+    sqlite3_stmt *stmt = conn->stmt[STMT_SCHEMA_VERSION];
+    int rc = sqlite3_step(stmt);
+    int version = sqlite3_column_int(stmt, 0);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_ROW) return rc;
+    if (version == conn->schema_version) return SQLITE_OK;
+
+    db_partition_t *old = conn->partitions;
+    int old_count = conn->partition_count;
+    conn->partitions = NULL;
+    conn->partition_count = conn->partition_capacity = 0;
+    conn->compact = DB_COMPACT;
+    stmt = conn->stmt[STMT_LIST_PARTITIONS];
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *suffix = (const char *) sqlite3_column_text(stmt, 0) + strlen(TO_STRING(TABLE_NAME) "_");
+        char *end;
+        long long start = strtoll(suffix, &end, 10);
+        if (*suffix == '\0' || *end != '\0') continue;  // not a partition
+        int compact = sqlite3_column_int(stmt, 1);
+        db_partition_add(conn, conn->partition_count, (sensor_ts_t) start, compact);
+        conn->compact |= compact;   // once migrated, a database stays compact
+    }
+    sqlite3_reset(stmt);
+    if (conn->partition_count > 1) qsort(conn->partitions, conn->partition_count, sizeof(db_partition_t), db_compare_start);
+    for (int i = 0; i < old_count; i++) {
+        int index = db_partition_search(conn, old[i].start);
+        if (index < conn->partition_count && conn->partitions[index].start == old[i].start) {
+            memcpy(conn->partitions[index].stmt, old[i].stmt, sizeof(old[i].stmt));
+        } else {
+            db_partition_finalize(&old[i]);
+        }
+    }
+    free(old);
+    conn->last_partition = 0;
+    conn->schema_version = version;
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// index of the partition 'ts' belongs to, the partition is created if it does not exist yet. -1 if an error occurs
+static int db_partition_for(DBCONN *conn, sensor_ts_t ts) {
+    int index = conn->last_partition;
+    if (index < conn->partition_count && conn->partitions[index].start <= ts &&
+        ts - conn->partitions[index].start < DB_PARTITION_SECONDS) {
+        return index;
+    }
+    sensor_ts_t start = partition_start(ts);
+    index = db_partition_search(conn, ts);
+    if (index == conn->partition_count || conn->partitions[index].start != start) {
+        char name[64], sql[512];
+        db_partition_name(name, sizeof(name), start);
+        if (conn->compact) {
+            snprintf(sql, sizeof(sql), DB_CREATE_COMPACT_PARTITION, name);
+        } else if (conn->defer_index) {
+            snprintf(sql, sizeof(sql), DB_CREATE_PARTITION, name);
+        } else {
+            snprintf(sql, sizeof(sql), DB_CREATE_PARTITION DB_CREATE_PARTITION_INDEX, name, (long long) start, name);
+        }
+        char *err_msg = 0;
+        if (sqlite3_exec(conn->db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+            log_event("Error creating partition %s: %s\n", name, err_msg);
+            sqlite3_free(err_msg);
+            return -1;
+        }
+        db_partition_add(conn, index, start, conn->compact);
+    }
+    conn->last_partition = index;
+    return index;
+}
+
+// the 'kind' statement of a partition, prepared on first use
+static sqlite3_stmt *db_partition_stmt(DBCONN *conn, int index, db_part_stmt_t kind) {
+    db_partition_t *partition = &conn->partitions[index];
+    if (partition->stmt[kind] == NULL) {
+        char name[64], sql[512];
+        db_partition_name(name, sizeof(name), partition->start);
+        snprintf(sql, sizeof(sql), db_part_stmt_sql[partition->compact][kind], name);
+        if (sqlite3_prepare_v3(conn->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &partition->stmt[kind], NULL) != SQLITE_OK) {
+            log_event("Statement prepare error: %s\n", sqlite3_errmsg(conn->db));
+            return NULL;
+        }
+    }
+    return partition->stmt[kind];
+}
+
+// binds the fields of 'args' to the named parameters the statement has
+static void db_bind_args(sqlite3_stmt *stmt, const db_args_t *args) {
+    int i;
+    if ((i = sqlite3_bind_parameter_index(stmt, ":id")) > 0) sqlite3_bind_int(stmt, i, args->id);
+    if ((i = sqlite3_bind_parameter_index(stmt, ":value")) > 0) sqlite3_bind_double(stmt, i, args->value);
+    if ((i = sqlite3_bind_parameter_index(stmt, ":ts")) > 0) sqlite3_bind_int64(stmt, i, args->ts);
+    if ((i = sqlite3_bind_parameter_index(stmt, ":from")) > 0) sqlite3_bind_int64(stmt, i, args->from);
+    if ((i = sqlite3_bind_parameter_index(stmt, ":to")) > 0) sqlite3_bind_int64(stmt, i, args->to);
+    if ((i = sqlite3_bind_parameter_index(stmt, ":limit")) > 0) sqlite3_bind_int(stmt, i, args->limit);
+}
+
+// start of the DB_BLOCK_SECONDS period a timestamp belongs to
+static sensor_ts_t db_block_period(sensor_ts_t ts) {
+    sensor_ts_t offset = ts % DB_BLOCK_PERIOD;
+    if (offset < 0) offset += DB_BLOCK_PERIOD;
+    return ts - offset;
+}
+
+// writes an open block to its row, the row is inserted the first time or if it disappeared (rolled back, expired)
+// The row of a block that is not 'closing' ends with its period, so only the count and the data change as long as
+// no late reading moves its start, the last write of a block sets the end to its newest reading
+static int db_store_block(DBCONN *conn, db_open_block_t *open, int closing) {
+    sqlite3_stmt *stmt;
+    int rc = SQLITE_DONE;
+    sensor_ts_t end = closing ? open->last : open->period + DB_BLOCK_PERIOD - 1;
+    if (open->rowid != 0 && !closing && !open->moved) {
+        stmt = conn->stmt[STMT_UPDATE_BLOCK_DATA];
+        sqlite3_bind_int(stmt, 1, open->block.count);
+        sqlite3_bind_blob(stmt, 2, open->block.data, (int) gorilla_size(&open->block), SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, open->rowid);
+        sqlite3_bind_int(stmt, 4, open->id);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc == SQLITE_DONE && sqlite3_changes(conn->db) == 0) open->rowid = 0;
+    } else if (open->rowid != 0) {
+        stmt = conn->stmt[STMT_UPDATE_BLOCK];
+        sqlite3_bind_int64(stmt, 1, open->first);
+        sqlite3_bind_int64(stmt, 2, end);
+        sqlite3_bind_int(stmt, 3, open->block.count);
+        sqlite3_bind_blob(stmt, 4, open->block.data, (int) gorilla_size(&open->block), SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 5, open->rowid);
+        sqlite3_bind_int(stmt, 6, open->id);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc == SQLITE_DONE && sqlite3_changes(conn->db) == 0) open->rowid = 0;
+    }
+    if (rc == SQLITE_DONE && open->rowid == 0) {
+        stmt = conn->stmt[STMT_INSERT_BLOCK];
+        sqlite3_bind_int(stmt, 1, open->id);
+        sqlite3_bind_int64(stmt, 2, open->first);
+        sqlite3_bind_int64(stmt, 3, end);
+        sqlite3_bind_int(stmt, 4, open->block.count);
+        sqlite3_bind_blob(stmt, 5, open->block.data, (int) gorilla_size(&open->block), SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc == SQLITE_DONE) open->rowid = sqlite3_last_insert_rowid(conn->db);
+    }
+    if (rc != SQLITE_DONE) {
+        log_event("Block write error: %s\n", sqlite3_errmsg(conn->db));
+        return rc;
+    }
+    open->dirty = 0;
+    open->moved = 0;
+    return SQLITE_OK;
+}
+
+// writes the open blocks that changed since they were last written
+static void db_store_blocks(DBCONN *conn) {
+    if (conn->blocks == NULL) return;
+    for (int i = 0; i < conn->blocks->count; i++) {
+        if (conn->blocks->open[i]->dirty) db_store_block(conn, conn->blocks->open[i], 0);
+    }
+}
+
+// writes a block for the last time and empties it for the next readings of its sensor
+static int db_close_block(DBCONN *conn, db_open_block_t *open) {
+    int rc = db_store_block(conn, open, 1);
+    if (rc != SQLITE_OK) return rc;
+    open->rowid = 0;
+    gorilla_init(&open->block);
+    return SQLITE_OK;
+}
+
+// appends a reading to the open block of its sensor. The block is closed when a reading of a later period arrives
+// or when it is full, a late reading still goes to the open block
+static int db_append_block(DBCONN *conn, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    struct db_blocks *blocks = conn->blocks;
+    db_open_block_t *open = blocks->by_id[id];
+    int rc = SQLITE_OK;
+    if (open == NULL) {
+        if (blocks->count == blocks->capacity) {
+            blocks->capacity = blocks->capacity ? blocks->capacity * 2 : 16;
+            blocks->open = realloc(blocks->open, blocks->capacity * sizeof(db_open_block_t *));
+            ERROR_HANDLER(blocks->open == NULL, "malloc() error");
+        }
+        open = malloc(sizeof(db_open_block_t));
+        ERROR_HANDLER(open == NULL, "malloc() error");
+        open->id = id;
+        open->rowid = 0;
+        open->dirty = 0;
+        open->moved = 0;
+        gorilla_init(&open->block);
+        blocks->by_id[id] = open;
+        blocks->open[blocks->count++] = open;
+    }
+    sensor_ts_t period = db_block_period(ts);
+    if (open->block.count > 0 && period > open->period) rc = db_close_block(conn, open);
+    if (rc == SQLITE_OK && gorilla_append(&open->block, ts, value) == GORILLA_FULL) {
+        rc = db_close_block(conn, open);
+        if (rc == SQLITE_OK) gorilla_append(&open->block, ts, value);   // an empty block has room
+    }
+    if (rc != SQLITE_OK) return rc;
+    if (open->block.count == 1) {
+        open->period = period;
+        open->first = open->last = ts;
+    } else {
+        if (ts < open->first) {
+            open->first = ts;
+            open->moved = 1;
+        }
+        if (ts > open->last) open->last = ts;
+    }
+    open->dirty = 1;
+    conn->pending++;
+    return SQLITE_OK;
+}
+
+// decodes the block of a (sensor_id, count, data) row, sorted by timestamp, returns the number of readings
+static int db_decode_block(sqlite3_stmt *stmt, sensor_data_t *decoded) {
+    gorilla_reader_t reader;
+    int64_t ts;
+    double value;
+    int n = 0;
+    sensor_id_t id = sqlite3_column_int(stmt, 0);
+    const void *data = sqlite3_column_blob(stmt, 2);
+    gorilla_reader_init(&reader, data, sqlite3_column_bytes(stmt, 2), sqlite3_column_int(stmt, 1));
+    while (n < GORILLA_BLOCK_READINGS && gorilla_next(&reader, &ts, &value)) {
+        // insertion sort, only late readings are out of order
+        int i = n++;
+        while (i > 0 && decoded[i - 1].ts > ts) {
+            decoded[i] = decoded[i - 1];
+            i--;
+        }
+        decoded[i].id = id;
+        decoded[i].value = value;
+        decoded[i].ts = ts;
+    }
+    return n;
+}
+
+// whether a decoded reading is a row of the db_part_stmt_t 'kind' with 'args', the sensor is matched by the SQL
+static int db_block_match(db_part_stmt_t kind, const db_args_t *args, const sensor_data_t *reading) {
+    if (reading->ts < args->from || reading->ts >= args->to) return 0;
+    if (kind == PSTMT_FIND_BY_VALUE) return reading->value == args->value;
+    if (kind == PSTMT_FIND_EXCEED_VALUE) return reading->value > args->value;
+    return 1;
+}
+
+int drop_partitions_before(DBCONN *conn, sensor_ts_t ts) {
+    int dropped = 0;
+    if (conn->cursors) {
+        log_event("Unable to drop partitions while a cursor is open.\n");
+        return -1;
+    }
+    db_refresh_partitions(conn);
+    // one savepoint, inside or outside a transaction, so dropping many partitions costs one fsync
+    sqlite3_exec(conn->db, "SAVEPOINT drop_partitions;", 0, 0, 0);
+    while (conn->partition_count > 0 && conn->partitions[0].start + DB_PARTITION_SECONDS <= ts) {
+        char name[64], sql[128];
+        char *err_msg = 0;
+        db_partition_finalize(&conn->partitions[0]);
+        db_partition_name(name, sizeof(name), conn->partitions[0].start);
+        snprintf(sql, sizeof(sql), "DROP TABLE IF EXISTS %s;", name);
+        if (sqlite3_exec(conn->db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+            log_event("Error dropping partition %s: %s\n", name, err_msg);
+            sqlite3_free(err_msg);
+            sqlite3_exec(conn->db, "ROLLBACK TO drop_partitions; RELEASE drop_partitions;", 0, 0, 0);
+            conn->schema_version = -1;
+            db_refresh_partitions(conn);
+            return -1;
+        }
+        memmove(&conn->partitions[0], &conn->partitions[1], (conn->partition_count - 1) * sizeof(db_partition_t));
+        conn->partition_count--;
+        dropped++;
+    }
+    sqlite3_stmt *stmt = conn->stmt[STMT_DROP_BLOCKS];
+    sqlite3_bind_int64(stmt, 1, ts);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        log_event("Error dropping blocks: %s\n", sqlite3_errmsg(conn->db));
+    }
+    sqlite3_reset(stmt);
+    sqlite3_exec(conn->db, "RELEASE drop_partitions;", 0, 0, 0);
+    conn->last_partition = 0;
+    return dropped;
+}
+
+// moves the rows of an unpartitioned TABLE_NAME table, from before partitioning, to the partitions
+static int db_migrate_unpartitioned(DBCONN *conn) {
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn->db, "SELECT sensor_id, sensor_value, timestamp FROM " TO_STRING(TABLE_NAME),
+                                -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return SQLITE_OK;  // no such table
+    rc = begin_transaction(conn);
+    while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        rc = insert_sensor(conn, sqlite3_column_int(stmt, 0), sqlite3_column_double(stmt, 1),
+                           sqlite3_column_int64(stmt, 2));
+    }
+    sqlite3_finalize(stmt);
+    if (rc == SQLITE_DONE) rc = sqlite3_exec(conn->db, "DROP TABLE " TO_STRING(TABLE_NAME) ";", 0, 0, 0);
+    if (rc != SQLITE_OK) {
+        log_event("Error moving %s to partitions: %s\n", TO_STRING(TABLE_NAME), sqlite3_errmsg(conn->db));
+        if (!sqlite3_get_autocommit(conn->db)) db_step(conn, STMT_ROLLBACK);
+        conn->in_transaction = 0;
+        return rc;
+    }
+    log_event("Moved %d rows of %s to partitions.\n", conn->pending, TO_STRING(TABLE_NAME));
+    rc = commit_transaction(conn);
+    // once only: give the pages of the old table back instead of leaving them on the free list
+    if (rc == SQLITE_OK) rc = sqlite3_exec(conn->db, "VACUUM;", 0, 0, 0);
+    return rc;
+}
 
 DBCONN *init_connection(char clear_up_flag) {
     DBCONN *conn;
     int rc;
 
+    conn = calloc(1, sizeof(DBCONN));
+    ERROR_HANDLER(conn == NULL, "malloc() error");
+
     // create or open the database
-    rc = sqlite3_open(TO_STRING(DB_NAME), &conn);
+    rc = sqlite3_open(TO_STRING(DB_NAME), &conn->db);
     if (rc) {
         // unable to connect to SQL server
-        log_event("Unable to connect to SQL server.");
+        log_event("Unable to connect to SQL server.\n");
+        sqlite3_close(conn->db);
+        free(conn);
         return NULL;
     } else {
-        log_event("Connected to SQL server.");
+        log_event("Connected to SQL server.\n");
+    }
+
+    // durability profile, before any table is touched so the journal mode can still change
+    db_durability_t profile = DB_DURABILITY;
+    const char *profile_name = getenv(DB_DURABILITY_ENV);
+    if (profile_name != NULL && parse_durability(profile_name, &profile) != 0) {
+        log_event("Unknown durability profile %s, using %s.\n", profile_name, durability_name(profile));
+    }
+    if (set_durability(conn, profile) != 0) {
+        log_event("Unable to set the %s durability profile.\n", durability_name(profile));
+    } else {
+        log_event("Durability profile %s.\n", durability_name(profile));
     }
 
     //create table
-    char *create_table_query = "CREATE TABLE IF NOT EXISTS " TO_STRING(
-            TABLE_NAME) " (id INTEGER PRIMARY KEY AUTOINCREMENT, sensor_id INT, sensor_value DECIMAL(4, 2), timestamp TIMESTAMP);";
-    char *clear_table_query = "DELETE FROM " TO_STRING(TABLE_NAME) ";";
-    rc = sqlite3_exec(conn, create_table_query, 0, 0, 0);
+    char *create_rollup_query = "CREATE TABLE IF NOT EXISTS " TO_STRING(
+            ROLLUP_TABLE_NAME) " (scope INT, id INT, period INT, start TIMESTAMP, count INT, sum REAL, min REAL, max REAL,"
+                               " PRIMARY KEY (scope, id, period, start));";
+    char *create_anomaly_query = "CREATE TABLE IF NOT EXISTS " TO_STRING(
+            ANOMALY_TABLE_NAME) " (id INTEGER PRIMARY KEY AUTOINCREMENT, sensor_id INT, room_id INT, kind INT,"
+                                " sensor_value REAL, score REAL, timestamp TIMESTAMP);";
+    // one row per block of one sensor, the index finds the blocks of a sensor that end after a timestamp
+    char *create_block_query = "CREATE TABLE IF NOT EXISTS " TO_STRING(
+            BLOCK_TABLE_NAME) " (id INTEGER PRIMARY KEY, sensor_id INT, block_start TIMESTAMP, block_end TIMESTAMP,"
+                              " count INT, data BLOB);"
+                              " CREATE INDEX IF NOT EXISTS " TO_STRING(BLOCK_TABLE_NAME) "_sensor_end ON "
+                              TO_STRING(BLOCK_TABLE_NAME) " (sensor_id, block_end, block_start);";
+    char *clear_table_query = "DELETE FROM " TO_STRING(ROLLUP_TABLE_NAME) "; DELETE FROM " TO_STRING(ANOMALY_TABLE_NAME) ";"
+                              " DELETE FROM " TO_STRING(BLOCK_TABLE_NAME) ";";
+    rc = sqlite3_exec(conn->db, create_rollup_query, 0, 0, 0);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(conn->db, create_anomaly_query, 0, 0, 0);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(conn->db, create_block_query, 0, 0, 0);
     if (rc != SQLITE_OK) {
-        log_event("Error creating table.");
+        log_event("Error creating table.\n");
+        db_close(conn);
+        free(conn);
         return NULL;
     } else {
-        log_event("Table created/opened.");
+        log_event("Table created/opened.\n");
     }
 
+    // prepare every statement once, they live as long as the connection
+    for (int i = 0; i < STMT_COUNT; i++) {
+        rc = sqlite3_prepare_v3(conn->db, db_stmt_sql[i], -1, SQLITE_PREPARE_PERSISTENT, &conn->stmt[i], NULL);
+        if (rc != SQLITE_OK) {
+            log_event("Statement prepare error: %s\n", sqlite3_errmsg(conn->db));
+            db_close(conn);
+            free(conn);
+            return NULL;
+        }
+    }
+
+    // the index of the open blocks is large, so it only exists when readings go to blocks. Without it the queries
+    // still decode the blocks a database may already have
+    if (DB_BLOCK_SECONDS > 0) {
+        conn->blocks = calloc(1, sizeof(struct db_blocks));
+        ERROR_HANDLER(conn->blocks == NULL, "malloc() error");
+    }
+
+    // the partition tables, the rows of a database from before partitioning are moved to them once
+    conn->schema_version = -1;
+    db_refresh_partitions(conn);
+    db_migrate_unpartitioned(conn);
+
     //clear up the table if the flag is set
     if (clear_up_flag) {
-        rc = sqlite3_exec(conn, clear_table_query, 0, 0, 0);
+        rc = sqlite3_exec(conn->db, clear_table_query, 0, 0, 0);
+        if (rc == SQLITE_OK && drop_partitions_before(conn, DB_TS_MAX) < 0) rc = SQLITE_ERROR;
         if (rc != SQLITE_OK) {
-            log_event("Error clearing up table.");
+            log_event("Error clearing up table.\n");
         } else {
-            log_event("Table cleared up.");
+            log_event("Table cleared up.\n");
         }
     }
 
     return conn;
 }
 
-void storagemgr_parse_sensor_data(DBCONN *conn, sbuffer_t **buffer) {
-    int conn_attempts = 0;
-    while (*buffer) {
-        if (conn == NULL) {
-            if (conn_attempts == 3) {
-                log_event("Unable to connect to SQL server.\n");
-                exit(EXIT_FAILURE);
+int set_durability(DBCONN *conn, db_durability_t profile) {
+    char *err_msg = 0;
+    commit_transaction(conn);
+    int rc = sqlite3_exec(conn->db, db_durability_sql[profile], 0, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        log_event("SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return rc;
+    }
+    conn->durability = profile;
+    return rc;
+}
+
+int parse_durability(const char *name, db_durability_t *profile) {
+    for (int i = DB_SAFE; i <= DB_FAST; i++) {
+        if (strcmp(name, db_durability_names[i]) == 0) {
+            *profile = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *durability_name(db_durability_t profile) {
+    return db_durability_names[profile];
+}
+
+int begin_transaction(DBCONN *conn) {
+    if (conn->in_transaction) return SQLITE_OK;
+    int rc = db_step(conn, STMT_BEGIN);
+    if (rc != SQLITE_OK) {
+        log_event("Begin transaction error: %s\n", sqlite3_errmsg(conn->db));
+        return rc;
+    }
+    conn->in_transaction = 1;
+    conn->pending = 0;
+    conn->opened_ms = db_now_ms();
+    return SQLITE_OK;
+}
+
+int commit_transaction(DBCONN *conn) {
+    if (!conn->in_transaction) return SQLITE_OK;
+    db_store_blocks(conn);
+    double start = db_now_ms();
+    int rc = db_step(conn, STMT_COMMIT);
+    if (rc != SQLITE_OK) {
+        log_event("Commit error, %d rows rolled back: %s\n", conn->pending, sqlite3_errmsg(conn->db));
+        if (!sqlite3_get_autocommit(conn->db)) db_step(conn, STMT_ROLLBACK);
+        conn->stats.failed++;
+        conn->schema_version = -1;  // partitions created in the transaction are gone again
+        db_refresh_partitions(conn);
+        // the open blocks still hold their readings, write them again with the next transaction
+        for (int i = 0; conn->blocks != NULL && i < conn->blocks->count; i++) {
+            conn->blocks->open[i]->dirty = 1;
+        }
+    } else {
+        double latency = db_now_ms() - start;
+        conn->stats.commits++;
+        conn->stats.rows += conn->pending;
+        conn->stats.total_ms += latency;
+        if (latency > conn->stats.max_ms) conn->stats.max_ms = latency;
+    }
+    conn->in_transaction = 0;
+    conn->pending = 0;
+    return rc;
+}
+
+void get_commit_stats(DBCONN *conn, storage_commit_stats_t *stats) {
+    *stats = conn->stats;
+}
+
+int set_index_deferral(DBCONN *conn, int defer) {
+    conn->defer_index = defer;
+    if (defer) return SQLITE_OK;
+    // index the partitions that were created without one, IF NOT EXISTS skips the others
+    int rc = commit_transaction(conn);
+    for (int i = 0; rc == SQLITE_OK && i < conn->partition_count; i++) {
+        if (conn->partitions[i].compact) continue;
+        char name[64], sql[256];
+        db_partition_name(name, sizeof(name), conn->partitions[i].start);
+        snprintf(sql, sizeof(sql), DB_CREATE_PARTITION_INDEX, (long long) conn->partitions[i].start, name);
+        char *err_msg = 0;
+        rc = sqlite3_exec(conn->db, sql, 0, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            log_event("Error indexing partition %s: %s\n", name, err_msg);
+            sqlite3_free(err_msg);
+        }
+    }
+    return rc;
+}
+
+// steps a bound query and hands every row to 'f' as text, the way sqlite3_exec does, then resets the statement
+// 'rows' is increased by the number of rows
+static int db_query(sqlite3_stmt *stmt, callback_t f, int *rows) {
+    int rc;
+    int columns = 0;
+    char *values[DB_MAX_COLUMNS];
+    char *names[DB_MAX_COLUMNS];
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        (*rows)++;
+        if (f == NULL) continue;
+        // the first step re-prepares the statement after a schema change, so the column names are read after it
+        if (columns == 0) {
+            columns = sqlite3_column_count(stmt);
+            if (columns > DB_MAX_COLUMNS) columns = DB_MAX_COLUMNS;
+            for (int i = 0; i < columns; i++) {
+                names[i] = (char *) sqlite3_column_name(stmt, i);
             }
-            log_event("Connection to SQL server lost.\n");
-            conn = init_connection(0);
-            conn_attempts++;
-            sleep(5);
-            continue;
         }
-        sensor_data_t sensor_data;
-        int status = sbuffer_remove(*buffer, &sensor_data);
-        if (status == SBUFFER_SUCCESS) {
-            int insert_status = insert_sensor(conn, sensor_data.id, sensor_data.value, sensor_data.ts);
-            if (insert_status != 0) {
-                log_event("Data insertion failed.\n");
-                conn_attempts++;
-                continue;
+        for (int i = 0; i < columns; i++) {
+            values[i] = (char *) sqlite3_column_text(stmt, i);
+        }
+        if (f(NULL, columns, values, names) != 0) {
+            rc = SQLITE_ABORT;
+            break;
+        }
+    }
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
+}
+
+// runs a db_part_stmt_t on the partitions that overlap [args->from, args->to), oldest first or newest first,
+// until args->limit rows were handed to 'f' (no limit if it is 0 or less)
+static int db_query_partitions(DBCONN *conn, db_part_stmt_t kind, db_args_t *args, int newest_first, callback_t f) {
+    int rc = db_refresh_partitions(conn);
+    if (rc != SQLITE_OK) return rc;
+    int limited = args->limit > 0;
+    if (!limited) args->limit = -1;
+    int first = db_partition_search(conn, args->from);
+    int last = first;
+    while (last < conn->partition_count && conn->partitions[last].start < args->to) last++;
+    for (int i = 0; i < last - first; i++) {
+        sqlite3_stmt *stmt = db_partition_stmt(conn, newest_first ? last - 1 - i : first + i, kind);
+        if (stmt == NULL) return SQLITE_ERROR;
+        db_bind_args(stmt, args);
+        int rows = 0;
+        rc = db_query(stmt, f, &rows);
+        if (rc != SQLITE_OK) break;
+        if (limited && (args->limit -= rows) <= 0) break;
+    }
+    return rc;
+}
+
+// runs a db_part_stmt_t on the blocks that overlap [args->from, args->to), oldest first or newest first, and hands
+// the matching readings to 'f' with the columns of a partition row, until args->limit rows (no limit if it is -1)
+static int db_query_blocks(DBCONN *conn, db_part_stmt_t kind, db_args_t *args, int newest_first, callback_t f) {
+    static const char *names[] = {"id", "sensor_id", "sensor_value", "timestamp"};
+    char id[8], value[32], ts[24];
+    char *values[] = {NULL, id, value, ts};
+    db_stmt_t query = STMT_FIND_BLOCKS_ALL;
+    if (kind == PSTMT_FIND_RANGE || kind == PSTMT_FIND_LATEST) {
+        query = newest_first ? STMT_FIND_BLOCKS_LATEST : STMT_FIND_BLOCKS_SENSOR;
+    }
+    sqlite3_stmt *stmt = conn->stmt[query];
+    db_bind_args(stmt, args);
+    int rc = SQLITE_OK;
+    while (args->limit != 0 && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (conn->decoded == NULL) {
+            conn->decoded = malloc(GORILLA_BLOCK_READINGS * sizeof(sensor_data_t));
+            ERROR_HANDLER(conn->decoded == NULL, "malloc() error");
+        }
+        int n = db_decode_block(stmt, conn->decoded);
+        for (int i = 0; i < n && args->limit != 0; i++) {
+            const sensor_data_t *reading = &conn->decoded[newest_first ? n - 1 - i : i];
+            if (!db_block_match(kind, args, reading)) continue;
+            if (args->limit > 0) args->limit--;
+            if (f == NULL) continue;
+            snprintf(id, sizeof(id), "%d", reading->id);
+            sqlite3_snprintf(sizeof(value), value, "%!.15g", reading->value);   // the text SQLite gives a REAL
+            snprintf(ts, sizeof(ts), "%lld", (long long) reading->ts);
+            if (f(NULL, 4, values, (char **) names) != 0) {
+                rc = SQLITE_ABORT;
+                break;
             }
         }
-        conn_attempts = 0;
+        if (rc == SQLITE_ABORT) break;
     }
+    if (args->limit == 0 || rc == SQLITE_DONE) rc = SQLITE_OK;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
+}
+
+// runs a db_part_stmt_t on the partitions and on the blocks, the blocks are taken to hold the newer readings
+static int db_query_readings(DBCONN *conn, db_part_stmt_t kind, db_args_t *args, int newest_first, callback_t f) {
+    int rc;
+    db_store_blocks(conn);  // the query sees the open blocks too
+    if (args->limit <= 0) args->limit = -1;
+    if (newest_first) {
+        rc = db_query_blocks(conn, kind, args, 1, f);
+        if (rc == SQLITE_OK && args->limit != 0) rc = db_query_partitions(conn, kind, args, 1, f);
+    } else {
+        rc = db_query_partitions(conn, kind, args, 0, f);
+        if (rc == SQLITE_OK && args->limit != 0) rc = db_query_blocks(conn, kind, args, 0, f);
+    }
+    return rc;
 }
 
 int insert_sensor(DBCONN *conn, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
     int result_code;
-    char sql[SQL_MAX_LEN];
-    sqlite3_stmt *stmt;
-    sprintf(sql, "INSERT INTO %s (sensor_id, sensor_value, timestamp) VALUES (?,?,?)", TO_STRING(TABLE_NAME));
-    result_code = sqlite3_prepare_v2(conn, sql, -1, &stmt, NULL);
-    if (result_code != SQLITE_OK) {
-        log_event("Data insertion prepare error: %s\n", sqlite3_errmsg(conn));
-        return result_code;
-    }
+    if (DB_BLOCK_SECONDS > 0) return db_append_block(conn, id, value, ts);
+    int index = db_partition_for(conn, ts);
+    sqlite3_stmt *stmt = index < 0 ? NULL : db_partition_stmt(conn, index, PSTMT_INSERT);
+    if (stmt == NULL) return SQLITE_ERROR;
     sqlite3_bind_int(stmt, 1, id);
-    sqlite3_bind_double(stmt, 2, value);
+    if (conn->partitions[index].compact) {
+        sqlite3_bind_int64(stmt, 2, llround(value * DB_VALUE_SCALE));
+    } else {
+        sqlite3_bind_double(stmt, 2, value);
+    }
     sqlite3_bind_int64(stmt, 3, ts);
     result_code = sqlite3_step(stmt);
     if (result_code != SQLITE_DONE) {
-        log_event("Data insertion execution error: %s\n", sqlite3_errmsg(conn));
+        log_event("Data insertion execution error: %s\n", sqlite3_errmsg(conn->db));
+    } else {
+        result_code = SQLITE_OK;
+        conn->pending++;
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    return result_code;
+}
+
+int insert_rollup(DBCONN *conn, const sensor_rollup_t *rollup) {
+    int result_code;
+    sqlite3_stmt *stmt = conn->stmt[STMT_INSERT_ROLLUP];
+    sqlite3_bind_int(stmt, 1, rollup->scope);
+    sqlite3_bind_int(stmt, 2, rollup->id);
+    sqlite3_bind_int64(stmt, 3, rollup->period);
+    sqlite3_bind_int64(stmt, 4, rollup->start);
+    sqlite3_bind_int64(stmt, 5, rollup->count);
+    sqlite3_bind_double(stmt, 6, rollup->sum);
+    sqlite3_bind_double(stmt, 7, rollup->min);
+    sqlite3_bind_double(stmt, 8, rollup->max);
+    result_code = sqlite3_step(stmt);
+    if (result_code != SQLITE_DONE) {
+        log_event("Rollup insertion execution error: %s\n", sqlite3_errmsg(conn->db));
+    } else {
+        result_code = SQLITE_OK;
+        conn->pending++;
+    }
+    sqlite3_reset(stmt);
+    return result_code;
+}
+
+int insert_anomaly(DBCONN *conn, const anomaly_event_t *anomaly) {
+    int result_code;
+    sqlite3_stmt *stmt = conn->stmt[STMT_INSERT_ANOMALY];
+    sqlite3_bind_int(stmt, 1, anomaly->sensor_id);
+    sqlite3_bind_int(stmt, 2, anomaly->room_id);
+    sqlite3_bind_int(stmt, 3, anomaly->kind);
+    sqlite3_bind_double(stmt, 4, anomaly->value);
+    sqlite3_bind_double(stmt, 5, anomaly->score);
+    sqlite3_bind_int64(stmt, 6, anomaly->ts);
+    result_code = sqlite3_step(stmt);
+    if (result_code != SQLITE_DONE) {
+        log_event("Anomaly insertion execution error: %s\n", sqlite3_errmsg(conn->db));
+    } else {
+        result_code = SQLITE_OK;
+        conn->pending++;
+    }
+    sqlite3_reset(stmt);
     return result_code;
 }
 
 void disconnect(DBCONN *conn) {
-    int ret = sqlite3_close(conn);
+    commit_transaction(conn);
+    db_store_blocks(conn);  // outside a transaction the open blocks were not written yet
+    int ret = db_close(conn);
     if (ret != SQLITE_OK) {
-        log_event("Error occured while disconnecting from the SQL server: %s\n", sqlite3_errmsg(conn));
+        log_event("Error occured while disconnecting from the SQL server: %s\n", sqlite3_errmsg(conn->db));
     } else {
         log_event("Disconnected from the SQL server.\n");
+        free(conn);
     }
 }
 
 int find_sensor_all(DBCONN *conn, callback_t f) {
-    int rc;
-    char *err_msg = 0;
-    char query[255];
-
-    snprintf(query, sizeof query, "SELECT * FROM %s;", TO_STRING(TABLE_NAME));
-    rc = sqlite3_exec(conn, query, f, 0, &err_msg);
+    db_args_t args = {.from = DB_TS_MIN, .to = DB_TS_MAX};
+    int rc = db_query_readings(conn, PSTMT_FIND_ALL, &args, 0, f);
     if (rc != SQLITE_OK) {
-        log_event("SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
-        return rc;
+        log_event("SQL error: %s\n", sqlite3_errmsg(conn->db));
     }
     return rc;
 }
 
 int find_sensor_by_value(DBCONN *conn, sensor_value_t value, callback_t f) {
-    char sql[200];
-    snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE sensor_value = %lf", TABLE_NAME, value);
-    return sqlite3_exec(conn, sql, f, 0, 0);
+    db_args_t args = {.value = value, .from = DB_TS_MIN, .to = DB_TS_MAX};
+    return db_query_readings(conn, PSTMT_FIND_BY_VALUE, &args, 0, f);
 }
 
 int find_sensor_exceed_value(DBCONN *conn, sensor_value_t value, callback_t f) {
-// Prepare the SQL statement
-    char sql[255];
-    snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE sensor_value > %f", TABLE_NAME, value);
-// Execute the statement
-    return sqlite3_exec(conn, sql, f, 0, 0);
+    db_args_t args = {.value = value, .from = DB_TS_MIN, .to = DB_TS_MAX};
+    return db_query_readings(conn, PSTMT_FIND_EXCEED_VALUE, &args, 0, f);
 }
 
 int find_sensor_by_timestamp(DBCONN *conn, sensor_ts_t ts, callback_t f) {
-    char sql[150];
     int rc;
-    sprintf(sql, "SELECT * FROM %s WHERE timestamp = %lu;", TABLE_NAME, ts);
-    rc = sqlite3_exec(conn, sql, f, 0, 0);
+    db_args_t args = {.ts = ts, .from = ts, .to = ts + 1};
+    rc = db_query_readings(conn, PSTMT_FIND_BY_TIMESTAMP, &args, 0, f);
 
     if (rc != SQLITE_OK) {
-        log_event("Failed to select data by timestamp. Error: %s\n", sqlite3_errmsg(conn));
+        log_event("Failed to select data by timestamp. Error: %s\n", sqlite3_errmsg(conn->db));
         return 1;
     }
     log_event("Selected data by timestamp successfully.\n");
@@ -141,19 +968,221 @@ int find_sensor_by_timestamp(DBCONN *conn, sensor_ts_t ts, callback_t f) {
 }
 
 int find_sensor_after_timestamp(DBCONN *conn, sensor_ts_t ts, callback_t f) {
-    char *zErrMsg = 0;
     int rc;
-    char sql[200];
+    db_args_t args = {.ts = ts, .from = ts + 1, .to = DB_TS_MAX};
+    rc = db_query_readings(conn, PSTMT_FIND_AFTER_TIMESTAMP, &args, 0, f);
 
-    sprintf(sql, "SELECT * FROM %s WHERE timestamp > %lu;", TABLE_NAME, (unsigned long) ts);
+    if (rc != SQLITE_OK) {
+        log_event("Error: %s\n", sqlite3_errmsg(conn->db));
+    } else {
+        log_event("SELECT operation on table %s successfully executed\n", TO_STRING(TABLE_NAME));
+    }
+    return rc;
+}
 
-    rc = sqlite3_exec(conn, sql, f, 0, &zErrMsg);
+int find_sensor_in_range(DBCONN *conn, sensor_id_t id, sensor_ts_t from, sensor_ts_t to, int limit, callback_t f) {
+    int rc;
+    db_args_t args = {.id = id, .from = from, .to = to, .limit = limit};
+    rc = db_query_readings(conn, PSTMT_FIND_RANGE, &args, 0, f);
 
     if (rc != SQLITE_OK) {
-        log_event("Error: %s\n", zErrMsg);
-        sqlite3_free(zErrMsg);
-    } else {
-        log_event("SELECT operation on table %s successfully executed\n", TABLE_NAME);
+        log_event("Error: %s\n", sqlite3_errmsg(conn->db));
+    }
+    return rc;
+}
+
+int find_sensor_latest(DBCONN *conn, sensor_id_t id, int limit, callback_t f) {
+    int rc;
+    db_args_t args = {.id = id, .from = DB_TS_MIN, .to = DB_TS_MAX, .limit = limit};
+    rc = db_query_readings(conn, PSTMT_FIND_LATEST, &args, 1, f);
+
+    if (rc != SQLITE_OK) {
+        log_event("Error: %s\n", sqlite3_errmsg(conn->db));
+    }
+    return rc;
+}
+
+// takes the 'kind' cursor statements of a connection for a cursor, unless another cursor still has them
+static int cursor_open(DBCONN *conn, db_cursor_t *cursor, db_part_stmt_t kind, sensor_id_t id, sensor_ts_t from,
+                       sensor_ts_t to) {
+    cursor->conn = NULL;
+    cursor->kind = kind;
+    cursor->id = id;
+    cursor->from = from;
+    cursor->to = to;
+    cursor->next = from;
+    cursor->stmt = NULL;
+    cursor->in_blocks = 0;
+    cursor->decoded = NULL;
+    cursor->decoded_count = cursor->decoded_next = 0;
+    cursor->done = 1;
+    if (conn->cursors & (1u << kind)) {
+        log_event("Cursor error: the statement is in use by another cursor\n");
+        return SQLITE_BUSY;
+    }
+    db_refresh_partitions(conn);    // the partitions are not re-read while a cursor is open
+    db_store_blocks(conn);
+    conn->cursors |= 1u << kind;
+    cursor->conn = conn;
+    cursor->done = 0;
+    return SQLITE_OK;
+}
+
+int cursor_open_all(DBCONN *conn, db_cursor_t *cursor, sensor_ts_t from, sensor_ts_t to) {
+    return cursor_open(conn, cursor, PSTMT_CURSOR_ALL, 0, from, to);
+}
+
+int cursor_open_sensor(DBCONN *conn, db_cursor_t *cursor, sensor_id_t id, sensor_ts_t from, sensor_ts_t to) {
+    return cursor_open(conn, cursor, PSTMT_CURSOR_SENSOR, id, from, to);
+}
+
+int cursor_next(db_cursor_t *cursor, sensor_data_t *data, int max) {
+    int n = 0;
+    DBCONN *conn = cursor->conn;
+    while (n < max && !cursor->done) {
+        if (cursor->in_blocks) {
+            // the readings of the current block, sorted like the find_* functions do, then the next block
+            if (cursor->decoded_next < cursor->decoded_count) {
+                const sensor_data_t *reading = &cursor->decoded[cursor->decoded_next++];
+                if (reading->ts >= cursor->from && reading->ts < cursor->to) data[n++] = *reading;
+                continue;
+            }
+            int rc = sqlite3_step(cursor->stmt);
+            if (rc == SQLITE_ROW) {
+                if (cursor->decoded == NULL) {
+                    cursor->decoded = malloc(GORILLA_BLOCK_READINGS * sizeof(sensor_data_t));
+                    ERROR_HANDLER(cursor->decoded == NULL, "malloc() error");
+                }
+                cursor->decoded_count = db_decode_block(cursor->stmt, cursor->decoded);
+                cursor->decoded_next = 0;
+            } else if (rc == SQLITE_DONE) {
+                cursor->done = 1;
+            } else {
+                log_event("Cursor error: %s\n", sqlite3_errmsg(conn->db));
+                cursor->done = 1;
+                return -1;
+            }
+            continue;
+        }
+        if (cursor->stmt == NULL) {
+            // move on to the next partition in the range, after the last one to the blocks
+            int index = db_partition_search(conn, cursor->next);
+            if (index == conn->partition_count || conn->partitions[index].start >= cursor->to) {
+                cursor->in_blocks = 1;
+                cursor->stmt = conn->stmt[cursor->kind == PSTMT_CURSOR_ALL ? STMT_CURSOR_BLOCKS_ALL
+                                                                           : STMT_CURSOR_BLOCKS_SENSOR];
+                db_args_t args = {.id = cursor->id, .from = cursor->from, .to = cursor->to};
+                db_bind_args(cursor->stmt, &args);
+                continue;
+            }
+            cursor->stmt = db_partition_stmt(conn, index, cursor->kind);
+            if (cursor->stmt == NULL) {
+                cursor->done = 1;
+                return -1;
+            }
+            db_args_t args = {.id = cursor->id, .from = cursor->from, .to = cursor->to};
+            db_bind_args(cursor->stmt, &args);
+            cursor->next = conn->partitions[index].start + DB_PARTITION_SECONDS;
+        }
+        int rc = sqlite3_step(cursor->stmt);
+        if (rc == SQLITE_ROW) {
+            data[n].id = sqlite3_column_int(cursor->stmt, 0);
+            data[n].value = sqlite3_column_double(cursor->stmt, 1);
+            data[n].ts = sqlite3_column_int64(cursor->stmt, 2);
+            n++;
+        } else if (rc == SQLITE_DONE) {
+            // stepping again would restart the query
+            sqlite3_reset(cursor->stmt);
+            sqlite3_clear_bindings(cursor->stmt);
+            cursor->stmt = NULL;
+        } else {
+            log_event("Cursor error: %s\n", sqlite3_errmsg(conn->db));
+            cursor->done = 1;
+            return -1;
+        }
+    }
+    return n;
+}
+
+void cursor_close(db_cursor_t *cursor) {
+    if (cursor->conn == NULL) return;
+    if (cursor->stmt != NULL) {
+        sqlite3_reset(cursor->stmt);
+        sqlite3_clear_bindings(cursor->stmt);
+    }
+    cursor->conn->cursors &= ~(1u << cursor->kind);
+    free(cursor->decoded);
+    cursor->decoded = NULL;
+    cursor->conn = NULL;
+    cursor->stmt = NULL;
+    cursor->done = 1;
+}
+
+int find_rollup_after_timestamp(DBCONN *conn, rollup_scope_t scope, uint16_t id, uint32_t period, sensor_ts_t ts,
+                                callback_t f) {
+    int rc;
+    sqlite3_stmt *stmt = conn->stmt[STMT_FIND_ROLLUP_AFTER_TIMESTAMP];
+    sqlite3_bind_int(stmt, 1, scope);
+    sqlite3_bind_int(stmt, 2, id);
+    sqlite3_bind_int64(stmt, 3, period);
+    sqlite3_bind_int64(stmt, 4, ts);
+    int rows = 0;
+    rc = db_query(stmt, f, &rows);
+
+    if (rc != SQLITE_OK) {
+        log_event("Error: %s\n", sqlite3_errmsg(conn->db));
     }
     return rc;
 }
+
+// the storage_backend_t of Sensor.db, thin wrappers around the functions above
+
+static void *db_backend_open(char clear_up_flag) {
+    return init_connection(clear_up_flag);
+}
+
+static void db_backend_close(void *handle) {
+    disconnect(handle);
+}
+
+static int db_backend_begin(void *handle) {
+    return begin_transaction(handle);
+}
+
+static int db_backend_insert(void *handle, const sensor_data_t *reading) {
+    return insert_sensor(handle, reading->id, reading->value, reading->ts);
+}
+
+static int db_backend_commit(void *handle) {
+    return commit_transaction(handle);
+}
+
+// a partition falls out of the window only when 'ts' reaches a new one, so the partitions and the blocks are
+// looked at once per DB_PARTITION_SECONDS
+static int db_backend_expire(void *handle, sensor_ts_t ts) {
+    DBCONN *conn = handle;
+    if (partition_start(ts) <= conn->expired) return 0;
+    int dropped = drop_partitions_before(conn, ts);
+    if (dropped >= 0) conn->expired = partition_start(ts);
+    return dropped;
+}
+
+static int db_backend_insert_rollup(void *handle, const sensor_rollup_t *rollup) {
+    return insert_rollup(handle, rollup);
+}
+
+static int db_backend_insert_anomaly(void *handle, const anomaly_event_t *anomaly) {
+    return insert_anomaly(handle, anomaly);
+}
+
+const storage_backend_t sqlite_backend = {
+        .name = "sqlite",
+        .open = db_backend_open,
+        .close = db_backend_close,
+        .begin = db_backend_begin,
+        .insert = db_backend_insert,
+        .commit = db_backend_commit,
+        .expire = db_backend_expire,
+        .insert_rollup = db_backend_insert_rollup,
+        .insert_anomaly = db_backend_insert_anomaly,
+};
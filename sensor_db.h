@@ -12,40 +12,163 @@
 #include "main.h"
 #include "errmacros.h"
 #include "config.h"
+#include "storage.h"
+#include "sensor_db_layout.h"
 
-// stringify preprocessor directives using 2-level preprocessor magic
-// this avoids using directives like -DDB_NAME=\"some_db_name\"
-#define REAL_TO_STRING(s) #s
-#define TO_STRING(s) REAL_TO_STRING(s)    //force macro-expansion on s before stringify s
+/**
+ * the durability profiles of the database, from the slowest and safest to the fastest
+ * All of them use the write-ahead log, so readers do not block the storagemgr
+ */
+typedef enum {
+    DB_SAFE,            /**< synchronous=FULL: a committed transaction survives a power loss */
+    DB_BALANCED,        /**< synchronous=NORMAL: survives a crash of the gateway, a power loss can undo the last commits */
+    DB_FAST             /**< synchronous=OFF, large cache, mmap: a power loss can undo commits or corrupt the file */
+} db_durability_t;
+
+#ifndef DB_DURABILITY
+#define DB_DURABILITY DB_SAFE               // profile used when the environment does not choose one
+#endif
+
+#define DB_DURABILITY_ENV "SENSOR_DB_DURABILITY"    // environment variable with "safe", "balanced" or "fast"
+
+#ifndef DB_FAST_CACHE_KB
+#define DB_FAST_CACHE_KB 65536              // page cache of the fast profile
+#endif
 
-#ifndef DB_NAME
-#define DB_NAME Sensor.db
+#ifndef DB_FAST_MMAP_SIZE
+#define DB_FAST_MMAP_SIZE 268435456         // bytes of the database file the fast profile maps into memory
 #endif
 
-#ifndef TABLE_NAME
-#define TABLE_NAME SensorData
+#ifndef DB_MAX_COLUMNS
+#define DB_MAX_COLUMNS 16    // columns a SELECT can hand to a callback_t
 #endif
 
-#define DBCONN sqlite3
+/**
+ * the statements of a connection, each one is prepared once by init_connection and reused with sqlite3_reset
+ */
+typedef enum {
+    STMT_INSERT_ROLLUP,
+    STMT_INSERT_ANOMALY,
+    STMT_FIND_ROLLUP_AFTER_TIMESTAMP,
+    STMT_BEGIN,
+    STMT_COMMIT,
+    STMT_ROLLBACK,
+    STMT_SCHEMA_VERSION,
+    STMT_LIST_PARTITIONS,
+    STMT_INSERT_BLOCK,
+    STMT_UPDATE_BLOCK,
+    STMT_UPDATE_BLOCK_DATA,
+    STMT_DROP_BLOCKS,
+    STMT_FIND_BLOCKS_ALL,
+    STMT_FIND_BLOCKS_SENSOR,
+    STMT_FIND_BLOCKS_LATEST,
+    STMT_CURSOR_BLOCKS_ALL,
+    STMT_CURSOR_BLOCKS_SENSOR,
+    STMT_COUNT
+} db_stmt_t;
+
+/**
+ * the statements on one partition table, each one is prepared the first time it is used on that partition
+ */
+typedef enum {
+    PSTMT_INSERT,
+    PSTMT_FIND_ALL,
+    PSTMT_FIND_BY_VALUE,
+    PSTMT_FIND_EXCEED_VALUE,
+    PSTMT_FIND_BY_TIMESTAMP,
+    PSTMT_FIND_AFTER_TIMESTAMP,
+    PSTMT_FIND_RANGE,
+    PSTMT_FIND_LATEST,
+    PSTMT_CURSOR_ALL,
+    PSTMT_CURSOR_SENSOR,
+    PSTMT_COUNT
+} db_part_stmt_t;
+
+/**
+ * a partition table: the readings with start <= timestamp < start + DB_PARTITION_SECONDS
+ * A compact partition is a WITHOUT ROWID table keyed on (sensor_id, timestamp) with fixed-point values, so it
+ * needs no separate index; a second reading of a sensor in the same second replaces the first
+ */
+typedef struct db_partition {
+    sensor_ts_t start;
+    int compact;                        /**< 1 for the compact layout, 0 for a rowid table with an index */
+    sqlite3_stmt *stmt[PSTMT_COUNT];    /**< NULL until the statement is first used */
+} db_partition_t;
+
+/**
+ * a connection to the database together with its prepared statements and its open transaction
+ * A connection is not thread-safe, it is used by one thread at a time
+ */
+typedef struct dbconn {
+    sqlite3 *db;
+    sqlite3_stmt *stmt[STMT_COUNT];
+    db_partition_t *partitions; /**< the partition tables, sorted by start */
+    int partition_count;
+    int partition_capacity;
+    int last_partition;         /**< the partition of the previous insert, usually also the next one's */
+    int schema_version;         /**< schema version the partitions were listed at, to notice other connections */
+    int compact;                /**< layout of new partitions: DB_COMPACT, or 1 once the database has a compact one */
+    int defer_index;            /**< 1 while new rowid partitions get no index, see set_index_deferral */
+    db_durability_t durability;
+    unsigned int cursors;       /**< bit 'kind' is set while a cursor uses the db_part_stmt_t 'kind' */
+    int in_transaction;         /**< 1 between begin_transaction and commit_transaction */
+    int pending;                /**< rows written in the open transaction */
+    double opened_ms;           /**< monotonic time the open transaction began */
+    storage_commit_stats_t stats;
+    sensor_ts_t expired;        /**< partition start the storage backend's 'expire' last dropped up to */
+    struct db_blocks *blocks;   /**< the block every sensor is filling, NULL with DB_BLOCK_SECONDS 0 */
+    sensor_data_t *decoded;     /**< one block of a find_* query, allocated when a query first reads a block */
+} dbconn_t;
+
+/**
+ * a cursor over the partition tables and then the blocks that yields typed rows, see cursor_open_all and
+ * cursor_open_sensor
+ * It borrows the prepared statements of the connection, so a connection has one cursor of each kind open at a time
+ */
+typedef struct db_cursor {
+    struct dbconn *conn;        /**< the connection that lends the statements */
+    db_part_stmt_t kind;        /**< PSTMT_CURSOR_ALL or PSTMT_CURSOR_SENSOR */
+    sensor_id_t id;
+    sensor_ts_t from;           /**< the range, from inclusive and to exclusive */
+    sensor_ts_t to;
+    sensor_ts_t next;           /**< the partitions that end after 'next' are still to be read */
+    sqlite3_stmt *stmt;         /**< the statement of the partition being read, NULL between partitions */
+    int in_blocks;              /**< 1 once the partitions are read and 'stmt' reads the blocks */
+    sensor_data_t *decoded;     /**< the block of the current 'stmt' row sorted by timestamp, allocated for the first */
+    int decoded_count;          /**< readings in 'decoded' */
+    int decoded_next;           /**< the next of them to return */
+    int done;                   /**< 1 after the last row */
+} db_cursor_t;
+
+#define DBCONN dbconn_t
 
 typedef int (*callback_t)(void *, int, char **, char **);
 
 /**
  * Make a connection to the database server
- * Create (open) a database with name DB_NAME having 1 table named TABLE_NAME  
+ * Create (open) a database with name DB_NAME, the measurements go to one TABLE_NAME_<start> table per
+ * DB_PARTITION_SECONDS, created on the first insert. The rows of an unpartitioned TABLE_NAME table are moved to
+ * the partitions. With DB_BLOCK_SECONDS > 0 new readings go to compressed blocks in BLOCK_TABLE_NAME instead
+ * All statements of the connection are prepared here, so inserts and queries only bind and step
+ * The durability profile is taken from the environment variable DB_DURABILITY_ENV, or DB_DURABILITY if it is not set
  * \param clear_up_flag if the table existed, clear up the existing data when clear_up_flag is set to 1
  * \return the connection for success, NULL if an error occurs
  */
 DBCONN *init_connection(char clear_up_flag);
 
 /**
- * Disconnect from the database server
+ * Disconnect from the database server, finalize the prepared statements and free the connection
+ * An open transaction is committed first
  * \param conn pointer to the current connection
  */
 void disconnect(DBCONN *conn);
 
 /**
  * Write an INSERT query to insert a single sensor measurement
+ * In a compact partition the value is rounded to 1 / DB_VALUE_SCALE
+ * With DB_BLOCK_SECONDS > 0 the reading is appended to the sensor's open block instead, which is stored (again)
+ * when it is closed, at every commit_transaction, before a query and at disconnect. Until it is closed its row
+ * ends with the period, so those writes leave the index alone
  * \param conn pointer to the current connection
  * \param id the sensor id
  * \param value the measurement value
@@ -54,11 +177,95 @@ void disconnect(DBCONN *conn);
  */
 int insert_sensor(DBCONN *conn, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
 
-/*
- * Reads continiously all data from the shared buffer data structure and stores this into the database
- * When *buffer becomes NULL the method finishes. This method will NOT automatically disconnect from the db
+/**
+ * Adds a closed rollup bucket to the table ROLLUP_TABLE_NAME
+ * If the table already has a bucket with the same scope, id, period and start (a partial room bucket of
+ * another datamgr worker, or a bucket written before a restart) the two are merged into one row
+ * \param conn pointer to the current connection
+ * \param rollup the closed bucket
+ * \return zero for success, and non-zero if an error occurs
+ */
+int insert_rollup(DBCONN *conn, const sensor_rollup_t *rollup);
+
+/**
+ * Write an INSERT query to store an anomaly found by the datamgr in the table ANOMALY_TABLE_NAME
+ * \param conn pointer to the current connection
+ * \param anomaly the anomaly
+ * \return zero for success, and non-zero if an error occurs
+ */
+int insert_anomaly(DBCONN *conn, const anomaly_event_t *anomaly);
+
+/**
+ * Returns the start of the partition a timestamp belongs to
+ * \param ts the timestamp
+ * \return the largest multiple of DB_PARTITION_SECONDS that is not after 'ts'
+ */
+sensor_ts_t partition_start(sensor_ts_t ts);
+
+/**
+ * Drops the partitions that only hold readings older than 'ts', the other partitions are not touched
+ * The blocks that only hold readings older than 'ts' are deleted as well
+ * Fails while a cursor of the connection is open
+ * \param conn pointer to the current connection
+ * \param ts the oldest timestamp to keep
+ * \return the number of partitions dropped, -1 if an error occurs
+ */
+int drop_partitions_before(DBCONN *conn, sensor_ts_t ts);
+
+/**
+ * Switches the connection to a durability profile, an open transaction is committed first
+ * \param conn pointer to the current connection
+ * \param profile the durability profile
+ * \return zero for success, and non-zero if an error occurs
+ */
+int set_durability(DBCONN *conn, db_durability_t profile);
+
+/**
+ * Looks up a durability profile by name
+ * \param name "safe", "balanced" or "fast"
+ * \param profile filled out with the profile
+ * \return zero for success, and non-zero if the name is unknown
+ */
+int parse_durability(const char *name, db_durability_t *profile);
+
+/**
+ * Returns the name of a durability profile, for log messages
+ * \param profile the durability profile
+ * \return "safe", "balanced" or "fast"
+ */
+const char *durability_name(db_durability_t profile);
+
+/**
+ * Starts a transaction, the rows written until commit_transaction are made durable with one fsync
+ * Nothing happens if a transaction is already open
+ * \param conn pointer to the current connection
+ * \return zero for success, and non-zero if an error occurs
  */
-void storagemgr_parse_sensor_data(DBCONN *conn, sbuffer_t **buffer);
+int begin_transaction(DBCONN *conn);
+
+/**
+ * Commits the open transaction and adds its latency to the connection's commit stats
+ * If the COMMIT fails the transaction is rolled back, so its rows are lost. Nothing happens without a transaction
+ * \param conn pointer to the current connection
+ * \return zero for success, and non-zero if an error occurs
+ */
+int commit_transaction(DBCONN *conn);
+
+/**
+ * Lets a bulk load create new partitions without their index, which is cheaper to build once at the end than to
+ * update with every row. The queries still work meanwhile, they scan the partitions without an index
+ * \param conn pointer to the current connection
+ * \param defer 1 to defer, 0 to commit the open transaction and create the missing indexes
+ * \return zero for success, and non-zero if an error occurs
+ */
+int set_index_deferral(DBCONN *conn, int defer);
+
+/**
+ * Copies the commit stats of a connection, from the thread that uses it
+ * \param conn pointer to the current connection
+ * \param stats filled out with the commit counters
+ */
+void get_commit_stats(DBCONN *conn, storage_commit_stats_t *stats);
 
 /**
   * Write a SELECT query to select all sensor measurements in the table 
@@ -109,4 +316,84 @@ int find_sensor_by_timestamp(DBCONN *conn, sensor_ts_t ts, callback_t f);
  */
 int find_sensor_after_timestamp(DBCONN *conn, sensor_ts_t ts, callback_t f);
 
+/**
+ * Returns the measurements of one sensor with from <= timestamp < to, oldest first
+ * The query only visits the partitions that overlap the range, and in each of them it is answered from the
+ * (sensor_id, timestamp, sensor_value) index, so it reads only the matching rows
+ * The callback function is applied to every row in the result
+ * \param conn pointer to the current connection
+ * \param id the sensor id
+ * \param from the start of the range, inclusive
+ * \param to the end of the range, exclusive
+ * \param limit the maximum number of rows, 0 or less for no limit
+ * \param f function pointer to the callback method that will handle the result set
+ * \return zero for success, and non-zero if an error occurs
+ */
+int find_sensor_in_range(DBCONN *conn, sensor_id_t id, sensor_ts_t from, sensor_ts_t to, int limit, callback_t f);
+
+/**
+ * Returns the newest measurements of one sensor, newest first, from the same index as find_sensor_in_range
+ * The callback function is applied to every row in the result
+ * \param conn pointer to the current connection
+ * \param id the sensor id
+ * \param limit the maximum number of rows, 0 or less for no limit
+ * \param f function pointer to the callback method that will handle the result set
+ * \return zero for success, and non-zero if an error occurs
+ */
+int find_sensor_latest(DBCONN *conn, sensor_id_t id, int limit, callback_t f);
+
+/**
+ * Opens a cursor over all measurements with from <= timestamp < to, partition by partition and within a partition
+ * in insertion order
+ * Readings stored in blocks follow the rows of the partitions, block by block and sorted by timestamp within a block
+ * \param conn pointer to the current connection
+ * \param cursor the cursor to open
+ * \param from the start of the range, inclusive
+ * \param to the end of the range, exclusive
+ * \return zero for success, and non-zero if an error occurs or a cursor of this kind is already open
+ */
+int cursor_open_all(DBCONN *conn, db_cursor_t *cursor, sensor_ts_t from, sensor_ts_t to);
+
+/**
+ * Opens a cursor over the measurements of one sensor with from <= timestamp < to, oldest first, using the index
+ * Readings stored in blocks follow the rows of the partitions, block by block in the order the blocks end and
+ * sorted by timestamp within a block, as the find_* functions return them
+ * \param conn pointer to the current connection
+ * \param cursor the cursor to open
+ * \param id the sensor id
+ * \param from the start of the range, inclusive
+ * \param to the end of the range, exclusive
+ * \return zero for success, and non-zero if an error occurs or a cursor of this kind is already open
+ */
+int cursor_open_sensor(DBCONN *conn, db_cursor_t *cursor, sensor_id_t id, sensor_ts_t from, sensor_ts_t to);
+
+/**
+ * Copies the next rows of a cursor into 'data', the values are read as numbers without a conversion to text
+ * \param cursor an open cursor
+ * \param data pre-allocated space for at least 'max' sensor_data_t
+ * \param max the maximum number of rows
+ * \return the number of rows copied, 0 after the last row and -1 if an error occurs
+ */
+int cursor_next(db_cursor_t *cursor, sensor_data_t *data, int max);
+
+/**
+ * Closes a cursor and gives its statement back to the connection, also before the last row was read
+ * \param cursor the cursor to close
+ */
+void cursor_close(db_cursor_t *cursor);
+
+/**
+ * Write a SELECT query to return the rollup buckets of one sensor or room that start at or after timestamp 'ts'
+ * The callback function is applied to every row in the result, ordered by start
+ * \param conn pointer to the current connection
+ * \param scope ROLLUP_SENSOR or ROLLUP_ROOM
+ * \param id the sensor id or room id
+ * \param period the bucket length in seconds, one of DATAMGR_ROLLUP_PERIODS
+ * \param ts the timestamp to be queried
+ * \param f function pointer to the callback method that will handle the result set
+ * \return zero for success, and non-zero if an error occurs
+ */
+int find_rollup_after_timestamp(DBCONN *conn, rollup_scope_t scope, uint16_t id, uint32_t period, sensor_ts_t ts,
+                                callback_t f);
+
 #endif /* _SENSOR_DB_H_ */
@@ -0,0 +1,54 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _SENSOR_DB_LAYOUT_H_
+#define _SENSOR_DB_LAYOUT_H_
+
+/*
+ * The names and the layout of the tables in the sensor database, shared by sensor_db.c and the standalone tools
+ * that open the database without the rest of the gateway, like db_compact
+ */
+
+// stringify preprocessor directives using 2-level preprocessor magic
+// this avoids using directives like -DDB_NAME=\"some_db_name\"
+#define REAL_TO_STRING(s) #s
+#define TO_STRING(s) REAL_TO_STRING(s)    //force macro-expansion on s before stringify s
+
+#ifndef DB_NAME
+#define DB_NAME Sensor.db
+#endif
+
+#ifndef TABLE_NAME
+#define TABLE_NAME SensorData       // prefix of the partition tables, TABLE_NAME_<start of the partition>
+#endif
+
+#ifndef DB_PARTITION_SECONDS
+#define DB_PARTITION_SECONDS 86400  // the readings of one day share a partition table
+#endif
+
+#ifndef DB_COMPACT
+#define DB_COMPACT 0                // 1: new partitions use the compact WITHOUT ROWID layout
+#endif
+
+#ifndef DB_VALUE_SCALE
+#define DB_VALUE_SCALE 100          // compact partitions store round(value * DB_VALUE_SCALE) as an integer
+#endif
+
+#ifndef DB_BLOCK_SECONDS
+#define DB_BLOCK_SECONDS 0          // > 0: readings are stored as one compressed block per sensor per this many seconds
+#endif
+
+#ifndef BLOCK_TABLE_NAME
+#define BLOCK_TABLE_NAME SensorBlock
+#endif
+
+#ifndef ROLLUP_TABLE_NAME
+#define ROLLUP_TABLE_NAME SensorRollup
+#endif
+
+#ifndef ANOMALY_TABLE_NAME
+#define ANOMALY_TABLE_NAME SensorAnomaly
+#endif
+
+#endif  //_SENSOR_DB_LAYOUT_H_
@@ -0,0 +1,163 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sensor_map.h"
+
+// reads a whole stream that cannot be mapped (pipe, in-memory FILE) into a malloc'ed buffer
+static char *sensor_map_slurp(FILE *fp, size_t *size) {
+    size_t capacity = 1 << 16, length = 0, n;
+    char *data = malloc(capacity);
+    if (data == NULL) return NULL;
+    while ((n = fread(data + length, 1, capacity - length, fp)) > 0) {
+        length += n;
+        if (length == capacity) {
+            char *bigger = realloc(data, capacity * 2);
+            if (bigger == NULL) {
+                free(data);
+                return NULL;
+            }
+            data = bigger;
+            capacity *= 2;
+        }
+    }
+    *size = length;
+    return data;
+}
+
+static inline const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+// parses an unsigned decimal that fits in 16 bits, returns NULL if there is none
+static inline const char *parse_u16(const char *p, const char *end, uint16_t *value) {
+    uint32_t v = 0;
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p - '0');
+        if (v > UINT16_MAX) return NULL;
+        p++;
+    }
+    if (p == start) return NULL;
+    *value = (uint16_t) v;
+    return p;
+}
+
+// prints a parse error, after SENSOR_MAP_MAX_REPORTS errors the rest is only counted
+static void sensor_map_report(sensor_map_t *map, const char *format, ...) {
+    va_list args;
+    int errors = map->malformed_lines + map->duplicate_ids;
+    if (errors == SENSOR_MAP_MAX_REPORTS + 1) {
+        fprintf(stderr, "sensor map: too many errors, no longer reporting them\n");
+    }
+    if (errors > SENSOR_MAP_MAX_REPORTS) return;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+// one pass over the whole file: parse, validate and fill the table
+static void sensor_map_parse(sensor_map_t *map, const char *p, const char *end) {
+    unsigned long line_number = 0;
+    uint32_t *first_line = calloc(SENSOR_MAP_IDS, sizeof(uint32_t));   // for duplicate reports only
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) eol = end;
+        line_number++;
+
+        uint16_t first, second, sensor_id, room_id;
+        const char *q = skip_blanks(p, eol);
+        if (q == eol || *q == '#') {
+            p = eol + 1;
+            continue;
+        }
+        q = parse_u16(q, eol, &first);
+        if (q != NULL) {
+            const char *sep = skip_blanks(q, eol);
+            if (sep < eol && *sep == ',') {
+                // "sensor_id,room_id" as used by the gateway
+                q = parse_u16(skip_blanks(sep + 1, eol), eol, &second);
+                sensor_id = first;
+                room_id = second;
+            } else if (sep > q) {
+                // "room_id sensor_id" as written by file_creator
+                q = parse_u16(sep, eol, &second);
+                room_id = first;
+                sensor_id = second;
+            } else {
+                q = NULL;
+            }
+        }
+        if (q == NULL || skip_blanks(q, eol) != eol) {
+            map->malformed_lines++;
+            sensor_map_report(map, "sensor map line %lu: malformed, expected 'sensor,room' or 'room sensor'\n",
+                              line_number);
+        } else if (map->present[sensor_id]) {
+            map->duplicate_ids++;
+            sensor_map_report(map, "sensor map line %lu: duplicate sensor id %u, first mapped on line %lu\n",
+                              line_number, (unsigned int) sensor_id,
+                              first_line ? (unsigned long) first_line[sensor_id] : 0UL);
+        } else {
+            map->room_id[sensor_id] = room_id;
+            map->present[sensor_id] = 1;
+            map->total_sensors++;
+            if (first_line) first_line[sensor_id] = (uint32_t) line_number;
+        }
+        p = eol + 1;
+    }
+    free(first_line);
+}
+
+int sensor_map_load(sensor_map_t **map, FILE *fp) {
+    struct stat st;
+    char *data = NULL;
+    size_t size = 0;
+    int mapped = 0;
+
+    if (map == NULL || fp == NULL) return SENSOR_MAP_FAILURE;
+    *map = calloc(1, sizeof(sensor_map_t));
+    if (*map == NULL) return SENSOR_MAP_FAILURE;
+
+    int fd = fileno(fp);
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        size = st.st_size;
+        if (size == 0) return SENSOR_MAP_SUCCESS;
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        } else {
+            madvise(data, size, MADV_SEQUENTIAL);
+            mapped = 1;
+        }
+    }
+    if (data == NULL) {
+        data = sensor_map_slurp(fp, &size);
+        if (data == NULL) {
+            sensor_map_free(map);
+            return SENSOR_MAP_FAILURE;
+        }
+    }
+
+    sensor_map_parse(*map, data, data + size);
+
+    if (mapped) munmap(data, size);
+    else free(data);
+    return SENSOR_MAP_SUCCESS;
+}
+
+void sensor_map_free(sensor_map_t **map) {
+    if (map == NULL || *map == NULL) return;
+    free(*map);
+    *map = NULL;
+}
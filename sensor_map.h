@@ -0,0 +1,51 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _SENSOR_MAP_H_
+#define _SENSOR_MAP_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "config.h"
+
+#define SENSOR_MAP_IDS (UINT16_MAX + 1)
+
+#ifndef SENSOR_MAP_MAX_REPORTS
+#define SENSOR_MAP_MAX_REPORTS 20   // parse errors printed per load, the rest is only counted
+#endif
+
+#define SENSOR_MAP_SUCCESS 0
+#define SENSOR_MAP_FAILURE -1
+
+/**
+ * the sensor to room table read from room_sensor.map, indexed by sensor id
+ * A loaded map is never modified, a reload builds a new one
+ */
+typedef struct sensor_map {
+    uint16_t room_id[SENSOR_MAP_IDS];   /**< room of every mapped sensor */
+    uint8_t present[SENSOR_MAP_IDS];    /**< non-zero if the sensor id appears in the map */
+    int total_sensors;                  /**< number of mapped sensors */
+    int malformed_lines;                /**< lines that were skipped because they could not be parsed */
+    int duplicate_ids;                  /**< lines that were skipped because their sensor id was already mapped */
+} sensor_map_t;
+
+/**
+ * Reads a sensor map in one pass over the memory-mapped file (streams that cannot be mapped are read first)
+ * Every line holds either "sensor_id,room_id" or "room_id sensor_id" (the format written by file_creator),
+ * empty lines and lines starting with '#' are skipped
+ * Malformed lines and duplicate sensor ids are reported on stderr with their line number, counted and skipped:
+ * if a sensor id appears more than once the first line wins
+ * \param map a double pointer that will point to the new map
+ * \param fp the sensor map file
+ * \return SENSOR_MAP_SUCCESS on success and SENSOR_MAP_FAILURE if an error occurred
+ */
+int sensor_map_load(sensor_map_t **map, FILE *fp);
+
+/**
+ * Frees a sensor map
+ * \param map a double pointer to the map, set to NULL
+ */
+void sensor_map_free(sensor_map_t **map);
+
+#endif  //_SENSOR_MAP_H_
@@ -0,0 +1,54 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include <stdatomic.h>
+
+/**
+ * a sequence counter for data with a single writer and many readers
+ * The writer never waits: it makes the counter odd while it updates and even again when it is done
+ * Readers never block the writer: they copy the data and retry when the counter moved while copying
+ */
+typedef atomic_uint seqlock_t;
+
+static inline void seqlock_init(seqlock_t *lock) {
+    atomic_init(lock, 0);
+}
+
+/**
+ * Starts an update, only one thread may write the data protected by 'lock'
+ */
+static inline void seqlock_write_begin(seqlock_t *lock) {
+    atomic_store_explicit(lock, atomic_load_explicit(lock, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * Ends an update started with seqlock_write_begin() and publishes the new data
+ */
+static inline void seqlock_write_end(seqlock_t *lock) {
+    atomic_store_explicit(lock, atomic_load_explicit(lock, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/**
+ * Starts a read, waits (without taking a lock) while an update is in progress
+ * \return the sequence number to pass to seqlock_read_retry()
+ */
+static inline unsigned int seqlock_read_begin(seqlock_t *lock) {
+    unsigned int seq;
+    while ((seq = atomic_load_explicit(lock, memory_order_acquire)) & 1u);
+    return seq;
+}
+
+/**
+ * \return non-zero if the data was modified since seqlock_read_begin() returned 'seq' and the read must be repeated
+ */
+static inline int seqlock_read_retry(seqlock_t *lock, unsigned int seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(lock, memory_order_relaxed) != seq;
+}
+
+#endif  //_SEQLOCK_H_
@@ -0,0 +1,271 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#define _GNU_SOURCE     // needed for clock_gettime with -std=c11
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "main.h"
+#include "storage.h"
+#include "bqueue.h"
+
+#define STORAGEMGR_POP_BATCHES 8    // batches the writer takes off the queue at once
+
+// one block of readings on its way from the drain stage to the writer thread
+typedef struct storagemgr_batch {
+    int count;
+    sensor_data_t readings[STORAGEMGR_BATCH_SIZE];
+} storagemgr_batch_t;
+
+// the group commit of the writer thread, kept here so every backend is committed the same way
+typedef struct storagemgr_txn {
+    int in_transaction;         // 1 between storagemgr_begin and storagemgr_commit
+    int pending;                // rows written in the open transaction
+    double opened_ms;           // monotonic time the open transaction began
+    storage_commit_stats_t stats;
+} storagemgr_txn_t;
+
+static bqueue_t *write_queue = NULL;        // drain stage -> writer thread, NULL while the storagemgr is stopped
+static storagemgr_stats_t writer_stats;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;    // protects writer_stats and write_queue
+
+static const storage_backend_t *storage_backends[] = {&sqlite_backend, &segment_backend};
+
+// milliseconds on the monotonic clock
+static double storage_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+const storage_backend_t *storage_find(const char *name) {
+    for (size_t i = 0; i < sizeof(storage_backends) / sizeof(storage_backends[0]); i++) {
+        if (strcmp(name, storage_backends[i]->name) == 0) return storage_backends[i];
+    }
+    return NULL;
+}
+
+int storage_open(storage_t *storage, char clear_up_flag) {
+    const char *name = getenv(STORAGE_BACKEND_ENV);
+    if (name == NULL) name = STORAGE_BACKEND;
+    storage->backend = storage_find(name);
+    storage->handle = NULL;
+    if (storage->backend == NULL) {
+        log_event("Unknown storage backend %s\n", name);
+        return -1;
+    }
+    storage->handle = storage->backend->open(clear_up_flag);
+    if (storage->handle == NULL) return -1;
+    log_event("Storage backend %s opened.\n", storage->backend->name);
+    return 0;
+}
+
+void storage_close(storage_t *storage) {
+    if (storage->handle == NULL) return;
+    storage->backend->close(storage->handle);
+    storage->handle = NULL;
+}
+
+static int storagemgr_begin(storage_t *storage, storagemgr_txn_t *txn) {
+    if (txn->in_transaction) return 0;
+    int rc = storage->backend->begin(storage->handle);
+    if (rc != 0) return rc;
+    txn->in_transaction = 1;
+    txn->pending = 0;
+    txn->opened_ms = storage_now_ms();
+    return 0;
+}
+
+// commits the open transaction and publishes the commit stats to storagemgr_get_stats()
+static void storagemgr_commit(storage_t *storage, storagemgr_txn_t *txn) {
+    if (!txn->in_transaction) return;
+    double start = storage_now_ms();
+    if (storage->backend->commit(storage->handle) != 0) {
+        txn->stats.failed++;
+    } else {
+        double latency = storage_now_ms() - start;
+        txn->stats.commits++;
+        txn->stats.rows += txn->pending;
+        txn->stats.total_ms += latency;
+        if (latency > txn->stats.max_ms) txn->stats.max_ms = latency;
+    }
+    txn->in_transaction = 0;
+    txn->pending = 0;
+    pthread_mutex_lock(&writer_mutex);
+    writer_stats.commits = txn->stats;
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+// writes the rollups and anomalies the datamgr has queued, returns how many it took
+// A backend that does not store them still takes them, so the datamgr's queues do not stay full
+static int storagemgr_write_datamgr(storage_t *storage, storagemgr_txn_t *txn) {
+    static int discarded = 0;
+    const storage_backend_t *backend = storage->backend;
+    sensor_rollup_t rollups[STORAGEMGR_ROLLUP_BATCH];
+    int n = datamgr_get_rollups(rollups, STORAGEMGR_ROLLUP_BATCH);
+    anomaly_event_t anomalies[STORAGEMGR_ROLLUP_BATCH];
+    int m = datamgr_get_anomalies(anomalies, STORAGEMGR_ROLLUP_BATCH);
+    if ((n > 0 && backend->insert_rollup == NULL) || (m > 0 && backend->insert_anomaly == NULL)) {
+        if (!discarded) log_event("Storage backend %s does not store rollups or anomalies.\n", backend->name);
+        discarded = 1;
+    }
+    if (n > 0 && backend->insert_rollup != NULL && storagemgr_begin(storage, txn) == 0) {
+        for (int i = 0; i < n; i++) {
+            if (backend->insert_rollup(storage->handle, &rollups[i]) != 0) {
+                log_event("Rollup insertion failed.\n");
+            }
+        }
+    }
+    if (m > 0 && backend->insert_anomaly != NULL && storagemgr_begin(storage, txn) == 0) {
+        for (int i = 0; i < m; i++) {
+            if (backend->insert_anomaly(storage->handle, &anomalies[i]) != 0) {
+                log_event("Anomaly insertion failed.\n");
+            }
+        }
+    }
+    return n + m;
+}
+
+// the writer thread: owns the backend, takes batches off write_queue and groups them into transactions
+static void *storagemgr_writer(void *arg) {
+    storage_t *storage = arg;
+    storagemgr_txn_t txn;
+    int conn_attempts = 0;
+    storagemgr_batch_t batches[STORAGEMGR_POP_BATCHES];
+    memset(&txn, 0, sizeof(txn));
+    while (1) {
+        if (storage->handle == NULL) {
+            if (conn_attempts == 3) {
+                log_event("Unable to open the %s storage.\n", storage->backend->name);
+                exit(EXIT_FAILURE);
+            }
+            // the new handle goes into 'storage', so storage_close() closes it once the storagemgr is done
+            log_event("Connection to the %s storage lost.\n", storage->backend->name);
+            storage->handle = storage->backend->open(0);
+            conn_attempts++;
+            sleep(5);
+            continue;
+        }
+        // wake up in time to commit the open transaction, the datamgr's rollups are polled at the same pace
+        int timeout_ms = STORAGEMGR_COMMIT_MS;
+        if (txn.in_transaction) {
+            timeout_ms = (int) (txn.opened_ms + STORAGEMGR_COMMIT_MS - storage_now_ms());
+            if (timeout_ms < 0) timeout_ms = 0;
+        }
+        int n = bqueue_pop_batch(write_queue, batches, STORAGEMGR_POP_BATCHES, timeout_ms);
+        if (n < 0) break;    // closed and drained
+        storagemgr_write_datamgr(storage, &txn);
+        // the window of timestamps that is stored, taken from the gateway clock and never from the readings
+        sensor_ts_t now = time(NULL);
+        sensor_ts_t oldest = STORAGEMGR_RETENTION > 0 ? now - STORAGEMGR_RETENTION : 1;
+        unsigned long rejected = 0, future = 0;
+        for (int b = 0; b < n; b++) {
+            if (storage->handle == NULL || storagemgr_begin(storage, &txn) != 0) {
+                log_event("Data insertion failed, %d readings lost.\n", batches[b].count);
+                // the connection is broken: close it, the next round opens a new one
+                storage_close(storage);
+                continue;
+            }
+            for (int i = 0; i < batches[b].count; i++) {
+                sensor_data_t *reading = &batches[b].readings[i];
+                if (reading->ts < oldest) {
+                    rejected++;
+                    continue;
+                }
+                // a clock far ahead only harms retention, where it could recreate expired parts or outlive the window
+                if (reading->ts > now + STORAGEMGR_MAX_FUTURE) {
+                    if (STORAGEMGR_RETENTION > 0) {
+                        rejected++;
+                        continue;
+                    }
+                    future++;
+                }
+                if (storage->backend->insert(storage->handle, reading) != 0) {
+                    log_event("Data insertion failed.\n");
+                } else {
+                    txn.pending++;
+                }
+            }
+        }
+        // group commit: one fsync for many rows, but a quiet sensor's reading still reaches the disk in time
+        if (txn.in_transaction && (txn.pending >= STORAGEMGR_COMMIT_ROWS ||
+                                   storage_now_ms() - txn.opened_ms >= STORAGEMGR_COMMIT_MS)) {
+            storagemgr_commit(storage, &txn);
+            // retention: the backend knows when its partitions or segments fall out of the window
+            if (STORAGEMGR_RETENTION > 0 && storage->handle != NULL) {
+                int dropped = storage->backend->expire(storage->handle, oldest);
+                if (dropped > 0) log_event("Dropped %d expired parts of the %s storage.\n", dropped,
+                                           storage->backend->name);
+            }
+        }
+        if (rejected > 0) log_event("Rejected %lu readings with a timestamp outside the storage window.\n", rejected);
+        if (future > 0) log_event("Stored %lu readings with a timestamp in the future.\n", future);
+        if (rejected > 0 || future > 0) {
+            pthread_mutex_lock(&writer_mutex);
+            writer_stats.rejected += rejected;
+            writer_stats.future += future;
+            pthread_mutex_unlock(&writer_mutex);
+        }
+        conn_attempts = 0;
+    }
+    if (storage->handle == NULL) return NULL;
+    // store the buckets the datamgr closed while shutting down
+    while (storagemgr_write_datamgr(storage, &txn) > 0);
+    storagemgr_commit(storage, &txn);
+
+    log_event("Storagemgr committed %lu rows in %lu transactions (%lu failed), commit latency avg %.2f ms max %.2f ms\n",
+              txn.stats.rows, txn.stats.commits, txn.stats.failed,
+              txn.stats.commits ? txn.stats.total_ms / txn.stats.commits : 0.0, txn.stats.max_ms);
+    return NULL;
+}
+
+void storagemgr_parse_sensor_data(storage_t *storage, sbuffer_t **buffer) {
+    pthread_t writer;
+    storagemgr_batch_t batch;
+    bqueue_t *queue;
+
+    ERROR_HANDLER(bqueue_init(&queue, sizeof(storagemgr_batch_t), STORAGEMGR_QUEUE_SIZE) != BQUEUE_SUCCESS,
+                  "bqueue_init() error");
+    pthread_mutex_lock(&writer_mutex);
+    write_queue = queue;
+    memset(&writer_stats, 0, sizeof(writer_stats));
+    pthread_mutex_unlock(&writer_mutex);
+    ERROR_HANDLER(pthread_create(&writer, NULL, storagemgr_writer, storage) != 0, "pthread_create() error");
+
+    // the drain stage: only moves readings from the sbuffer to the writer, it never waits for the disk
+    while (*buffer) {
+        batch.count = sbuffer_remove_batch(*buffer, batch.readings, STORAGEMGR_BATCH_SIZE);
+        if (batch.count <= 0) continue;
+        int rc = bqueue_try_push(queue, &batch);
+        if (rc == BQUEUE_FULL) {
+            // the writer is behind, wait for it instead of queueing more: new readings wait in the sbuffer
+            pthread_mutex_lock(&writer_mutex);
+            writer_stats.stalls++;
+            pthread_mutex_unlock(&writer_mutex);
+            rc = bqueue_push(queue, &batch);
+        }
+        if (rc != BQUEUE_SUCCESS) break;
+        size_t depth = bqueue_size(queue);
+        pthread_mutex_lock(&writer_mutex);
+        writer_stats.batches++;
+        if (depth > writer_stats.max_queue_depth) writer_stats.max_queue_depth = depth;
+        pthread_mutex_unlock(&writer_mutex);
+    }
+
+    bqueue_close(queue);
+    pthread_join(writer, NULL);
+    pthread_mutex_lock(&writer_mutex);
+    write_queue = NULL;
+    pthread_mutex_unlock(&writer_mutex);
+    bqueue_free(&queue);
+}
+
+void storagemgr_get_stats(storagemgr_stats_t *stats) {
+    pthread_mutex_lock(&writer_mutex);
+    *stats = writer_stats;
+    stats->queue_depth = write_queue != NULL ? bqueue_size(write_queue) : 0;
+    pthread_mutex_unlock(&writer_mutex);
+}
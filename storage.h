@@ -0,0 +1,149 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _STORAGE_H_
+#define _STORAGE_H_
+
+#include "config.h"
+#include "sbuffer.h"
+#include "anomaly.h"
+
+#ifndef STORAGEMGR_ROLLUP_BATCH
+#define STORAGEMGR_ROLLUP_BATCH 64    // rollup buckets taken from the datamgr at once
+#endif
+
+#ifndef STORAGEMGR_BATCH_SIZE
+#define STORAGEMGR_BATCH_SIZE 64      // readings taken from the sbuffer at once
+#endif
+
+#ifndef STORAGEMGR_QUEUE_SIZE
+#define STORAGEMGR_QUEUE_SIZE 64      // batches of STORAGEMGR_BATCH_SIZE readings queued for the writer thread
+#endif
+
+#ifndef STORAGEMGR_COMMIT_ROWS
+#define STORAGEMGR_COMMIT_ROWS 1000   // rows in a transaction before it is committed
+#endif
+
+#ifndef STORAGEMGR_COMMIT_MS
+#define STORAGEMGR_COMMIT_MS 200      // age in milliseconds of a transaction before it is committed
+#endif
+
+#ifndef STORAGEMGR_RETENTION
+#define STORAGEMGR_RETENTION 0        // seconds of readings to keep, older ones are dropped, 0 keeps everything
+#endif
+
+#ifndef STORAGEMGR_MAX_FUTURE
+#define STORAGEMGR_MAX_FUTURE 86400   // readings further ahead of the gateway clock (s) are rejected with retention on
+#endif
+
+#ifndef STORAGE_BACKEND
+#define STORAGE_BACKEND "sqlite"      // backend used when the environment does not choose one
+#endif
+
+#define STORAGE_BACKEND_ENV "SENSOR_STORAGE"    // environment variable with "sqlite" or "segment"
+
+/**
+ * the operations of a storage backend, 'handle' is what 'open' returned
+ * The functions return zero on success, except 'open' (NULL on failure) and 'expire'
+ * A handle is used by one thread at a time
+ * How a backend lays out its data in time (partitions, segments) is its own business: the storagemgr hands 'expire'
+ * the start of the retention window after every commit, and the backend drops what fell out of it, if anything
+ */
+typedef struct storage_backend {
+    const char *name;
+    void *(*open)(char clear_up_flag);                  /**< clear_up_flag 1 removes the stored data */
+    void (*close)(void *handle);                        /**< commits first */
+    int (*begin)(void *handle);                         /**< starts a group of inserts that is committed at once */
+    int (*insert)(void *handle, const sensor_data_t *reading);
+    int (*commit)(void *handle);                        /**< makes the inserts since 'begin' durable */
+    int (*expire)(void *handle, sensor_ts_t ts);        /**< drops readings older than 'ts', returns how many units
+                                                             (partitions, segments) it dropped or -1. Called often,
+                                                             so it returns at once while nothing can be dropped */
+    int (*insert_rollup)(void *handle, const sensor_rollup_t *rollup);     /**< NULL if rollups are not stored */
+    int (*insert_anomaly)(void *handle, const anomaly_event_t *anomaly);   /**< NULL if anomalies are not stored */
+} storage_backend_t;
+
+/**
+ * commit counters of a writer, the latencies are wall-clock time of the commit (mostly its fsync)
+ */
+typedef struct storage_commit_stats {
+    unsigned long commits;      /**< transactions committed */
+    unsigned long rows;         /**< rows written by those transactions */
+    unsigned long failed;       /**< transactions rolled back because the commit failed */
+    double total_ms;            /**< summed commit latency */
+    double max_ms;              /**< worst commit latency */
+} storage_commit_stats_t;
+
+/**
+ * an open backend
+ */
+typedef struct storage {
+    const storage_backend_t *backend;
+    void *handle;
+} storage_t;
+
+/**
+ * metrics of the storagemgr's writer thread
+ */
+typedef struct storagemgr_stats {
+    size_t queue_depth;         /**< batches waiting for the writer now */
+    size_t max_queue_depth;     /**< most batches ever waiting */
+    unsigned long batches;      /**< batches handed to the writer */
+    unsigned long stalls;       /**< times the drain stage waited because the queue was full */
+    unsigned long rejected;     /**< readings not stored because their timestamp was outside the storage window */
+    unsigned long future;       /**< readings stored without retention although they were more than
+                                     STORAGEMGR_MAX_FUTURE seconds ahead of the gateway clock */
+    storage_commit_stats_t commits; /**< commits of the writer, updated after every commit */
+} storagemgr_stats_t;
+
+extern const storage_backend_t sqlite_backend;      /**< Sensor.db, see sensor_db.h */
+extern const storage_backend_t segment_backend;     /**< columnar segment files, see segment.h */
+
+/**
+ * Looks up a backend by name
+ * \param name "sqlite" or "segment"
+ * \return the backend, NULL if there is none with that name
+ */
+const storage_backend_t *storage_find(const char *name);
+
+/**
+ * Opens the backend named by the environment variable STORAGE_BACKEND_ENV, or STORAGE_BACKEND if it is not set
+ * \param storage filled out with the backend and its handle
+ * \param clear_up_flag 1 removes the data that is already stored
+ * \return zero for success, non-zero if the name is unknown or the backend could not be opened
+ */
+int storage_open(storage_t *storage, char clear_up_flag);
+
+/**
+ * Commits and closes a backend
+ * \param storage the open backend
+ */
+void storage_close(storage_t *storage);
+
+/**
+ * Reads continiously all data from the shared buffer data structure and stores this in the backend
+ * The calling thread only drains the sbuffer into a queue of STORAGEMGR_QUEUE_SIZE batches, a writer thread that
+ * owns 'storage' writes them, together with the closed rollup buckets and the anomalies of the datamgr if the
+ * backend stores those
+ * When the writer falls behind the queue fills up and the drain waits, so a slow disk delays the readings in the
+ * sbuffer instead of growing the queue. Once the sbuffer holds SBUFFER_CAPACITY readings the connmgr waits as well
+ * If the backend cannot start a transaction its handle is closed and opened again, up to three times in a row
+ * Inserts are grouped and committed every STORAGEMGR_COMMIT_ROWS rows or STORAGEMGR_COMMIT_MS milliseconds,
+ * whichever comes first, and once more before the method finishes
+ * Retention is counted on the gateway clock: readings older than STORAGEMGR_RETENTION seconds, or more than
+ * STORAGEMGR_MAX_FUTURE seconds in the future, are rejected before they reach the backend, so a sensor with a wrong
+ * clock can neither recreate expired data nor push the retention window forward. After every commit the backend's
+ * 'expire' drops what fell out of the window. Without retention nothing expires, so readings from the future are
+ * stored and only counted
+ * When *buffer becomes NULL the queue is written out and the method finishes. This method will NOT close 'storage'
+ */
+void storagemgr_parse_sensor_data(storage_t *storage, sbuffer_t **buffer);
+
+/**
+ * Copies the queue depth and commit latency metrics of the storagemgr, from any thread
+ * \param stats filled out with the metrics
+ */
+void storagemgr_get_stats(storagemgr_stats_t *stats);
+
+#endif  //_STORAGE_H_
@@ -0,0 +1,157 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include "threshold.h"
+
+#ifndef SET_MAX_TEMP
+#error SET_MAX_TEMP not set
+#endif
+
+#ifndef SET_MIN_TEMP
+#error SET_MIN_TEMP not set
+#endif
+
+#define ID_SPACE (UINT16_MAX + 1)
+#define NO_RULE 0   // index 0 of 'rules' is the default rule
+
+struct threshold_config {
+    threshold_rule_t *rules;    // rules[0] is the default rule
+    int rule_count;
+    int rule_capacity;
+    uint16_t *room_rule;        // index into 'rules' per room id, NO_RULE if the room has no rule
+    uint16_t *sensor_rule;      // index into 'rules' per sensor id, NO_RULE if the sensor has no rule
+};
+
+static int config_add_rule(threshold_config_t *config, threshold_rule_t *rule) {
+    if (config->rule_count == UINT16_MAX) return NO_RULE;
+    if (config->rule_count == config->rule_capacity) {
+        int capacity = config->rule_capacity * 2;
+        threshold_rule_t *rules = realloc(config->rules, capacity * sizeof(threshold_rule_t));
+        if (rules == NULL) return NO_RULE;
+        config->rules = rules;
+        config->rule_capacity = capacity;
+    }
+    config->rules[config->rule_count] = *rule;
+    return config->rule_count++;
+}
+
+int threshold_config_load(threshold_config_t **config, FILE *fp) {
+    char line[256];
+    int line_number = 0;
+
+    *config = calloc(1, sizeof(threshold_config_t));
+    if (*config == NULL) return THRESHOLD_FAILURE;
+    threshold_config_t *cfg = *config;
+    cfg->rule_capacity = 16;
+    cfg->rules = malloc(cfg->rule_capacity * sizeof(threshold_rule_t));
+    cfg->room_rule = calloc(ID_SPACE, sizeof(uint16_t));
+    cfg->sensor_rule = calloc(ID_SPACE, sizeof(uint16_t));
+    if (cfg->rules == NULL || cfg->room_rule == NULL || cfg->sensor_rule == NULL) {
+        threshold_config_free(config);
+        return THRESHOLD_FAILURE;
+    }
+    cfg->rules[0] = (threshold_rule_t) {SET_MIN_TEMP, SET_MAX_TEMP, THRESHOLD_DEFAULT_HYSTERESIS,
+                                        THRESHOLD_DEFAULT_MIN_DURATION, THRESHOLD_DEFAULT_RATE_LIMIT};
+    cfg->rule_count = 1;
+
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        char scope[16];
+        unsigned int id = 0;
+        long min_duration = THRESHOLD_DEFAULT_MIN_DURATION, rate_limit = THRESHOLD_DEFAULT_RATE_LIMIT;
+        threshold_rule_t rule = {0, 0, THRESHOLD_DEFAULT_HYSTERESIS, 0, 0};
+        int offset = 0, fields;
+
+        line_number++;
+        char *text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\n' || *text == '\r' || *text == '\0') continue;
+
+        if (sscanf(text, "%15s%n", scope, &offset) != 1) continue;
+        if (strcmp(scope, "room") == 0 || strcmp(scope, "sensor") == 0) {
+            int id_offset = 0;
+            if (sscanf(text + offset, "%u%n", &id, &id_offset) != 1 || id > UINT16_MAX) {
+                fprintf(stderr, "threshold config line %d: invalid %s id\n", line_number, scope);
+                continue;
+            }
+            offset += id_offset;
+        } else if (strcmp(scope, "default") != 0) {
+            fprintf(stderr, "threshold config line %d: unknown scope '%s'\n", line_number, scope);
+            continue;
+        }
+        fields = sscanf(text + offset, "%lf %lf %lf %ld %ld", &rule.min_temp, &rule.max_temp, &rule.hysteresis,
+                        &min_duration, &rate_limit);
+        if (fields < 2 || rule.min_temp > rule.max_temp || rule.hysteresis < 0 || min_duration < 0 ||
+            rate_limit < 0) {
+            fprintf(stderr, "threshold config line %d: expected 'min max [hysteresis [min_duration [rate_limit]]]'\n",
+                    line_number);
+            continue;
+        }
+        rule.min_duration = min_duration;
+        rule.rate_limit = rate_limit;
+
+        if (strcmp(scope, "default") == 0) {
+            cfg->rules[0] = rule;
+            continue;
+        }
+        int index = config_add_rule(cfg, &rule);
+        if (index == NO_RULE) {
+            fprintf(stderr, "threshold config line %d: too many rules\n", line_number);
+            continue;
+        }
+        if (scope[0] == 'r') cfg->room_rule[id] = index;
+        else cfg->sensor_rule[id] = index;
+    }
+    return THRESHOLD_SUCCESS;
+}
+
+void threshold_config_free(threshold_config_t **config) {
+    if (config == NULL || *config == NULL) return;
+    free((*config)->rules);
+    free((*config)->room_rule);
+    free((*config)->sensor_rule);
+    free(*config);
+    *config = NULL;
+}
+
+const threshold_rule_t *threshold_resolve(const threshold_config_t *config, sensor_id_t sensor_id, uint16_t room_id) {
+    uint16_t index = config->sensor_rule[sensor_id];
+    if (index == NO_RULE) index = config->room_rule[room_id];
+    return &config->rules[index];
+}
+
+// the level 'value' puts the sensor in, taking the hysteresis band of the current level into account
+static uint8_t threshold_target(const threshold_rule_t *rule, uint8_t level, double value) {
+    if (value > rule->max_temp) return THRESHOLD_TOO_HOT;
+    if (value < rule->min_temp) return THRESHOLD_TOO_COLD;
+    if (level == THRESHOLD_TOO_HOT && value > rule->max_temp - rule->hysteresis) return THRESHOLD_TOO_HOT;
+    if (level == THRESHOLD_TOO_COLD && value < rule->min_temp + rule->hysteresis) return THRESHOLD_TOO_COLD;
+    return THRESHOLD_NORMAL;
+}
+
+int threshold_check(const threshold_rule_t *rule, threshold_state_t *state, double value, time_t ts) {
+    uint8_t target = threshold_target(rule, state->level, value);
+
+    // debounce: a new level has to hold for min_duration before it is taken over
+    if (target == state->level) {
+        state->pending = state->level;
+    } else {
+        if (target != state->pending) {
+            state->pending = target;
+            state->pending_since = ts;
+        }
+        if (ts - state->pending_since >= rule->min_duration) {
+            state->level = target;
+        }
+    }
+
+    // rate limit: a sensor that keeps flapping only reports its latest level once per rate_limit
+    if (state->level == state->reported) return 0;
+    if (state->last_alert != 0 && ts - state->last_alert < rule->rate_limit) return 0;
+    state->reported = state->level;
+    state->last_alert = ts;
+    return 1;
+}
@@ -0,0 +1,108 @@
+/**
+ * \author Mustafa Ekici
+ */
+
+#ifndef _THRESHOLD_H_
+#define _THRESHOLD_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+
+#define THRESHOLD_FILE "room_thresholds.conf"
+
+#ifndef THRESHOLD_DEFAULT_HYSTERESIS
+#define THRESHOLD_DEFAULT_HYSTERESIS 0.5    // degrees the average must move back inside the band to clear an alarm
+#endif
+
+#ifndef THRESHOLD_DEFAULT_MIN_DURATION
+#define THRESHOLD_DEFAULT_MIN_DURATION 0    // seconds a level change must last before it is reported
+#endif
+
+#ifndef THRESHOLD_DEFAULT_RATE_LIMIT
+#define THRESHOLD_DEFAULT_RATE_LIMIT 60     // minimum seconds between two alerts of the same sensor
+#endif
+
+#define THRESHOLD_SUCCESS 0
+#define THRESHOLD_FAILURE -1
+
+typedef enum {
+    THRESHOLD_NORMAL = 0,
+    THRESHOLD_TOO_COLD = 1,
+    THRESHOLD_TOO_HOT = 2
+} threshold_level_t;
+
+/**
+ * the limits that apply to one sensor
+ */
+typedef struct threshold_rule {
+    double min_temp;            /**< an average below this is too cold */
+    double max_temp;            /**< an average above this is too hot */
+    double hysteresis;          /**< band inside the limits the average must reach before an alarm clears */
+    time_t min_duration;        /**< seconds a new level must hold before it is reported */
+    time_t rate_limit;          /**< minimum seconds between two alerts of the same sensor */
+} threshold_rule_t;
+
+/**
+ * per-sensor state of the threshold check, zero-initialised means 'normal, nothing pending'
+ */
+typedef struct threshold_state {
+    uint8_t level;              /**< current level after hysteresis and debouncing */
+    uint8_t reported;           /**< last level that was sent out as an alert */
+    uint8_t pending;            /**< level waiting for min_duration to pass */
+    time_t pending_since;       /**< timestamp of the reading that started 'pending' */
+    time_t last_alert;          /**< timestamp of the last alert */
+} threshold_state_t;
+
+/**
+ * an alert as it travels from the datamgr workers to the logger
+ */
+typedef struct threshold_alert {
+    sensor_id_t sensor_id;
+    uint16_t room_id;
+    uint8_t level;              /**< the new level, THRESHOLD_NORMAL means an earlier alarm cleared */
+    double value;               /**< the running average that caused the alert */
+    sensor_ts_t ts;             /**< timestamp of the reading that caused the alert */
+} threshold_alert_t;
+
+typedef struct threshold_config threshold_config_t;
+
+/**
+ * Creates a threshold configuration
+ * Every line of 'fp' is "default|room <id>|sensor <id> min max [hysteresis [min_duration [rate_limit]]]",
+ * empty lines and lines starting with '#' are skipped. Sensor rules win over room rules, room rules over the default
+ * Without a default line the default rule is SET_MIN_TEMP/SET_MAX_TEMP with the THRESHOLD_DEFAULT_* values
+ * Malformed lines are reported on stderr with their line number and skipped
+ * \param config a double pointer that will point to the new configuration
+ * \param fp the configuration file, or NULL to only use the default rule
+ * \return THRESHOLD_SUCCESS on success and THRESHOLD_FAILURE if an error occurred
+ */
+int threshold_config_load(threshold_config_t **config, FILE *fp);
+
+/**
+ * Frees a configuration, rules resolved from it can no longer be used
+ * \param config a double pointer to the configuration, set to NULL
+ */
+void threshold_config_free(threshold_config_t **config);
+
+/**
+ * Returns the rule that applies to a sensor, in O(1)
+ * \param config the configuration
+ * \param sensor_id the sensor id
+ * \param room_id the room the sensor is mapped to
+ * \return a pointer to the rule, valid as long as the configuration
+ */
+const threshold_rule_t *threshold_resolve(const threshold_config_t *config, sensor_id_t sensor_id, uint16_t room_id);
+
+/**
+ * Feeds a new running average into the state machine of one sensor, in O(1)
+ * \param rule the rule that applies to the sensor
+ * \param state the sensor's threshold state
+ * \param value the new running average
+ * \param ts the timestamp of the reading
+ * \return non-zero if a level change must be reported, the new level is then in state->reported
+ */
+int threshold_check(const threshold_rule_t *rule, threshold_state_t *state, double value, time_t ts);
+
+#endif  //_THRESHOLD_H_